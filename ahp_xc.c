@@ -23,9 +23,20 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DECODER
+#endif
 #include "ahp_xc.h"
 
 #include "serial.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <dirent.h>
+#endif
 
 #ifndef AIRY
 #define AIRY 1.21966
@@ -33,9 +44,24 @@
 #ifndef EULER
 #define EULER 2.71828182845904523536028747135266249775724709369995
 #endif
-static int32_t xc_current_input = 0;
-static int64_t sign = 1;
-static int64_t fill = 0;
+typedef struct {
+    uint32_t rows;
+    uint64_t lag_size;
+    uint64_t *counts;
+    double *magnitude;
+    double *phase;
+} autocorrelation_cache;
+
+typedef struct {
+    autocorrelation_cache autocorrelations;
+    ahp_xc_sample *crosscorrelation;
+    uint64_t *counts;
+    double *magnitude;
+    double *phase;
+    uint32_t order;
+    uint64_t auto_lag;
+    uint64_t cross_lag;
+} decode_scratch;
 
 typedef struct  {
     ahp_xc_sample *sample;
@@ -43,10 +69,253 @@ typedef struct  {
     int32_t *indexes;
     int32_t order;
     const char *data;
+    const int64_t *values;
     double lag;
     double *lags;
+    ahp_xc_packet_planes *planes;
+    uint32_t row;
+    decode_scratch *scratch;
+    autocorrelation_cache *cache;
 } thread_argument;
 
+typedef struct {
+    int32_t field_len;
+    int32_t channel_len;
+    int32_t counts;
+    int32_t autocorrelations;
+    int32_t auto_stride;
+    int32_t crosscorrelations;
+    int32_t cross_stride;
+    int32_t auto_channels;
+    int32_t cross_channels;
+    int32_t timestamp;
+    int32_t checksum;
+    uint32_t auto_field;
+    uint32_t auto_field_stride;
+    uint32_t cross_field;
+    uint32_t cross_field_stride;
+    uint32_t nvalues;
+} packet_layout;
+
+typedef struct {
+    int32_t order;
+    uint32_t npolytopes;
+    int32_t *lines;
+    int32_t *sorted;
+    int32_t *indexes;
+    int32_t *slots;
+    uint32_t mask;
+    double *lags;
+} polytope_table;
+
+typedef struct {
+    unsigned char *lines;
+    unsigned char *baselines;
+    unsigned char *needed;
+    uint32_t nmasked;
+    uint32_t ncross;
+} subscription_mask;
+
+typedef struct {
+    uint32_t capacity;
+    int32_t owned;
+    int32_t *indexes;
+    double *lags;
+} index_slot;
+
+typedef struct {
+    uint64_t nsamples;
+    int32_t embedded;
+    int32_t reserved;
+} samples_arena;
+
+typedef struct {
+    ahp_xc_packet packet;
+    pthread_mutex_t lock;
+    uint32_t capacity;
+} packet_arena;
+
+typedef struct {
+    uint64_t sequence;
+    ahp_xc_packet *packet;
+} packet_cell;
+
+typedef struct {
+    packet_cell *cells;
+    uint64_t mask;
+    char padding0[48];
+    uint64_t head;
+    char padding1[56];
+    uint64_t tail;
+    char padding2[56];
+} packet_queue;
+
+typedef struct {
+    packet_queue ready;
+    packet_queue available;
+    ahp_xc_packet **packets;
+    char *frames;
+    uint32_t npackets;
+    uint64_t dropped;
+    int32_t running;
+    int32_t waiting;
+    int32_t initialized;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} acquisition_state;
+
+#define RECORDING_MAGIC "AHPXCREC"
+#define RECORDING_VERSION 1
+#define RECORDING_PAGE_SIZE 4096
+#define RECORDING_INDEX_INTERVAL 64
+#define RECORDING_SEGMENT_SIZE (256ULL << 20)
+
+///First page of a recording segment, records are appended after the index and count is published last
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_len;
+    char header[128];
+    uint32_t packetsize;
+    uint32_t record_size;
+    uint32_t index_interval;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t index_capacity;
+    uint64_t data_offset;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t nindex;
+} recording_header;
+
+///One entry every index_interval records, sorted by device timestamp within a segment
+typedef struct {
+    double timestamp;
+    uint64_t offset;
+} recording_index;
+
+///Prefix of each record, followed by the raw frame including its carriage return
+typedef struct {
+    double host_time;
+    double timestamp;
+} recording_record;
+
+typedef struct {
+    char *path;
+    uint64_t segment_size;
+    uint32_t segment;
+    int32_t fd;
+    char *map;
+    recording_header *header;
+    double last_timestamp;
+    uint64_t recorded;
+    int32_t running;
+} recording_state;
+
+typedef struct {
+    char **segments;
+    uint32_t nsegments;
+    uint32_t segment;
+    char *map;
+    uint64_t map_size;
+    const recording_header *header;
+    uint64_t record;
+    uint32_t offset;
+    double speed;
+    double start_time;
+    double start_clock;
+    int32_t started;
+    uint64_t replayed;
+    int32_t active;
+    int32_t finished;
+} replay_state;
+
+#define SCAN_PIPELINE_DEPTH 4
+///Packets a device and its driver may still hold when the commands of a line transition leave the host
+#define SCAN_SYNC_PACKETS 64
+
+typedef struct {
+    char *frames;
+    uint64_t *tags;
+    uint32_t nslots;
+    uint32_t frame_size;
+    uint64_t head;
+    uint64_t tail;
+    int32_t done;
+    int32_t stopped;
+    int32_t *interrupt;
+    int32_t (*decode)(const char *, uint64_t, uint64_t, void *);
+    void *context;
+    ahp_xc_context *device;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} scan_pipeline;
+
+typedef struct {
+    unsigned char buf[256];
+    uint32_t len;
+    uint32_t depth;
+} command_batch;
+
+#define REG_CAPTURE 0x1
+#define REG_INDEX 0x2
+#define REG_ORDER 0x4
+#define REG_RATE 0x8
+
+#define REG_TEST 0x3
+#define REG_LEDS 0xc
+#define REG_VOLTAGE 0x30
+#define REG_AUTO_DELAY 0x40
+#define REG_CROSS_DELAY 0x80
+
+typedef struct {
+    unsigned char test;
+    unsigned char leds;
+    unsigned char voltage;
+    uint32_t known;
+    off_t auto_delay[3];
+    off_t cross_delay[3];
+} line_registers;
+
+typedef struct {
+    line_registers *lines;
+    uint32_t known;
+    uint32_t order;
+    baud_rate rate;
+    unsigned char capture_flags;
+    int32_t capture_pending;
+    uint64_t saved;
+} register_shadow;
+
+typedef struct {
+    uint32_t next;
+    uint32_t end;
+    char padding[56];
+} job_range;
+
+typedef struct {
+    pthread_t thread;
+    ahp_xc_context *device;
+    uint32_t index;
+} pool_worker;
+
+typedef struct {
+    pool_worker *workers;
+    job_range *ranges;
+    uint32_t nworkers;
+    uint32_t njobs;
+    uint32_t pending;
+    uint64_t generation;
+    int32_t running;
+    int32_t initialized;
+    void (*job)(uint32_t, uint32_t);
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+} worker_pool;
+
 
 typedef struct {
     unsigned char buffer[0x1000000];
@@ -56,12 +325,16 @@ typedef struct {
     pthread_mutex_t mutex;
 } read_argument;
 
-typedef struct {
-    uint32_t nthreads;
+typedef struct ahp_xc_context {
+    ahp_serial_port *port;
+    worker_pool pool;
+    acquisition_state acquisition;
+    recording_state recording;
+    replay_state replay;
+    command_batch commands;
+    register_shadow shadow;
     thread_argument *autocorrelation_thread_args;
     thread_argument *crosscorrelation_thread_args;
-    pthread_t *autocorrelation_threads;
-    pthread_t *crosscorrelation_threads;
     pthread_mutex_t mutex;
     int32_t mutexes_initialized;
 
@@ -95,13 +368,75 @@ typedef struct {
     int32_t buf_allocd;
     int32_t header_allocd;
     int32_t buf_len;
+    int32_t buf_size;
+    int32_t rx_len;
     int32_t header_len;
     int32_t delaysize_len;
     unsigned char capture_flags;
     unsigned char max_lost_packets;
+    int32_t reader_thread_enabled;
+    int32_t fused_decode;
+    int32_t concurrent_scan;
+    int32_t fast_phase_magnitude;
+    int32_t lazy_phase_magnitude;
+    int32_t validate_only;
+    int64_t *values;
+    int64_t *tmp_values;
+    const char *values_frame;
+    uint32_t nvalues;
+    packet_layout layout;
+    polytope_table polytopes;
+    subscription_mask subscription;
+    decode_scratch *scratch;
+    uint32_t nscratch;
+    autocorrelation_cache auto_cache;
+    ahp_xc_packet **packet_cache;
+    uint32_t packet_cache_len;
+    uint32_t packet_cache_size;
+    pthread_mutex_t packet_cache_mutex;
+    int32_t current_input;
+    int64_t sign;
+    int64_t fill;
+    uint64_t allocations;
 } ahp_xc_device;
 
-ahp_xc_device ahp_xc;
+static ahp_xc_device xc_default_device = { .port = &ahp_serial_default_port, .packet_cache_mutex = PTHREAD_MUTEX_INITIALIZER, .sign = 1, .fill = 0 };
+
+///Device the functions called from this thread operate on
+static __thread ahp_xc_device *xc_current_device = &xc_default_device;
+
+#define ahp_xc (*xc_current_device)
+
+static ahp_xc_device *select_device(ahp_xc_device *device)
+{
+    ahp_xc_device *previous = xc_current_device;
+    xc_current_device = device;
+    serial_select_port(device->port);
+    return previous;
+}
+
+static void *xc_malloc(size_t size)
+{
+    __atomic_add_fetch(&ahp_xc.allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void *xc_calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&ahp_xc.allocations, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+static void *xc_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&ahp_xc.allocations, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+uint64_t ahp_xc_get_allocations()
+{
+    return __atomic_load_n(&ahp_xc.allocations, __ATOMIC_RELAXED);
+}
 
 static uint32_t get_npolytopes(int nlines, int32_t order)
 {
@@ -115,640 +450,2880 @@ static int32_t get_line_index(int nlines, int32_t idx, int32_t order)
 
 int32_t ahp_xc_get_line_index(int32_t idx, int32_t order)
 {
+    polytope_table *table = &ahp_xc.polytopes;
+    if(table->lines != NULL && idx >= 0 && (uint32_t)idx < table->npolytopes && order >= 0 && order < table->order)
+        return table->lines[idx*table->order+order];
     return get_line_index(ahp_xc_get_nlines(), idx, order);
 }
 
-int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order)
+static void sort_tuple(int32_t *dst, const int32_t *src, int32_t order)
+{
+    int32_t x, y;
+    for(x = 0; x < order; x++) {
+        int32_t v = src[x];
+        for(y = x; y > 0 && dst[y-1] > v; y--)
+            dst[y] = dst[y-1];
+        dst[y] = v;
+    }
+}
+
+static uint32_t hash_tuple(const int32_t *tuple, int32_t order)
+{
+    int32_t x;
+    uint32_t hash = 2166136261u;
+    for(x = 0; x < order; x++) {
+        hash ^= (uint32_t)tuple[x];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int32_t scan_crosscorrelation_index(const int32_t *lines, int32_t order)
 {
     int32_t x, y, idx;
     int32_t npolytopes = ahp_xc_get_nbaselines();
-    int* matches = (int*)malloc(sizeof(int)*npolytopes);
-    memset(matches, 0, sizeof(int)*npolytopes);
+    int32_t index = 0;
+    int32_t best_match = 0;
     for(idx = 0; idx < npolytopes; idx ++) {
+        int32_t matches = 0;
         for(x = 0; x < order; x ++) {
             for(y = 0; y < order; y ++) {
-                if(lines[x] == ahp_xc_get_line_index(idx, y))
-                    matches[idx]++;
+                if(lines[x] == get_line_index(ahp_xc_get_nlines(), idx, y))
+                    matches++;
             }
         }
-    }
-    int32_t index = 0;
-    int32_t best_match = 0;
-    for(idx = 0; idx < npolytopes; idx++) {
-        if(matches[idx] > best_match) {
-            best_match = matches[idx];
+        if(matches > best_match) {
+            best_match = matches;
             index = idx;
         }
     }
     return index;
 }
 
-uint64_t ahp_xc_max_threads(uint64_t value)
+static void free_polytopes()
 {
-    if(value>0) {
-        ahp_xc.max_threads = value;
+    polytope_table *table = &ahp_xc.polytopes;
+    free(table->lines);
+    free(table->sorted);
+    free(table->indexes);
+    free(table->slots);
+    free(table->lags);
+    memset(table, 0, sizeof(polytope_table));
+}
+
+static int32_t build_polytopes(int32_t order)
+{
+    polytope_table *table = &ahp_xc.polytopes;
+    uint32_t nlines = ahp_xc.nlines;
+    uint32_t npolytopes = nlines * (nlines - 1) / 2;
+    uint32_t idx, x, y;
+    int32_t err = -ENOMEM;
+    free_polytopes();
+    if(order < 1 || npolytopes == 0)
+        return -EINVAL;
+    uint32_t nslots = 1;
+    while(nslots < npolytopes * 2)
+        nslots <<= 1;
+    table->lines = (int32_t*)xc_malloc(sizeof(int32_t) * npolytopes * order);
+    table->sorted = (int32_t*)xc_malloc(sizeof(int32_t) * npolytopes * order);
+    table->indexes = (int32_t*)xc_malloc(sizeof(int32_t) * npolytopes);
+    table->slots = (int32_t*)xc_malloc(sizeof(int32_t) * nslots);
+    table->lags = (double*)xc_calloc(npolytopes * order, sizeof(double));
+    uint32_t *first = (uint32_t*)xc_calloc(nlines + 1, sizeof(uint32_t));
+    uint32_t *members = (uint32_t*)xc_malloc(sizeof(uint32_t) * npolytopes * order);
+    int32_t *matches = (int32_t*)xc_calloc(npolytopes, sizeof(int32_t));
+    uint32_t *touched = (uint32_t*)xc_malloc(sizeof(uint32_t) * npolytopes);
+    if(table->lines == NULL || table->sorted == NULL || table->indexes == NULL || table->slots == NULL || table->lags == NULL ||
+       first == NULL || members == NULL || matches == NULL || touched == NULL)
+        goto end;
+    for(idx = 0; idx < npolytopes; idx++) {
+        for(y = 0; y < (uint32_t)order; y++) {
+            table->lines[idx*order+y] = get_line_index(nlines, idx, y);
+            first[table->lines[idx*order+y]+1]++;
+        }
+        sort_tuple(&table->sorted[idx*order], &table->lines[idx*order], order);
     }
-    return ahp_xc.max_threads;
+    for(x = 0; x < nlines; x++)
+        first[x+1] += first[x];
+    for(idx = 0; idx < npolytopes; idx++) {
+        for(y = 0; y < (uint32_t)order; y++)
+            members[first[table->lines[idx*order+y]]++] = idx;
+    }
+    for(x = nlines; x > 0; x--)
+        first[x] = first[x-1];
+    first[0] = 0;
+    for(idx = 0; idx < npolytopes; idx++) {
+        uint32_t ntouched = 0;
+        int32_t best_match = 0;
+        int32_t index = 0;
+        for(x = 0; x < (uint32_t)order; x++) {
+            int32_t line = table->lines[idx*order+x];
+            for(y = first[line]; y < first[line+1]; y++) {
+                if(matches[members[y]]++ == 0)
+                    touched[ntouched++] = members[y];
+            }
+        }
+        for(x = 0; x < ntouched; x++) {
+            uint32_t polytope = touched[x];
+            if(matches[polytope] > best_match || (matches[polytope] == best_match && (int32_t)polytope < index)) {
+                best_match = matches[polytope];
+                index = polytope;
+            }
+            matches[polytope] = 0;
+        }
+        table->indexes[idx] = index;
+    }
+    for(x = 0; x < nslots; x++)
+        table->slots[x] = -1;
+    table->mask = nslots - 1;
+    for(idx = 0; idx < npolytopes; idx++) {
+        uint32_t slot = hash_tuple(&table->sorted[idx*order], order) & table->mask;
+        while(table->slots[slot] > -1) {
+            if(!memcmp(&table->sorted[table->slots[slot]*order], &table->sorted[idx*order], sizeof(int32_t)*order))
+                break;
+            slot = (slot + 1) & table->mask;
+        }
+        if(table->slots[slot] < 0)
+            table->slots[slot] = idx;
+    }
+    table->order = order;
+    table->npolytopes = npolytopes;
+    err = 0;
+end:
+    free(first);
+    free(members);
+    free(matches);
+    free(touched);
+    if(err)
+        free_polytopes();
+    return err;
 }
 
-void wait_threads()
+int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order)
 {
-    while (ahp_xc.nthreads >= ahp_xc_max_threads(0))
-        usleep(1);
+    polytope_table *table = &ahp_xc.polytopes;
+    int32_t key[16];
+    if(table->slots == NULL || order != table->order || order > 16)
+        return scan_crosscorrelation_index(lines, order);
+    sort_tuple(key, lines, order);
+    uint32_t slot = hash_tuple(key, order) & table->mask;
+    while(table->slots[slot] > -1) {
+        if(!memcmp(&table->sorted[table->slots[slot]*order], key, sizeof(int32_t)*order))
+            return table->indexes[table->slots[slot]];
+        slot = (slot + 1) & table->mask;
+    }
+    return scan_crosscorrelation_index(lines, order);
 }
 
-void wait_no_threads()
+const int32_t *ahp_xc_get_polytope_lines(uint32_t idx)
 {
-    while (ahp_xc.nthreads > 0)
-        usleep(1);
+    polytope_table *table = &ahp_xc.polytopes;
+    if(table->lines == NULL || idx >= table->npolytopes)
+        return NULL;
+    return &table->lines[idx*table->order];
 }
 
-static void complex_phase_magnitude(ahp_xc_correlation *sample)
+uint64_t ahp_xc_max_threads(uint64_t value)
 {
-    if(!ahp_xc.detected) return;
-    double cr = (double)sample->real / sample->counts;
-    double ci = (double)sample->imaginary / sample->counts;
-    double magnitude = (double)sqrt(pow(cr, 2)+pow((double)ci, 2));
-    double phase = 0.0;
-    if(magnitude > 0.0) {
-        phase = asin ((double)cr / magnitude);
-        if(ci < 0)
-            phase = M_PI*2.0-phase;
+    if(value>0) {
+        ahp_xc.max_threads = value;
     }
-    sample->magnitude = magnitude;
-    sample->phase = phase;
+    return ahp_xc.max_threads;
 }
 
-double get_timestamp(char *data)
+static int32_t pool_next_job(uint32_t worker, uint32_t *job)
 {
-    char timestamp[16] = { 0 };
-    double ts = 0;
-    uint32_t tmp = 0;
-    strncpy(timestamp, &data[ahp_xc_get_packetsize()-19], 16);
-    sscanf(timestamp, "%8X", &tmp);
-    ts = (double)tmp * 4.294967296;
-    sscanf(&timestamp[8], "%8X", &tmp);
-    return (double)ts + tmp / 1000000000.0;
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t x;
+    for(x = 0; x <= pool->nworkers; x++) {
+        job_range *range = &pool->ranges[(worker + x) % (pool->nworkers + 1)];
+        if(__atomic_load_n(&range->next, __ATOMIC_RELAXED) >= range->end)
+            continue;
+        *job = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+        if(*job < range->end)
+            return 1;
+    }
+    return 0;
 }
 
-double ahp_xc_get_current_channel_auto(int n, const char *data)
+static void pool_work(uint32_t worker)
 {
-    char *current_channel = (char*)malloc(ahp_xc.delaysize_len);
-    double channel = 0;
-    uint32_t tmp = 0;
-    const char *message = &data[ahp_xc_get_packetsize()-19-ahp_xc.delaysize_len*ahp_xc_get_nlines()-ahp_xc.delaysize_len*(n+1)];
-    strncpy(current_channel, message, ahp_xc.delaysize_len);
-    sscanf(current_channel, "%X", &tmp);
-    channel = (double)tmp;
-    return channel;
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t job;
+    while(pool_next_job(worker, &job))
+        pool->job(job, worker);
+    pthread_mutex_lock(&pool->mutex);
+    if(--pool->pending == 0)
+        pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-double ahp_xc_get_current_channel_cross(int n, const char *data)
+static void *pool_thread(void *arg)
 {
-    char *current_channel = (char*)malloc(ahp_xc.delaysize_len);
-    double channel = 0;
-    uint32_t tmp = 0;
-    const char *message = &data[ahp_xc_get_packetsize()-19-ahp_xc.delaysize_len*(n+1)];
-    strncpy(current_channel, message, ahp_xc.delaysize_len);
-    sscanf(current_channel, "%X", &tmp);
-    channel = (double)tmp;
-    return channel;
+    pool_worker *self = (pool_worker*)arg;
+    select_device(self->device);
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t worker = self->index;
+    uint64_t generation = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        while(pool->running && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if(!pool->running)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        pool_work(worker);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
 }
 
-int32_t calc_checksum(char *data)
+static void stop_pool()
 {
-    if(!ahp_xc.connected) return -ENOENT;
-    int32_t x;
-    uint32_t checksum = 0x00;
-    uint32_t calculated_checksum = 0;
-    unsigned char v = data[ahp_xc_get_packetsize()-3];
-    checksum = v < 'A' ? (v - '0') : (v - 'A' + 10);
-    checksum *= 16;
-    v = data[ahp_xc_get_packetsize()-2];
-    checksum += v < 'A' ? (v - '0') : (v - 'A' + 10);
-    for(x = ahp_xc.header_len; x < (int)ahp_xc_get_packetsize()-3; x++) {
-        calculated_checksum += data[x] < 'A' ? (data[x] - '0') : (data[x] - 'A' + 10);
-        calculated_checksum &= 0xff;
-    }
-    if(checksum != calculated_checksum) {
-        return EINVAL;
-    }
-    return 0;
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t x;
+    if(!pool->initialized)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for(x = 0; x < pool->nworkers; x++)
+        pthread_join(pool->workers[x].thread, NULL);
+    free(pool->workers);
+    free(pool->ranges);
+    pool->workers = NULL;
+    pool->ranges = NULL;
+    pool->nworkers = 0;
 }
 
-static int grab_packet(double *timestamp)
+static int32_t start_pool(uint32_t nworkers)
 {
-    errno = 0;
-    uint32_t size = ahp_xc_get_packetsize();
-    ahp_xc.buf_len = size;
-    if(!ahp_xc.connected){
-        errno = ENOENT;
-        goto err_end;
-    }
-    int32_t nread = 0;
-    char c = 0;
-    while (c != '\r') {
-        int n = serial_read((unsigned char*)&c, 1);
-        if(n > 0)
-            ahp_xc.tmp_buf[nread++] = c;
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t x;
+    if(pool->initialized && pool->nworkers == nworkers)
+        return 0;
+    if(!pool->initialized) {
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->start, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        pool->initialized = 1;
     }
-    if(nread < 2) {
-        nread = 0;
-        c = 0;
-        while (c != '\r') {
-            int n = serial_read((unsigned char*)&c, 1);
-            if(n > 0)
-                ahp_xc.tmp_buf[nread++] = c;
-        }
+    stop_pool();
+    pool->ranges = (job_range*)xc_calloc(nworkers + 1, sizeof(job_range));
+    pool->workers = (pool_worker*)xc_malloc(sizeof(pool_worker) * (nworkers + 1));
+    if(pool->ranges == NULL || pool->workers == NULL) {
+        free(pool->ranges);
+        free(pool->workers);
+        pool->ranges = NULL;
+        pool->workers = NULL;
+        return -ENOMEM;
     }
-    ahp_xc.tmp_buf[nread-1] = '\0';
-    if(nread < 3) {
-        errno = ENODATA;
-    } else if(nread < 0) {
-        errno = ETIMEDOUT;
-    } else {
-        if(ahp_xc.header_len > 0) {
-            if(strncmp(ahp_xc_get_header(), ahp_xc.tmp_buf, ahp_xc.header_len))
-                errno = EPERM;
-            else {
-                errno = calc_checksum((char*)ahp_xc.tmp_buf);
-            }
-        }
+    pool->running = 1;
+    for(x = 0; x < nworkers; x++) {
+        pool->workers[x].device = xc_current_device;
+        pool->workers[x].index = x;
+        if(pthread_create(&pool->workers[x].thread, NULL, pool_thread, &pool->workers[x]))
+            break;
+        pool->nworkers++;
     }
-    if(errno)
-        goto err_end;
-    if(timestamp != NULL)
-        *timestamp = get_timestamp(ahp_xc.tmp_buf);
-    memcpy(ahp_xc.buf, ahp_xc.tmp_buf, nread);
     return 0;
-err_end:
-    fprintf(stderr, "%s error: %s\n", __func__, strerror(errno));
-    return -1;
 }
 
-uint32_t ahp_xc_current_input()
+static void destroy_pool()
 {
-    return xc_current_input;
+    worker_pool *pool = &ahp_xc.pool;
+    if(!pool->initialized)
+        return;
+    stop_pool();
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->initialized = 0;
 }
 
-void ahp_xc_select_input(uint32_t index)
+void wait_no_threads()
 {
-    if(!ahp_xc.detected) return;
-    int32_t idx = 0;
-    if(index >= ahp_xc_get_nlines())
+    worker_pool *pool = &ahp_xc.pool;
+    if(!pool->initialized)
         return;
-    ahp_xc_send_command(CLEAR, SET_INDEX);
-    int len = (((int)log2(ahp_xc_get_nlines()) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_send_command(SET_INDEX, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_INDEX, (unsigned char)(index&0xf));
-        index >>= 4;
-    }
-    xc_current_input = index;
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-void ahp_xc_enable_crosscorrelator(int32_t enable)
+void wait_threads()
 {
-    if(!ahp_xc.detected) return;
-    ahp_xc.correlator_enabled = enable;
+    wait_no_threads();
 }
 
-void ahp_xc_enable_intensity_crosscorrelator(int32_t enable)
+static void run_jobs(void (*job)(uint32_t, uint32_t), uint32_t njobs)
 {
-    if(!ahp_xc.detected) return;
-    ahp_xc.intensity_correlator_enabled = enable;
+    worker_pool *pool = &ahp_xc.pool;
+    uint32_t x, nworkers = 0;
+    if(ahp_xc.max_threads > 1 && njobs > 1) {
+        start_pool((uint32_t)ahp_xc.max_threads - 1);
+        nworkers = pool->nworkers;
+    }
+    if(nworkers == 0) {
+        for(x = 0; x < njobs; x++)
+            job(x, 0);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pool->job = job;
+    pool->njobs = njobs;
+    for(x = 0; x <= nworkers; x++) {
+        pool->ranges[x].next = (uint32_t)((uint64_t)njobs * x / (nworkers + 1));
+        pool->ranges[x].end = (uint32_t)((uint64_t)njobs * (x + 1) / (nworkers + 1));
+    }
+    pool->pending = nworkers + 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    pool_work(nworkers);
+    wait_no_threads();
 }
 
-int32_t ahp_xc_intensity_crosscorrelator_enabled()
-{
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.intensity_correlator_enabled != 0 || !ahp_xc_has_crosscorrelator();
-}
+static const double asin_coeffs[8] = {
+    1.5707963050, -0.2145988016, 0.0889789874, -0.0501743046,
+    0.0308918810, -0.0170881256, 0.0066700901, -0.0012624911,
+};
 
-int32_t ahp_xc_has_crosscorrelator()
+static double exact_phase(double cr, double ci, double magnitude)
 {
-    if(!ahp_xc.detected) return 0;
-    return (ahp_xc.flags & HAS_CROSSCORRELATOR ? ahp_xc.correlator_enabled : 0);
+    double phase = 0.0;
+    if(magnitude > 0.0) {
+        phase = asin (cr / magnitude);
+        if(ci < 0)
+            phase = M_PI*2.0-phase;
+    }
+    return phase;
 }
 
-int32_t ahp_xc_has_psu()
+/**
+* \brief Approximate exact_phase with the Abramowitz-Stegun 4.4.46 arcsine expansion
+* The absolute error is below 3e-8 radians, rounding included.
+*/
+static double fast_phase(double cr, double ci, double magnitude)
 {
-    if(!ahp_xc.detected) return 0;
-    return (ahp_xc.flags & HAS_PSU ? 1 : 0);
+    if(!(magnitude > 0.0))
+        return 0.0;
+    double t = fmin(fabs(cr) / magnitude, 1.0);
+    double p = asin_coeffs[7];
+    int32_t x;
+    for(x = 6; x >= 0; x--)
+        p = p * t + asin_coeffs[x];
+    double phase = copysign(M_PI_2 - sqrt(1.0 - t) * p, cr);
+    return (ci < 0 ? M_PI*2.0-phase : phase);
 }
 
-int32_t ahp_xc_has_leds()
+static void phase_magnitude(int64_t real, int64_t imaginary, uint64_t counts, double *magnitude, double *phase)
 {
-    if(!ahp_xc.detected) return 0;
-    return (ahp_xc.flags & HAS_LEDS ? 1 : 0);
+    double cr = (double)real / counts;
+    double ci = (double)imaginary / counts;
+    *magnitude = (double)sqrt(pow(cr, 2)+pow((double)ci, 2));
+    *phase = (ahp_xc.fast_phase_magnitude ? fast_phase(cr, ci, *magnitude) : exact_phase(cr, ci, *magnitude));
 }
 
-int32_t ahp_xc_has_cumulative_only()
+static void complex_phase_magnitude(ahp_xc_correlation *sample)
 {
-    if(!ahp_xc.detected) return 0;
-    return (ahp_xc.flags & HAS_CUMULATIVE_ONLY ? 1 : 0);
+    if(!ahp_xc.detected) return;
+    phase_magnitude(sample->real, sample->imaginary, sample->counts, &sample->magnitude, &sample->phase);
 }
 
-char* ahp_xc_get_header()
+static void phase_magnitude_scalar(const int64_t *fields, uint64_t counts, double *magnitude, double *phase, uint32_t len, int32_t fast)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.header;
+    uint32_t x;
+    for(x = 0; x < len; x++) {
+        double cr = (double)fields[x*2] / counts;
+        double ci = (double)fields[x*2+1] / counts;
+        magnitude[x] = sqrt(cr*cr+ci*ci);
+        phase[x] = (fast ? fast_phase(cr, ci, magnitude[x]) : exact_phase(cr, ci, magnitude[x]));
+    }
 }
 
-int32_t ahp_xc_get_baudrate()
+#if defined(__SSE2__)
+static __m128d fast_phase_sse2(__m128d cr, __m128d ci, __m128d magnitude)
 {
-    return ahp_xc.baserate << ahp_xc.rate;
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d one = _mm_set1_pd(1.0);
+    __m128d t = _mm_min_pd(_mm_div_pd(_mm_andnot_pd(sign, cr), magnitude), one);
+    __m128d p = _mm_set1_pd(asin_coeffs[7]);
+    int32_t x;
+    for(x = 6; x >= 0; x--)
+        p = _mm_add_pd(_mm_mul_pd(p, t), _mm_set1_pd(asin_coeffs[x]));
+    __m128d phase = _mm_sub_pd(_mm_set1_pd(M_PI_2), _mm_mul_pd(_mm_sqrt_pd(_mm_sub_pd(one, t)), p));
+    phase = _mm_or_pd(phase, _mm_and_pd(cr, sign));
+    __m128d negative = _mm_cmplt_pd(ci, _mm_setzero_pd());
+    phase = _mm_or_pd(_mm_and_pd(negative, _mm_sub_pd(_mm_set1_pd(M_PI*2.0), phase)), _mm_andnot_pd(negative, phase));
+    return _mm_and_pd(phase, _mm_cmpgt_pd(magnitude, _mm_setzero_pd()));
 }
 
-uint32_t ahp_xc_get_bps()
+static void phase_magnitude_sse2(const int64_t *fields, uint64_t counts, double *magnitude, double *phase, uint32_t len, int32_t fast)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.bps;
+    const __m128d c = _mm_set1_pd((double)counts);
+    double cr[2], ci[2];
+    uint32_t x, y;
+    for(x = 0; x + 2 <= len; x += 2) {
+        __m128d r = _mm_div_pd(_mm_set_pd((double)fields[x*2+2], (double)fields[x*2]), c);
+        __m128d i = _mm_div_pd(_mm_set_pd((double)fields[x*2+3], (double)fields[x*2+1]), c);
+        __m128d m = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(r, r), _mm_mul_pd(i, i)));
+        _mm_storeu_pd(&magnitude[x], m);
+        if(fast) {
+            _mm_storeu_pd(&phase[x], fast_phase_sse2(r, i, m));
+            continue;
+        }
+        _mm_storeu_pd(cr, r);
+        _mm_storeu_pd(ci, i);
+        for(y = 0; y < 2; y++)
+            phase[x+y] = exact_phase(cr[y], ci[y], magnitude[x+y]);
+    }
+    phase_magnitude_scalar(&fields[x*2], counts, &magnitude[x], &phase[x], len - x, fast);
 }
+#endif
 
-uint32_t ahp_xc_get_nlines()
+#ifdef HAVE_AVX2_DECODER
+__attribute__((target("avx2")))
+static __m256d fast_phase_avx2(__m256d cr, __m256d ci, __m256d magnitude)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.nlines;
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d t = _mm256_min_pd(_mm256_div_pd(_mm256_andnot_pd(sign, cr), magnitude), one);
+    __m256d p = _mm256_set1_pd(asin_coeffs[7]);
+    int32_t x;
+    for(x = 6; x >= 0; x--)
+        p = _mm256_add_pd(_mm256_mul_pd(p, t), _mm256_set1_pd(asin_coeffs[x]));
+    __m256d phase = _mm256_sub_pd(_mm256_set1_pd(M_PI_2), _mm256_mul_pd(_mm256_sqrt_pd(_mm256_sub_pd(one, t)), p));
+    phase = _mm256_or_pd(phase, _mm256_and_pd(cr, sign));
+    __m256d negative = _mm256_cmp_pd(ci, _mm256_setzero_pd(), _CMP_LT_OQ);
+    phase = _mm256_blendv_pd(phase, _mm256_sub_pd(_mm256_set1_pd(M_PI*2.0), phase), negative);
+    return _mm256_and_pd(phase, _mm256_cmp_pd(magnitude, _mm256_setzero_pd(), _CMP_GT_OQ));
 }
 
-uint32_t ahp_xc_get_nbaselines()
+__attribute__((target("avx2")))
+static void phase_magnitude_avx2(const int64_t *fields, uint64_t counts, double *magnitude, double *phase, uint32_t len, int32_t fast)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - 1) / 2;
+    const __m256d c = _mm256_set1_pd((double)counts);
+    double cr[4], ci[4];
+    uint32_t x, y;
+    for(x = 0; x + 4 <= len; x += 4) {
+        __m256d r = _mm256_div_pd(_mm256_set_pd((double)fields[x*2+6], (double)fields[x*2+4], (double)fields[x*2+2], (double)fields[x*2]), c);
+        __m256d i = _mm256_div_pd(_mm256_set_pd((double)fields[x*2+7], (double)fields[x*2+5], (double)fields[x*2+3], (double)fields[x*2+1]), c);
+        __m256d m = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(r, r), _mm256_mul_pd(i, i)));
+        _mm256_storeu_pd(&magnitude[x], m);
+        if(fast) {
+            _mm256_storeu_pd(&phase[x], fast_phase_avx2(r, i, m));
+            continue;
+        }
+        _mm256_storeu_pd(cr, r);
+        _mm256_storeu_pd(ci, i);
+        for(y = 0; y < 4; y++)
+            phase[x+y] = exact_phase(cr[y], ci[y], magnitude[x+y]);
+    }
+    phase_magnitude_scalar(&fields[x*2], counts, &magnitude[x], &phase[x], len - x, fast);
 }
+#endif
 
-uint32_t ahp_xc_get_npolytopes(int32_t order)
+/**
+* \brief Compute magnitude and phase of len interleaved real and imaginary fields normalized by counts
+* The vector kernels give the same magnitudes and exact phases as phase_magnitude,
+* the fast approximation replaces asin with a polynomial evaluated in the vector registers.
+*/
+static void phase_magnitude_batch(const int64_t *fields, uint64_t counts, double *magnitude, double *phase, uint32_t len)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - order + 1) / order;
+    static void (*kernel)(const int64_t *, uint64_t, double *, double *, uint32_t, int32_t) = NULL;
+    void (*selected)(const int64_t *, uint64_t, double *, double *, uint32_t, int32_t) = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if(selected == NULL) {
+        selected = phase_magnitude_scalar;
+#if defined(__SSE2__)
+        selected = phase_magnitude_sse2;
+#endif
+#ifdef HAVE_AVX2_DECODER
+        if(__builtin_cpu_supports("avx2"))
+            selected = phase_magnitude_avx2;
+#endif
+        __atomic_store_n(&kernel, selected, __ATOMIC_RELAXED);
+    }
+    selected(fields, counts, magnitude, phase, len, ahp_xc.fast_phase_magnitude);
 }
 
-uint32_t ahp_xc_get_delaysize()
+static void decode_phase_magnitude(const int64_t *fields, uint64_t counts, double *magnitude, double *phase, uint32_t len)
 {
-    if(!ahp_xc.detected) return 0;
-    if(ahp_xc.delaysize == 0 || ahp_xc.delaysize == 4)
-        return pow(2, 24);
-    return ahp_xc.delaysize * 17;
+    uint32_t x;
+    if(!ahp_xc.lazy_phase_magnitude) {
+        phase_magnitude_batch(fields, counts, magnitude, phase, len);
+        return;
+    }
+    for(x = 0; x < len; x++) {
+        magnitude[x] = NAN;
+        phase[x] = NAN;
+    }
 }
 
-uint32_t ahp_xc_get_autocorrelator_lagsize()
+static void store_planes(int64_t *real, int64_t *imaginary, uint64_t *counts, double *magnitude, double *phase, const int64_t *fields, uint64_t count, uint32_t len)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.auto_lagsize;
+    uint32_t x;
+    for(x = 0; x < len; x++) {
+        real[x] = fields[x*2];
+        imaginary[x] = fields[x*2+1];
+        counts[x] = count;
+    }
+    decode_phase_magnitude(fields, count, magnitude, phase, len);
 }
 
-uint32_t ahp_xc_get_crosscorrelator_lagsize()
+static void store_correlations(ahp_xc_correlation *correlations, const int64_t *fields, uint64_t count, uint32_t len)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.cross_lagsize;
+    double magnitude[32];
+    double phase[32];
+    uint32_t x;
+    decode_phase_magnitude(fields, count, magnitude, phase, len);
+    for(x = 0; x < len; x++) {
+        correlations[x].counts = count;
+        correlations[x].real = fields[x*2];
+        correlations[x].imaginary = fields[x*2+1];
+        correlations[x].magnitude = magnitude[x];
+        correlations[x].phase = phase[x];
+    }
 }
 
-double ahp_xc_get_frequency()
+static inline uint64_t hex_nibble(unsigned char c)
 {
-    if(!ahp_xc.detected) return 0;
-    return ahp_xc.frequency;
+    return (c & 0xf) + 9 * (c >> 6);
 }
 
-double ahp_xc_get_sampletime()
+static inline int64_t hex_sign_extend(int64_t v, int64_t _sign, int64_t _fill)
 {
-    return (double)1.0/ahp_xc_get_frequency();
+    int64_t mask = -(int64_t)(v >= _sign);
+    return (v & ~mask) | (-((v ^ _fill) + 1) & mask);
 }
 
-double ahp_xc_get_packettime()
+static void hex_decode_scalar(const char *src, int32_t n, int64_t *dst, size_t count, int32_t is_signed, uint32_t *sum)
 {
-    return 9.0  * (double)ahp_xc_get_packetsize() / (double)ahp_xc_get_baudrate();
+    const int64_t _sign = ahp_xc.sign;
+    const int64_t _fill = ahp_xc.fill;
+    size_t x;
+    int32_t y;
+    uint32_t total = 0;
+    for(x = 0; x < count; x++) {
+        uint64_t v = 0;
+        for(y = 0; y < n; y++) {
+            uint64_t nibble = hex_nibble((unsigned char)src[y]);
+            v = (v << 4) | nibble;
+            total += (uint32_t)nibble;
+        }
+        dst[x] = is_signed ? hex_sign_extend((int64_t)v, _sign, _fill) : (int64_t)v;
+        src += n;
+    }
+    if(sum != NULL)
+        *sum += total;
 }
 
-uint32_t ahp_xc_get_packetsize()
-{
-    return ahp_xc.packetsize;
-}
+///Shortest field run decoded with AVX2, measured with ahp_xc_bench
+#define HEX_DECODE_AVX2_MIN_FIELDS 8
 
-int32_t ahp_xc_get_fd()
+static const unsigned char digit_mask[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#if defined(__SSE2__)
+static void hex_decode_sse2(const char *src, int32_t n, int64_t *dst, size_t count, int32_t is_signed, uint32_t *sum)
 {
-    return serial_get_fd();
+    const __m128i mask = _mm_loadu_si128((const __m128i*)(digit_mask + 16 - n));
+    __m128i total = _mm_setzero_si128();
+    const __m128i lo_mask = _mm_set1_epi8(0x0f);
+    const __m128i alpha_mask = _mm_set1_epi8(0x01);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i byte_mask = _mm_set1_epi16(0x00ff);
+    const int32_t shift = 64 - 4 * n;
+    const int64_t _sign = ahp_xc.sign;
+    const int64_t _fill = ahp_xc.fill;
+    size_t x;
+    for(x = 0; x < count; x++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        __m128i alpha = _mm_and_si128(_mm_srli_epi16(v, 6), alpha_mask);
+        v = _mm_add_epi8(_mm_and_si128(v, lo_mask), _mm_and_si128(_mm_sub_epi8(_mm_setzero_si128(), alpha), nine));
+        if(sum != NULL)
+            total = _mm_add_epi64(total, _mm_sad_epu8(_mm_and_si128(v, mask), _mm_setzero_si128()));
+        v = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8)), byte_mask);
+        v = _mm_packus_epi16(v, v);
+        uint64_t value = __builtin_bswap64((uint64_t)_mm_cvtsi128_si64(v));
+        if(shift > 0)
+            value >>= shift;
+        dst[x] = is_signed ? hex_sign_extend((int64_t)value, _sign, _fill) : (int64_t)value;
+        src += n;
+    }
+    if(sum != NULL)
+        *sum += (uint32_t)(_mm_cvtsi128_si64(total) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total)));
 }
+#endif
 
-int32_t ahp_xc_connect_fd(int32_t fd)
+#ifdef HAVE_AVX2_DECODER
+__attribute__((target("avx2")))
+static void hex_decode_avx2(const char *src, int32_t n, int64_t *dst, size_t count, int32_t is_signed, uint32_t *sum)
 {
-    if(ahp_xc.detected)
-        return 0;
-    ahp_xc.connected = 0;
-    ahp_xc.detected = 0;
-    ahp_xc.bps = 0;
-    ahp_xc.nlines = 0;
-    ahp_xc.nbaselines = 0;
-    ahp_xc.delaysize = 0;
-    ahp_xc.frequency = 0;
-    ahp_xc.packetsize = 4096;
-    ahp_xc.rate = R_BASE;
-    if(fd > -1) {
-        ahp_xc.connected = 1;
-        ahp_xc.buf = (char*)malloc(ahp_xc.packetsize);
-        ahp_xc.tmp_buf = (char*)malloc(ahp_xc.packetsize);
-        ahp_xc.detected = 0;
-        serial_set_fd(fd, XC_BASE_RATE);
-        if(!ahp_xc.mutexes_initialized) {
-            pthread_mutex_init(&ahp_xc.mutex, &ahp_serial_mutex_attr);
-            ahp_xc.mutexes_initialized = 1;
+    const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(digit_mask + 16 - n)));
+    __m256i total = _mm256_setzero_si256();
+    const __m256i lo_mask = _mm256_set1_epi8(0x0f);
+    const __m256i alpha_mask = _mm256_set1_epi8(0x01);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i byte_mask = _mm256_set1_epi16(0x00ff);
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i shift = _mm_cvtsi32_si128(64 - 4 * n);
+    const __m256i _sign = _mm256_set1_epi64x(ahp_xc.sign);
+    const __m256i _fill = _mm256_set1_epi64x(ahp_xc.fill);
+    const __m256i one = _mm256_set1_epi64x(1);
+    size_t x;
+    for(x = 0; x + 4 <= count; x += 4) {
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)), _mm_loadu_si128((const __m128i*)(src + n)), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src + 2 * n))), _mm_loadu_si128((const __m128i*)(src + 3 * n)), 1);
+        __m256i alpha = _mm256_and_si256(_mm256_srli_epi16(a, 6), alpha_mask);
+        a = _mm256_add_epi8(_mm256_and_si256(a, lo_mask), _mm256_and_si256(_mm256_sub_epi8(_mm256_setzero_si256(), alpha), nine));
+        if(sum != NULL)
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_and_si256(a, mask), _mm256_setzero_si256()));
+        a = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(a, 4), _mm256_srli_epi16(a, 8)), byte_mask);
+        alpha = _mm256_and_si256(_mm256_srli_epi16(b, 6), alpha_mask);
+        b = _mm256_add_epi8(_mm256_and_si256(b, lo_mask), _mm256_and_si256(_mm256_sub_epi8(_mm256_setzero_si256(), alpha), nine));
+        if(sum != NULL)
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_and_si256(b, mask), _mm256_setzero_si256()));
+        b = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(b, 4), _mm256_srli_epi16(b, 8)), byte_mask);
+        __m256i v = _mm256_packus_epi16(a, b);
+        v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, reverse), _MM_SHUFFLE(3, 1, 2, 0));
+        v = _mm256_srl_epi64(v, shift);
+        if(is_signed) {
+            __m256i negative = _mm256_andnot_si256(_mm256_cmpgt_epi64(_sign, v), _mm256_set1_epi64x(-1));
+            __m256i complement = _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_add_epi64(_mm256_xor_si256(v, _fill), one));
+            v = _mm256_blendv_epi8(v, complement, negative);
         }
-        ahp_xc.nthreads = 0;
-        xc_current_input = 0;
-        ahp_xc_get_properties();
+        _mm256_storeu_si256((__m256i*)(dst + x), v);
+        src += 4 * n;
     }
-    if(!ahp_xc.detected)
-        ahp_xc_disconnect();
-    ahp_xc.connected = ahp_xc.detected;
-    return !ahp_xc.detected;
+    if(sum != NULL) {
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+        *sum += (uint32_t)(_mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)));
+    }
+    _mm256_zeroupper();
+#if defined(__SSE2__)
+    hex_decode_sse2(src, n, dst + x, count - x, is_signed, sum);
+#else
+    hex_decode_scalar(src, n, dst + x, count - x, is_signed, sum);
+#endif
 }
+#endif
 
-int32_t ahp_xc_connect(const char *port)
+/**
+* \brief Decode count fixed-width hexadecimal fields of n digits into dst
+* The vector decoders load 16 bytes from each field start, the buffer must be readable
+* up to 16 bytes past the start of the last field, as it happens within a packet.
+* Signed fields are sign-extended using the sign and fill values of the current device.
+* When sum is not NULL the digit values are added to it, for checksumming during the decode.
+* Runs shorter than HEX_DECODE_AVX2_MIN_FIELDS stay on SSE2, where the AVX2 setup does not pay off.
+*/
+static void hex_decode(const char *src, int32_t n, int64_t *dst, size_t count, int32_t is_signed, uint32_t *sum)
 {
-    if(ahp_xc.detected)
-        return 0;
-    sleep(1);
-    xc_current_input = 0;
-    ahp_xc.nthreads = 0;
-    ahp_xc.connected = 0;
-    ahp_xc.detected = 0;
-    ahp_xc.bps = 0;
-    ahp_xc.nlines = 0;
-    ahp_xc.nbaselines = 0;
-    ahp_xc.delaysize = 0;
-    ahp_xc.frequency = 1;
-    ahp_xc.max_threads = 1;
-    ahp_xc.max_lost_packets = 1;
-    ahp_xc.packetsize = 4096;
-    ahp_xc.baserate = XC_BASE_RATE;
-    ahp_xc.rate = R_BASE;
-    ahp_xc.correlator_enabled = 1;
-    strcpy(ahp_xc.comport, port);
-    if(!serial_connect(port, ahp_xc_get_baudrate(), "8N1")) {
-        ahp_xc.connected = 1;
-        ahp_xc.buf = (char*)malloc(ahp_xc.packetsize);
-        ahp_xc.tmp_buf = (char*)malloc(ahp_xc.packetsize);
-        ahp_xc.buf_allocd = 1;
-        ahp_xc.buf[0] = 0;
-        ahp_xc.tmp_buf[0] = 0;
-        ahp_xc.buf_len = 0;
-        ahp_xc.header = (char*)malloc(1);
-        ahp_xc.header_allocd = 1;
-        ahp_xc.header[0] = 0;
-        ahp_xc.header_len = 0;
-        if(!ahp_xc.mutexes_initialized) {
-            pthread_mutex_init(&ahp_xc.mutex, &ahp_serial_mutex_attr);
-            ahp_xc.mutexes_initialized = 1;
-        }
-        ahp_xc_get_properties();
+    static void (*decoder)(const char *, int32_t, int64_t *, size_t, int32_t, uint32_t *) = NULL;
+    if(n < 1 || n > 16) {
+        hex_decode_scalar(src, n, dst, count, is_signed, sum);
+        return;
     }
-    return !ahp_xc.detected;
+#if defined(__SSE2__)
+    if(count < HEX_DECODE_AVX2_MIN_FIELDS) {
+        hex_decode_sse2(src, n, dst, count, is_signed, sum);
+        return;
+    }
+#endif
+    void (*selected)(const char *, int32_t, int64_t *, size_t, int32_t, uint32_t *) = __atomic_load_n(&decoder, __ATOMIC_RELAXED);
+    if(selected == NULL) {
+        selected = hex_decode_scalar;
+#if defined(__SSE2__)
+        selected = hex_decode_sse2;
+#endif
+#ifdef HAVE_AVX2_DECODER
+        if(__builtin_cpu_supports("avx2"))
+            selected = hex_decode_avx2;
+#endif
+        __atomic_store_n(&decoder, selected, __ATOMIC_RELAXED);
+    }
+    selected(src, n, dst, count, is_signed, sum);
 }
-void ahp_xc_disconnect()
+
+static uint32_t nibble_sum(const char *src, size_t len)
 {
-    if(ahp_xc.connected) {
-        if(ahp_xc.detected) {
-            ahp_xc_send_command(CLEAR, SET_INDEX);
-            ahp_xc_send_command(CLEAR, SET_LEDS);
-            ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
-            ahp_xc_send_command(CLEAR, SET_VOLTAGE);
-            ahp_xc_send_command(CLEAR, SET_DELAY);
-            ahp_xc_send_command(CLEAR, ENABLE_TEST);
-            ahp_xc_send_command(CLEAR, CLEAR);
-        }
-        if(ahp_xc.mutexes_initialized) {
-            pthread_mutex_unlock(&ahp_xc.mutex);
-            pthread_mutex_destroy(&ahp_xc.mutex);
-            ahp_xc.mutexes_initialized = 0;
-        }
-        free(ahp_xc.buf);
-        free(ahp_xc.tmp_buf);
-        free(ahp_xc.header);
-        serial_close();
+    uint32_t sum = 0;
+    size_t x = 0;
+#if defined(__SSE2__)
+    const __m128i lo_mask = _mm_set1_epi8(0x0f);
+    const __m128i alpha_mask = _mm_set1_epi8(0x01);
+    const __m128i nine = _mm_set1_epi8(9);
+    __m128i total = _mm_setzero_si128();
+    for(; x + 16 <= len; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        __m128i alpha = _mm_and_si128(_mm_srli_epi16(v, 6), alpha_mask);
+        v = _mm_add_epi8(_mm_and_si128(v, lo_mask), _mm_and_si128(_mm_sub_epi8(_mm_setzero_si128(), alpha), nine));
+        total = _mm_add_epi64(total, _mm_sad_epu8(v, _mm_setzero_si128()));
     }
+    sum = (uint32_t)(_mm_cvtsi128_si64(total) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total)));
+#endif
+    for(; x < len; x++)
+        sum += hex_nibble((unsigned char)src[x]);
+    return sum;
 }
 
-uint32_t ahp_xc_is_connected()
+double get_timestamp(char *data)
 {
-    return ahp_xc.connected;
+    int64_t timestamp[2];
+    hex_decode_scalar(&data[ahp_xc.layout.timestamp], 8, timestamp, 2, 0, NULL);
+    return (double)timestamp[0] * 4.294967296 + timestamp[1] / 1000000000.0;
 }
 
-uint32_t ahp_xc_is_detected()
+static double get_channel(const char *message)
 {
-    return ahp_xc.detected;
+    int64_t channel = 0;
+    hex_decode_scalar(message, ahp_xc.layout.channel_len, &channel, 1, 0, NULL);
+    return (double)(uint32_t)channel;
 }
 
-ahp_xc_sample *ahp_xc_alloc_samples(uint64_t nlines, size_t size)
+double ahp_xc_get_current_channel_auto(int n, const char *data)
 {
-    uint64_t x;
-    ahp_xc_sample* samples = (ahp_xc_sample*)malloc(sizeof(ahp_xc_sample)*nlines);
-    memset(samples, 0, sizeof(ahp_xc_sample)*nlines);
-    for(x = 0; x < nlines; x++) {
-        samples[x].lag_size = size;
-        samples[x].correlations = (ahp_xc_correlation*)malloc(sizeof(ahp_xc_correlation)*size);
-        memset(samples[x].correlations, 0, sizeof(ahp_xc_correlation)*size);
-    }
-    return samples;
+    return get_channel(&data[ahp_xc.layout.auto_channels-ahp_xc.layout.channel_len*n]);
 }
 
-ahp_xc_sample *ahp_xc_copy_samples(ahp_xc_sample* src, uint64_t nlines, size_t size)
+double ahp_xc_get_current_channel_cross(int n, const char *data)
 {
-    uint64_t x;
-    ahp_xc_sample* samples = ahp_xc_alloc_samples(nlines, size);
-    for(x = 0; x < nlines; x++) {
-        samples[x].lag = src[x].lag;
-        memcpy(samples[x].correlations, src[x].correlations, sizeof(ahp_xc_correlation)*size);
+    return get_channel(&data[ahp_xc.layout.cross_channels-ahp_xc.layout.channel_len*n]);
+}
+
+static void build_layout()
+{
+    packet_layout *layout = &ahp_xc.layout;
+    int32_t n = ahp_xc.bps / 4;
+    layout->field_len = n;
+    layout->channel_len = ahp_xc.delaysize_len;
+    layout->auto_field = ahp_xc.nlines;
+    layout->auto_field_stride = ahp_xc.auto_lagsize * 2;
+    layout->cross_field = layout->auto_field + ahp_xc.nlines * layout->auto_field_stride;
+    layout->cross_field_stride = 2;
+    layout->counts = ahp_xc.header_len;
+    layout->autocorrelations = layout->counts + n * layout->auto_field;
+    layout->auto_stride = n * layout->auto_field_stride;
+    layout->crosscorrelations = layout->counts + n * layout->cross_field;
+    layout->cross_stride = n * layout->cross_field_stride;
+    layout->timestamp = ahp_xc.packetsize - 19;
+    layout->checksum = ahp_xc.packetsize - 3;
+    layout->cross_channels = layout->timestamp - layout->channel_len;
+    layout->auto_channels = layout->cross_channels - layout->channel_len * ahp_xc.nlines;
+    layout->nvalues = (n > 0 ? (layout->timestamp - layout->counts) / n : 0);
+}
+
+int32_t calc_checksum(char *data)
+{
+    if(!ahp_xc.connected) return -ENOENT;
+    uint32_t checksum = 0x00;
+    uint32_t calculated_checksum = 0;
+    checksum = hex_nibble((unsigned char)data[ahp_xc.layout.checksum]) * 16 + hex_nibble((unsigned char)data[ahp_xc.layout.checksum+1]);
+    calculated_checksum = nibble_sum(&data[ahp_xc.layout.counts], ahp_xc.layout.checksum - ahp_xc.layout.counts);
+    if(checksum != (calculated_checksum & 0xff)) {
+        return EINVAL;
     }
-    return samples;
+    return 0;
 }
 
-void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples)
+static int32_t decode_frame(const char *data, int64_t *values)
 {
-    uint64_t x;
-    if(samples != NULL) {
-        for(x = 0; x < nlines; x++) {
-            if(samples[x].correlations != NULL) {
-                free(samples[x].correlations);
-            }
-        }
-        free(samples);
+    int32_t x;
+    const packet_layout *layout = &ahp_xc.layout;
+    int32_t n = layout->field_len;
+    int32_t nlines = layout->auto_field;
+    int32_t tail = layout->counts + ahp_xc.nvalues * n;
+    const char *payload = data + layout->counts;
+    uint32_t calculated_checksum = 0;
+    uint32_t checksum = 0;
+    if(!ahp_xc.fused_decode) {
+        int32_t err = calc_checksum((char*)data);
+        if(err)
+            return err;
+        hex_decode(payload, n, values, nlines, 0, NULL);
+        hex_decode(payload + nlines * n, n, values + nlines, ahp_xc.nvalues - nlines, 1, NULL);
+        return 0;
     }
+    hex_decode(payload, n, values, nlines, 0, &calculated_checksum);
+    hex_decode(payload + nlines * n, n, values + nlines, ahp_xc.nvalues - nlines, 1, &calculated_checksum);
+    for(x = tail; x < layout->checksum; x++)
+        calculated_checksum += hex_nibble((unsigned char)data[x]);
+    checksum = hex_nibble((unsigned char)data[layout->checksum]) * 16 + hex_nibble((unsigned char)data[layout->checksum+1]);
+    if(checksum != (calculated_checksum & 0xff))
+        return EINVAL;
+    return 0;
 }
 
-ahp_xc_packet *ahp_xc_alloc_packet()
+static int alloc_values()
 {
-    ahp_xc_packet *packet = (ahp_xc_packet*)malloc(sizeof(ahp_xc_packet));
-    packet->bps = (uint64_t)ahp_xc_get_bps();
-    packet->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
-    packet->n_lines = (uint64_t)ahp_xc_get_nlines();
-    packet->n_baselines = (uint64_t)ahp_xc_get_nbaselines();
-    packet->auto_lag = ahp_xc_get_autocorrelator_lagsize();
-    packet->cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
-    packet->counts = (uint64_t*)malloc((uint64_t)ahp_xc_get_nlines() * sizeof(uint64_t));
-    packet->autocorrelations = ahp_xc_alloc_samples((uint64_t)ahp_xc_get_nlines(), (uint64_t)ahp_xc_get_autocorrelator_lagsize());
-    packet->crosscorrelations = ahp_xc_alloc_samples((uint64_t)ahp_xc_get_nbaselines(), (uint64_t)ahp_xc_get_crosscorrelator_lagsize()*2-1);
-    packet->lock = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(((pthread_mutex_t*)packet->lock), &ahp_serial_mutex_attr);
-    return packet;
+    uint32_t nvalues = ahp_xc.layout.nvalues;
+    ahp_xc.values_frame = NULL;
+    ahp_xc.nvalues = 0;
+    if(nvalues < ahp_xc.nlines)
+        return -EINVAL;
+    int64_t *values = (int64_t*)xc_realloc(ahp_xc.values, sizeof(int64_t) * nvalues);
+    if(values == NULL)
+        return -ENOMEM;
+    ahp_xc.values = values;
+    values = (int64_t*)xc_realloc(ahp_xc.tmp_values, sizeof(int64_t) * nvalues);
+    if(values == NULL)
+        return -ENOMEM;
+    ahp_xc.tmp_values = values;
+    ahp_xc.nvalues = nvalues;
+    return 0;
 }
 
-ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet)
+static int alloc_buffers(uint32_t size)
 {
-    ahp_xc_packet *copy = ahp_xc_alloc_packet();
-    copy->timestamp = packet->timestamp;
-    copy->bps = packet->bps;
-    copy->tau = packet->tau;
-    copy->n_lines = packet->n_lines;
-    copy->n_baselines = packet->n_baselines;
-    copy->auto_lag = packet->auto_lag;
-    copy->cross_lag = packet->cross_lag;
-    copy->counts = (uint64_t*)malloc((uint64_t)copy->n_lines * sizeof(uint64_t));
-    memcpy(copy->counts, packet->counts, sizeof(uint64_t) * (uint64_t)copy->n_lines);
-    ahp_xc_free_samples(copy->n_lines, copy->autocorrelations);
-    ahp_xc_free_samples(copy->n_baselines, copy->crosscorrelations);
-    copy->autocorrelations = ahp_xc_copy_samples(packet->autocorrelations, copy->n_lines, copy->auto_lag);
-    copy->crosscorrelations = ahp_xc_copy_samples(packet->crosscorrelations, copy->n_baselines, copy->cross_lag);
-    return copy;
+    uint32_t capacity = size * 2;
+    char *buf = (char*)xc_realloc(ahp_xc.buf, capacity);
+    if(buf == NULL)
+        return -ENOMEM;
+    ahp_xc.buf = buf;
+    buf = (char*)xc_realloc(ahp_xc.tmp_buf, capacity);
+    if(buf == NULL)
+        return -ENOMEM;
+    ahp_xc.tmp_buf = buf;
+    ahp_xc.buf_size = capacity;
+    if(ahp_xc.rx_len > ahp_xc.buf_size)
+        ahp_xc.rx_len = 0;
+    return 0;
 }
 
-void ahp_xc_free_packet(ahp_xc_packet *packet)
+static void flush_rx()
 {
-    if(packet != NULL) {
-        if(packet->counts != NULL)
-            free(packet->counts);
-        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
-        free(packet->lock);
-        ahp_xc_free_samples((uint64_t)packet->n_lines, packet->autocorrelations);
-        ahp_xc_free_samples((uint64_t)packet->n_baselines, packet->crosscorrelations);
-        free(packet);
-    }
+    serial_flush_rx();
+    ahp_xc.rx_len = 0;
 }
 
-static void ahp_xc_start_autocorrelation_scan(uint32_t index)
+static int32_t line_masked(uint32_t index)
 {
-    if(!ahp_xc.detected) return;
-    int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags((flags|CAP_RESET_TIMESTAMP)&~(CAP_ENABLE|CAP_EXTRA_CMD));
-    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
-    ahp_xc_set_capture_flags(flags);
+    return ahp_xc.subscription.lines != NULL && ahp_xc.subscription.lines[index];
 }
 
-static void ahp_xc_end_autocorrelation_scan(uint32_t index)
+static int32_t baseline_masked(uint32_t index)
 {
-    if(!ahp_xc.detected) return;
-    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+    return ahp_xc.subscription.baselines != NULL && ahp_xc.subscription.baselines[index];
 }
 
-static void* _get_autocorrelation(void *o)
+static void free_subscription()
 {
-    thread_argument *arg = (thread_argument*)o;
-    ahp_xc_sample *sample = arg->sample;
-    int32_t index = arg->index;
-    const char *data = arg->data;
-    double lag = arg->lag;
-    uint32_t y;
-    int32_t n = ahp_xc_get_bps() / 4;
-    const char *packet = data;
-    char *subpacket = (char*)malloc(n+1);
-    memset(subpacket, 0, n+1);
-    sample->lag_size = ahp_xc_get_autocorrelator_lagsize();
-    sample->lag = lag;
-    packet += ahp_xc.header_len;
-    memcpy(subpacket, &packet[index*n], (unsigned int)n);
-    uint64_t counts = strtoul(subpacket, NULL, 16)|1;
-    packet += n*ahp_xc_get_nlines();
-    packet += n*index*ahp_xc_get_autocorrelator_lagsize()*2;
-    for(y = 0; y < sample->lag_size; y++) {
-        sample->correlations[y].counts = counts;
-        memcpy(subpacket, packet, (unsigned int)n);
-        sscanf(subpacket, "%lX",  &sample->correlations[y].real);
-        if(sample->correlations[y].real >= sign) {
-            sample->correlations[y].real ^= fill;
-            sample->correlations[y].real ++;
-            sample->correlations[y].real = ~sample->correlations[y].real;
-            sample->correlations[y].real ++;
-        }
-        packet += n;
-        memcpy(subpacket, packet, (unsigned int)n);
-        sscanf(subpacket, "%lX",  &sample->correlations[y].imaginary);
-        if(sample->correlations[y].imaginary >= sign) {
-            sample->correlations[y].imaginary ^= fill;
-            sample->correlations[y].imaginary ++;
-            sample->correlations[y].imaginary = ~sample->correlations[y].imaginary;
-            sample->correlations[y].imaginary ++;
-        }
-        packet += n;
-        complex_phase_magnitude(&sample->correlations[y]);
-        sample->correlations[y].lag = ahp_xc_get_current_channel_auto(index, data) * ahp_xc_get_sampletime();
-    }
-    packet += (ahp_xc_get_nbaselines() + ahp_xc_get_nlines()) * n;
-    free(subpacket);
-    if(ahp_xc.nthreads > 0)
-        ahp_xc.nthreads--;
-    return NULL;
+    free(ahp_xc.subscription.lines);
+    free(ahp_xc.subscription.baselines);
+    free(ahp_xc.subscription.needed);
+    memset(&ahp_xc.subscription, 0, sizeof(subscription_mask));
 }
 
-void ahp_xc_get_autocorrelation(ahp_xc_sample *sample, int32_t index, const char *data, double lag)
+static void alloc_subscription()
 {
-    if(!ahp_xc.mutexes_initialized)
+    subscription_mask *mask = &ahp_xc.subscription;
+    free_subscription();
+    mask->lines = (unsigned char*)xc_calloc(ahp_xc.nlines, 1);
+    mask->baselines = (unsigned char*)xc_calloc(ahp_xc.nbaselines > 0 ? ahp_xc.nbaselines : 1, 1);
+    mask->needed = (unsigned char*)xc_calloc(ahp_xc.nlines, 1);
+    if(mask->lines == NULL || mask->baselines == NULL || mask->needed == NULL)
+        free_subscription();
+}
+
+static void set_masked(unsigned char *masked, int32_t value)
+{
+    value = (value != 0);
+    if(*masked && !value)
+        ahp_xc.subscription.nmasked--;
+    else if(!*masked && value)
+        ahp_xc.subscription.nmasked++;
+    *masked = (unsigned char)value;
+}
+
+static int32_t decode_values()
+{
+    return ahp_xc.nvalues > 0 && !ahp_xc.validate_only && ahp_xc.subscription.nmasked == 0;
+}
+
+static void consume_frame(int32_t len)
+{
+    ahp_xc.rx_len -= len;
+    if(ahp_xc.rx_len > 0)
+        memmove(ahp_xc.tmp_buf, ahp_xc.tmp_buf+len, ahp_xc.rx_len);
+}
+
+static double host_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (double)now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static void close_segment()
+{
+    recording_state *recording = &ahp_xc.recording;
+    if(recording->header == NULL)
         return;
-    ahp_xc.autocorrelation_thread_args[index].sample = sample;
-    ahp_xc.autocorrelation_thread_args[index].index = index;
-    ahp_xc.autocorrelation_thread_args[index].data = data;
-    ahp_xc.autocorrelation_thread_args[index].lag = lag;
-    _get_autocorrelation(&ahp_xc.autocorrelation_thread_args[index]);
+#ifndef _WIN32
+    recording_header *header = recording->header;
+    off_t used = (off_t)(header->data_offset + header->count * header->record_size);
+    munmap(recording->map, recording->segment_size);
+    if(ftruncate(recording->fd, used))
+        pwarn("cannot trim the recording segment: %s\n", strerror(errno));
+    close(recording->fd);
+#endif
+    recording->map = NULL;
+    recording->header = NULL;
+    recording->fd = -1;
 }
 
-static int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent)
+static int32_t open_segment()
 {
-    if(!ahp_xc.detected) return 0;
-    int32_t r = -1;
-    uint32_t i = 0;
-    uint32_t x = 0;
-    uint32_t y = 0;
-    int32_t s = 0;
-    *autocorrelations = NULL;
-    (*percent) = 0;
-    r++;
-    size_t len = 0;
-    size_t size = 0;
-    for(i = 0; i < nlines; i++) {
-        lines[i].start = (lines[i].start < ahp_xc_get_delaysize()-2 ? lines[i].start : (off_t)ahp_xc_get_delaysize()-2);
-        lines[i].len = (lines[i].start+(off_t)lines[i].len < ahp_xc_get_delaysize() ? (off_t)lines[i].len : (off_t)ahp_xc_get_delaysize()-1-lines[i].start);
-        len = fmax(len, lines[i].len/lines[i].step);
-        size += lines[i].len/lines[i].step;
-    }
-    ahp_xc_sample *correlations = ahp_xc_alloc_samples(size, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
-    char* data = (char*)malloc(ahp_xc_get_packetsize()*(len+1));
-    for(i = 0; i < nlines; i++) {
-        ahp_xc_select_input(lines[i].index);
-        int capture_flags = ahp_xc_get_capture_flags();
-        ahp_xc_set_capture_flags(capture_flags & ~CAP_EXTRA_CMD);
-        ahp_xc_select_input(lines[i].index);
-        ahp_xc_send_command(CLEAR, SET_DELAY);
-        ahp_xc_set_capture_flags(capture_flags);
-        ahp_xc_set_channel_auto(lines[i].index, lines[i].start, lines[i].len, lines[i].step);
-        ahp_xc_start_autocorrelation_scan(lines[i].index);
+    recording_state *recording = &ahp_xc.recording;
+    close_segment();
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    uint64_t size = recording->segment_size;
+    uint32_t packetsize = ahp_xc_get_packetsize();
+    uint32_t record_size = (uint32_t)((sizeof(recording_record) + packetsize + 7) & ~7);
+    uint64_t capacity = (size - RECORDING_PAGE_SIZE) * RECORDING_INDEX_INTERVAL / ((uint64_t)record_size * RECORDING_INDEX_INTERVAL + sizeof(recording_index));
+    uint64_t index_capacity = capacity / RECORDING_INDEX_INTERVAL + 1;
+    uint64_t data_offset = (RECORDING_PAGE_SIZE + index_capacity * sizeof(recording_index) + RECORDING_PAGE_SIZE - 1) & ~(uint64_t)(RECORDING_PAGE_SIZE - 1);
+    if(size < data_offset + record_size)
+        return -EINVAL;
+    char *name = (char*)xc_malloc(strlen(recording->path) + 32);
+    if(name == NULL)
+        return -ENOMEM;
+    int fd = -1;
+    while(fd < 0) {
+        sprintf(name, "%s/segment-%06u.xcr", recording->path, recording->segment++);
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if(fd < 0 && errno != EEXIST) {
+            int32_t err = -errno;
+            free(name);
+            return err;
+        }
     }
-    i = 0;
-    ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
-    serial_flush_rx();
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
-    while(i < len) {
-        if(*interrupt)
-            break;
-        unsigned char *buf = (unsigned char*)malloc(ahp_xc_get_packetsize());
-        serial_read((unsigned char*)buf, ahp_xc_get_packetsize());
-        memcpy(data+i*ahp_xc_get_packetsize(), buf+1, ahp_xc_get_packetsize()-1);
-        *((char*)data+i*ahp_xc_get_packetsize()+ahp_xc_get_packetsize()) = '\r';
-        i++;
-        free(buf);
-        (*percent) += 100.0 / len;
-        r++;
+    free(name);
+    char *map = NULL;
+    if(!ftruncate(fd, (off_t)size))
+        map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == NULL || map == MAP_FAILED) {
+        int32_t err = -errno;
+        close(fd);
+        return err;
     }
-    i = 0;
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    madvise(map, size, MADV_SEQUENTIAL);
+    recording_header *header = (recording_header*)map;
+    memcpy(header->magic, RECORDING_MAGIC, sizeof(header->magic));
+    header->version = RECORDING_VERSION;
+    header->header_len = ahp_xc.header_len;
+    memcpy(header->header, ahp_xc.header, ahp_xc.header_len);
+    header->packetsize = packetsize;
+    header->record_size = record_size;
+    header->index_interval = RECORDING_INDEX_INTERVAL;
+    header->index_offset = RECORDING_PAGE_SIZE;
+    header->index_capacity = index_capacity;
+    header->data_offset = data_offset;
+    header->capacity = (size - data_offset) / record_size;
+    recording->fd = fd;
+    recording->map = map;
+    recording->header = header;
+    recording->last_timestamp = 0;
+    return 0;
+#endif
+}
+
+/**
+* \brief Append a validated frame to the current segment
+* A new segment is started when the current one is full or the device timestamp goes back,
+* so that the records of each segment are sorted by timestamp.
+*/
+static void record_frame(const char *frame, double timestamp)
+{
+    recording_state *recording = &ahp_xc.recording;
+    recording_header *header = recording->header;
+    if(header == NULL || header->count >= header->capacity || timestamp < recording->last_timestamp) {
+        if(open_segment()) {
+            perr("cannot open a recording segment in %s, recording stopped\n", recording->path);
+            recording->running = 0;
+            return;
+        }
+        header = recording->header;
+    }
+    uint64_t count = header->count;
+    uint64_t offset = header->data_offset + count * header->record_size;
+    recording_record *record = (recording_record*)(recording->map + offset);
+    record->host_time = host_time();
+    record->timestamp = timestamp;
+    memcpy(record + 1, frame, header->packetsize - 1);
+    ((char*)(record + 1))[header->packetsize - 1] = '\r';
+    if(count % header->index_interval == 0 && header->nindex < header->index_capacity) {
+        recording_index *index = (recording_index*)(recording->map + header->index_offset);
+        index[header->nindex].timestamp = timestamp;
+        index[header->nindex].offset = offset;
+        __atomic_store_n(&header->nindex, header->nindex + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&header->count, count + 1, __ATOMIC_RELEASE);
+    recording->last_timestamp = timestamp;
+    __atomic_add_fetch(&recording->recorded, 1, __ATOMIC_RELAXED);
+}
+
+static const recording_header *check_segment(const char *map, uint64_t size)
+{
+    const recording_header *header = (const recording_header*)map;
+    if(size < RECORDING_PAGE_SIZE || memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) || header->version != RECORDING_VERSION)
+        return NULL;
+    if(header->index_interval < 1 || header->record_size < sizeof(recording_record) + header->packetsize ||
+       header->index_offset + header->index_capacity * sizeof(recording_index) > header->data_offset ||
+       header->data_offset + header->count * header->record_size > size || header->nindex > header->index_capacity)
+        return NULL;
+    return header;
+}
+
+/**
+* \brief Find the first record of a segment whose device timestamp is not earlier than timestamp
+* The first index entry not earlier than timestamp bounds the search to the index_interval records
+* before it, so repeated timestamps spanning an index boundary resolve to their first record.
+* \return Returns the record number, or the record count if every record is earlier
+*/
+static uint64_t find_record(const char *map, const recording_header *header, double timestamp)
+{
+    const recording_index *index = (const recording_index*)(map + header->index_offset);
+    uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    uint64_t nindex = __atomic_load_n(&header->nindex, __ATOMIC_ACQUIRE);
+    uint64_t lo = 0;
+    uint64_t hi = nindex;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(index[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    hi = (lo < nindex ? lo * header->index_interval : count);
+    lo = (lo > 0 ? (lo - 1) * header->index_interval : 0);
+    if(hi > count)
+        hi = count;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const recording_record *record = (const recording_record*)(map + header->data_offset + mid * header->record_size);
+        if(record->timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void replay_close_segment()
+{
+    replay_state *replay = &ahp_xc.replay;
+#ifndef _WIN32
+    if(replay->map != NULL)
+        munmap(replay->map, replay->map_size);
+#endif
+    replay->map = NULL;
+    replay->map_size = 0;
+    replay->header = NULL;
+    replay->record = 0;
+    replay->offset = 0;
+}
+
+static int32_t replay_open_segment(uint32_t index)
+{
+    replay_state *replay = &ahp_xc.replay;
+    replay_close_segment();
+    replay->segment = index;
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    struct stat st;
+    int fd = open(replay->segments[index], O_RDONLY);
+    if(fd < 0)
+        return -errno;
+    if(fstat(fd, &st)) {
+        close(fd);
+        return -errno;
+    }
+    char *map = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -errno;
+    replay->map = map;
+    replay->map_size = (uint64_t)st.st_size;
+    replay->header = check_segment(map, replay->map_size);
+    if(replay->header == NULL || (ahp_xc.header_len > 0 && ((int32_t)replay->header->header_len != ahp_xc.header_len ||
+       memcmp(replay->header->header, ahp_xc.header, ahp_xc.header_len) || replay->header->packetsize != ahp_xc_get_packetsize()))) {
+        perr("%s is not a recording of this device\n", replay->segments[index]);
+        replay_close_segment();
+        return -EINVAL;
+    }
+    madvise(map, replay->map_size, MADV_SEQUENTIAL);
+    madvise(map, replay->map_size, MADV_WILLNEED);
+    return 0;
+#endif
+}
+
+static void free_replay()
+{
+    replay_state *replay = &ahp_xc.replay;
+    uint32_t x;
+    replay_close_segment();
+    for(x = 0; x < replay->nsegments; x++)
+        free(replay->segments[x]);
+    free(replay->segments);
+    memset(replay, 0, sizeof(replay_state));
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+    return strcmp(*(char * const*)a, *(char * const*)b);
+}
+
+static int32_t list_segments(const char *path)
+{
+    replay_state *replay = &ahp_xc.replay;
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    struct stat st;
+    if(stat(path, &st))
+        return -errno;
+    if(!S_ISDIR(st.st_mode)) {
+        replay->segments = (char**)xc_malloc(sizeof(char*));
+        if(replay->segments == NULL || (replay->segments[0] = strdup(path)) == NULL)
+            return -ENOMEM;
+        replay->nsegments = 1;
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+        return -errno;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if(len < 4 || strcmp(entry->d_name + len - 4, ".xcr"))
+            continue;
+        char **segments = (char**)xc_realloc(replay->segments, sizeof(char*) * (replay->nsegments + 1));
+        char *name = (char*)xc_malloc(strlen(path) + len + 2);
+        if(segments == NULL || name == NULL) {
+            if(segments != NULL)
+                replay->segments = segments;
+            free(name);
+            closedir(dir);
+            return -ENOMEM;
+        }
+        sprintf(name, "%s/%s", path, entry->d_name);
+        replay->segments = segments;
+        replay->segments[replay->nsegments++] = name;
+    }
+    closedir(dir);
+    if(replay->nsegments == 0)
+        return -ENOENT;
+    qsort(replay->segments, replay->nsegments, sizeof(char*), compare_segments);
+    return 0;
+#endif
+}
+
+static void replay_pace(double time)
+{
+    replay_state *replay = &ahp_xc.replay;
+    struct timespec now;
+    if(replay->speed <= 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double clock = (double)now.tv_sec + now.tv_nsec / 1000000000.0;
+    if(!replay->started) {
+        replay->start_time = time;
+        replay->start_clock = clock;
+        replay->started = 1;
+        return;
+    }
+    double wait = replay->start_clock + (time - replay->start_time) / replay->speed - clock;
+    if(wait > 0) {
+        struct timespec delay;
+        delay.tv_sec = (time_t)wait;
+        delay.tv_nsec = (long)((wait - (double)delay.tv_sec) * 1000000000.0);
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+* \brief Read the next bytes of the recorded stream in place of the serial port
+* Frames are released at the pace they were received, scaled by the replay speed.
+* \return Returns the number of bytes copied, 0 at the end of the recording
+*/
+static int replay_read(unsigned char *buf, int len)
+{
+    replay_state *replay = &ahp_xc.replay;
+    while(replay->header == NULL || replay->record >= __atomic_load_n(&replay->header->count, __ATOMIC_ACQUIRE)) {
+        if(replay->finished || replay->segment + 1 >= replay->nsegments || replay_open_segment(replay->segment + 1)) {
+            replay->finished = 1;
+            return 0;
+        }
+    }
+    const recording_header *header = replay->header;
+    const recording_record *record = (const recording_record*)(replay->map + header->data_offset + replay->record * header->record_size);
+    if(replay->offset == 0)
+        replay_pace(record->host_time);
+    uint32_t n = header->packetsize - replay->offset;
+    if((uint32_t)len < n)
+        n = (uint32_t)len;
+    memcpy(buf, (const char*)(record + 1) + replay->offset, n);
+    replay->offset += n;
+    if(replay->offset == header->packetsize) {
+        replay->offset = 0;
+        replay->record++;
+        __atomic_add_fetch(&replay->replayed, 1, __ATOMIC_RELAXED);
+    }
+    return (int)n;
+}
+
+static int grab_packet(double *timestamp)
+{
+    errno = 0;
+    uint32_t size = ahp_xc_get_packetsize();
+    ahp_xc.buf_len = size;
+    if(!ahp_xc.connected){
+        errno = ENOENT;
+        goto err_end;
+    }
+    int32_t nread = 0;
+    int32_t scanned = 0;
+    int32_t skipped = 0;
+    int32_t ntries = 3;
+    char *eop = NULL;
+    while(eop == NULL) {
+        if(ahp_xc.rx_len > scanned)
+            eop = (char*)memchr(ahp_xc.tmp_buf+scanned, '\r', ahp_xc.rx_len-scanned);
+        if(eop != NULL) {
+            nread = (int32_t)(eop-ahp_xc.tmp_buf)+1;
+            if(nread < 2 && !skipped) {
+                consume_frame(nread);
+                skipped = 1;
+                scanned = 0;
+                eop = NULL;
+            }
+            continue;
+        }
+        scanned = ahp_xc.rx_len;
+        if(ahp_xc.rx_len >= ahp_xc.buf_size) {
+            ahp_xc.rx_len = 0;
+            scanned = 0;
+        }
+        int32_t want = (int32_t)size > ahp_xc.rx_len ? (int32_t)size - ahp_xc.rx_len : 1;
+        if(want > ahp_xc.buf_size - ahp_xc.rx_len)
+            want = ahp_xc.buf_size - ahp_xc.rx_len;
+        int n = (ahp_xc.replay.active ? replay_read((unsigned char*)ahp_xc.tmp_buf+ahp_xc.rx_len, want) :
+                 serial_read_some((unsigned char*)ahp_xc.tmp_buf+ahp_xc.rx_len, want));
+        if(n < 1) {
+            if(--ntries > 0)
+                continue;
+            errno = ETIMEDOUT;
+            goto err_end;
+        }
+        ahp_xc.rx_len += n;
+    }
+    ahp_xc.tmp_buf[nread-1] = '\0';
+    if(nread < 3) {
+        errno = ENODATA;
+    } else {
+        if(ahp_xc.header_len > 0) {
+            if(nread != (int32_t)size)
+                errno = EINVAL;
+            else if(memcmp(ahp_xc_get_header(), ahp_xc.tmp_buf, ahp_xc.header_len))
+                errno = EPERM;
+            else if(decode_values())
+                errno = decode_frame(ahp_xc.tmp_buf, ahp_xc.tmp_values);
+            else
+                errno = calc_checksum((char*)ahp_xc.tmp_buf);
+        }
+    }
+    if(errno) {
+        consume_frame(nread);
+        goto err_end;
+    }
+    if(timestamp != NULL || ahp_xc.recording.running) {
+        double frame_time = get_timestamp(ahp_xc.tmp_buf);
+        if(timestamp != NULL)
+            *timestamp = frame_time;
+        if(ahp_xc.recording.running)
+            record_frame(ahp_xc.tmp_buf, frame_time);
+    }
+    char *frame = ahp_xc.tmp_buf;
+    ahp_xc.tmp_buf = ahp_xc.buf;
+    ahp_xc.buf = frame;
+    ahp_xc.values_frame = NULL;
+    if(ahp_xc.header_len > 0 && decode_values()) {
+        int64_t *values = ahp_xc.tmp_values;
+        ahp_xc.tmp_values = ahp_xc.values;
+        ahp_xc.values = values;
+        ahp_xc.values_frame = frame;
+    }
+    ahp_xc.rx_len -= nread;
+    if(ahp_xc.rx_len > 0)
+        memcpy(ahp_xc.tmp_buf, frame+nread, ahp_xc.rx_len);
+    return 0;
+err_end:
+    fprintf(stderr, "%s error: %s\n", __func__, strerror(errno));
+    return -1;
+}
+
+static int32_t flush_commands()
+{
+    command_batch *batch = &ahp_xc.commands;
+    int32_t err = 0;
+    if(batch->len > 0 && !ahp_xc.replay.active)
+        err = serial_write(batch->buf, batch->len);
+    batch->len = 0;
+    return (err < 0 ? err : 0);
+}
+
+static int32_t emit_command(xc_cmd cmd, unsigned char value)
+{
+    if(!ahp_xc.connected) return -ENOENT;
+    int32_t err = 0;
+    unsigned char c = (unsigned char)(cmd|(value<<4));
+    command_batch *batch = &ahp_xc.commands;
+    if(batch->depth > 0) {
+        if(batch->len == sizeof(batch->buf))
+            err = flush_commands();
+        perr("%02X ", c);
+        batch->buf[batch->len++] = c;
+        return err;
+    }
+    perr("%02X ", c);
+    if(ahp_xc.replay.active)
+        return 0;
+    err |= serial_write(&c, 1);
+    return err;
+}
+
+static int32_t sync_capture_flags()
+{
+    register_shadow *shadow = &ahp_xc.shadow;
+    if(!shadow->capture_pending)
+        return 0;
+    shadow->capture_pending = 0;
+    if((shadow->known & REG_CAPTURE) && shadow->capture_flags == ahp_xc.capture_flags) {
+        shadow->saved++;
+        return 0;
+    }
+    shadow->capture_flags = ahp_xc.capture_flags;
+    shadow->known |= REG_CAPTURE;
+    return emit_command(ENABLE_CAPTURE, shadow->capture_flags);
+}
+
+static int32_t send_command(xc_cmd cmd, unsigned char value)
+{
+    if(cmd != ENABLE_CAPTURE)
+        sync_capture_flags();
+    return emit_command(cmd, value);
+}
+
+static line_registers *shadow_line(uint32_t index)
+{
+    if(ahp_xc.shadow.lines == NULL || index >= ahp_xc.nlines)
+        return NULL;
+    return &ahp_xc.shadow.lines[index];
+}
+
+static void reset_shadow()
+{
+    register_shadow *shadow = &ahp_xc.shadow;
+    shadow->known = 0;
+    shadow->capture_pending = 0;
+    if(shadow->lines != NULL)
+        memset(shadow->lines, 0, sizeof(line_registers)*ahp_xc.nlines);
+}
+
+static void invalidate_shadow(xc_cmd cmd)
+{
+    register_shadow *shadow = &ahp_xc.shadow;
+    uint32_t bits = 0;
+    uint32_t x;
+    switch(cmd) {
+        case SET_INDEX:
+            shadow->known &= ~REG_INDEX;
+            return;
+        case SET_BAUD_RATE:
+            shadow->known &= ~(REG_RATE|REG_ORDER);
+            return;
+        case ENABLE_CAPTURE:
+            shadow->known &= ~REG_CAPTURE;
+            return;
+        case SET_LEDS:
+            bits = REG_LEDS;
+            break;
+        case SET_VOLTAGE:
+            bits = REG_VOLTAGE;
+            break;
+        case ENABLE_TEST:
+            bits = REG_TEST;
+            break;
+        case CLEAR:
+        case SET_DELAY:
+            bits = REG_AUTO_DELAY|REG_CROSS_DELAY;
+            break;
+        default:
+            reset_shadow();
+            return;
+    }
+    if(shadow->lines == NULL)
+        return;
+    if(shadow->known & REG_INDEX) {
+        shadow->lines[ahp_xc.current_input].known &= ~bits;
+        return;
+    }
+    for(x = 0; x < ahp_xc.nlines; x++)
+        shadow->lines[x].known &= ~bits;
+}
+
+static uint32_t delay_length(off_t value)
+{
+    int len = (((int)log2(value) & ~3) + 4) / 4;
+    return (uint32_t)(len < 1 ? 1 : len);
+}
+
+/**
+* \brief Write both nibbles of a per line register, skipping those the shadow already holds
+* With stop_capture the nibbles are written with capture off, as the baseline protocol does for test and voltage.
+*/
+static void write_line_register(uint32_t index, xc_cmd cmd, uint32_t mask, unsigned char *reg, unsigned char lo, unsigned char hi, int32_t stop_capture)
+{
+    line_registers *line = shadow_line(index);
+    uint32_t known_lo = mask & -mask;
+    uint32_t known_hi = mask & ~known_lo;
+    int32_t send_lo = (line == NULL || !(line->known & known_lo) || (*reg & 0xf) != lo);
+    int32_t send_hi = (line == NULL || !(line->known & known_hi) || (*reg >> 4) != hi);
+    ahp_xc.shadow.saved += !send_lo + !send_hi;
+    if(!send_lo && !send_hi)
+        return;
+    int flags = ahp_xc_get_capture_flags();
+    ahp_xc_begin_commands();
+    ahp_xc_select_input(index);
+    if(send_lo) {
+        ahp_xc_set_capture_flags((xc_capture_flags)(stop_capture ? 0 : flags&~CAP_EXTRA_CMD));
+        send_command(cmd, lo);
+    }
+    if(send_hi) {
+        ahp_xc_set_capture_flags((xc_capture_flags)(stop_capture ? CAP_EXTRA_CMD : flags|CAP_EXTRA_CMD));
+        send_command(cmd, hi);
+    }
+    ahp_xc_set_capture_flags((xc_capture_flags)flags);
+    ahp_xc_end_commands();
+    if(line != NULL) {
+        *reg = (unsigned char)(lo | (hi << 4));
+        line->known |= mask;
+    }
+}
+
+/**
+* \brief Record and write the step, size and start delay registers of a line, skipping them if the shadow already holds them
+* The cross delays are written with CAP_EXTRA_CMD and the auto delays without it, with keep_capture
+* the other capture flags are kept so a scan can reprogram a line while another one streams.
+*/
+static void write_channel_delays(uint32_t index, off_t value, size_t size, size_t step, int32_t cross, int32_t keep_capture)
+{
+    int32_t idx = 0;
+    if(value+size >= ahp_xc_get_delaysize())
+        return;
+    ahp_xc_scan_request *channel = (cross ? &ahp_xc.cross_channel[index] : &ahp_xc.auto_channel[index]);
+    channel->start = value;
+    channel->len = size;
+    channel->step = step;
+    int capture_flags = ahp_xc_get_capture_flags();
+    int delay_flags = cross ? CAP_EXTRA_CMD : 0;
+    int flags = ahp_xc_get_test_flags(index)&~TEST_STEP;
+    line_registers *line = shadow_line(index);
+    off_t delay[3] = { value, (off_t)size, (off_t)step };
+    off_t *shadow = (line == NULL ? NULL : (cross ? line->cross_delay : line->auto_delay));
+    uint32_t known = (cross ? REG_CROSS_DELAY : REG_AUTO_DELAY);
+    if(line != NULL && (line->known & known) && !memcmp(shadow, delay, sizeof(delay))) {
+        ahp_xc.shadow.saved += 7 + delay_length(value) + delay_length(size) + delay_length(step);
+        ahp_xc_set_test_flags(index, flags|TEST_STEP);
+        return;
+    }
+    if(keep_capture)
+        delay_flags |= capture_flags&~CAP_EXTRA_CMD;
+    int len = (((int)log2(step) & ~3) + 4) / 4;
+    if(len < 0) len = 1;
+    ahp_xc_begin_commands();
+    ahp_xc_set_test_flags(index, flags);
+    ahp_xc_set_capture_flags((xc_capture_flags)delay_flags);
+    ahp_xc_select_input(index);
+    send_command(CLEAR, SET_DELAY);
+    send_command(CLEAR, CLEAR);
+    send_command(SET_DELAY, (unsigned char)(len&0xf));
+    for(idx = 0; idx < len; idx ++) {
+        send_command(SET_DELAY, (unsigned char)(step&0xf));
+        step >>= 4;
+    }
+    len = (((int)log2(size) & ~3) + 4) / 4;
+    if(len < 0) len = 1;
+    ahp_xc_select_input(index);
+    ahp_xc_set_test_flags(index, flags|0x10);
+    send_command(CLEAR, CLEAR);
+    send_command(SET_DELAY, (unsigned char)(len&0xf));
+    for(idx = 0; idx < len; idx ++) {
+        send_command(SET_DELAY, (unsigned char)(size&0xf));
+        size >>= 4;
+    }
+    len = (((int)log2(value) & ~3) + 4) / 4;
+    if(len < 0) len = 1;
+    ahp_xc_select_input(index);
+    ahp_xc_set_test_flags(index, flags|0x20);
+    send_command(CLEAR, CLEAR);
+    send_command(SET_DELAY, (unsigned char)(len&0xf));
+    for(idx = 0; idx < len; idx ++) {
+        send_command(SET_DELAY, (unsigned char)(value&0xf));
+        value >>= 4;
+    }
+    ahp_xc_set_test_flags(index, flags|TEST_STEP);
+    ahp_xc_set_capture_flags((xc_capture_flags)capture_flags);
+    ahp_xc_end_commands();
+    if(line != NULL) {
+        memcpy(shadow, delay, sizeof(delay));
+        line->known |= known;
+    }
+}
+
+void ahp_xc_begin_commands()
+{
+    ahp_xc.commands.depth++;
+}
+
+int32_t ahp_xc_end_commands()
+{
+    command_batch *batch = &ahp_xc.commands;
+    if(batch->depth == 0)
+        return 0;
+    if(batch->depth == 1)
+        sync_capture_flags();
+    if(--batch->depth > 0)
+        return 0;
+    if(!ahp_xc.connected) {
+        batch->len = 0;
+        return -ENOENT;
+    }
+    return flush_commands();
+}
+
+int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value)
+{
+    if(!ahp_xc.connected) return -ENOENT;
+    invalidate_shadow(cmd == CLEAR && value != CLEAR ? (xc_cmd)value : cmd);
+    if(cmd == ENABLE_CAPTURE)
+        ahp_xc.shadow.capture_pending = 0;
+    return send_command(cmd, value);
+}
+
+uint64_t ahp_xc_get_saved_commands()
+{
+    return ahp_xc.shadow.saved;
+}
+
+void ahp_xc_invalidate_registers()
+{
+    reset_shadow();
+}
+
+uint32_t ahp_xc_current_input()
+{
+    return ahp_xc.current_input;
+}
+
+void ahp_xc_select_input(uint32_t index)
+{
+    if(!ahp_xc.detected) return;
+    int32_t idx = 0;
+    uint32_t value = index;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    int len = (((int)log2(ahp_xc_get_nlines()) & ~3) + 4) / 4;
+    if(len < 0) len = 1;
+    if((ahp_xc.shadow.known & REG_INDEX) && (uint32_t)ahp_xc.current_input == index) {
+        ahp_xc.shadow.saved += len + 2;
+        return;
+    }
+    ahp_xc_begin_commands();
+    send_command(CLEAR, SET_INDEX);
+    send_command(SET_INDEX, (unsigned char)(len&0xf));
+    for(idx = 0; idx < len; idx ++) {
+        send_command(SET_INDEX, (unsigned char)(value&0xf));
+        value >>= 4;
+    }
+    ahp_xc_end_commands();
+    ahp_xc.current_input = index;
+    ahp_xc.shadow.known |= REG_INDEX;
+}
+
+void ahp_xc_enable_crosscorrelator(int32_t enable)
+{
+    if(!ahp_xc.detected) return;
+    ahp_xc.correlator_enabled = enable;
+}
+
+void ahp_xc_enable_intensity_crosscorrelator(int32_t enable)
+{
+    if(!ahp_xc.detected) return;
+    ahp_xc.intensity_correlator_enabled = enable;
+}
+
+void ahp_xc_enable_reader_thread(int32_t enable)
+{
+    ahp_xc.reader_thread_enabled = enable;
+    if(!ahp_xc.connected || ahp_xc.replay.active) return;
+    if(enable)
+        serial_start_reader();
+    else
+        serial_stop_reader();
+}
+
+int32_t ahp_xc_reader_thread_enabled()
+{
+    return ahp_xc.reader_thread_enabled && serial_reader_running();
+}
+
+void ahp_xc_enable_fused_decode(int32_t enable)
+{
+    ahp_xc.fused_decode = enable;
+}
+
+int32_t ahp_xc_fused_decode_enabled()
+{
+    return ahp_xc.fused_decode;
+}
+
+void ahp_xc_enable_concurrent_scan(int32_t enable)
+{
+    ahp_xc.concurrent_scan = enable;
+}
+
+int32_t ahp_xc_concurrent_scan_enabled()
+{
+    return ahp_xc.concurrent_scan;
+}
+
+void ahp_xc_enable_fast_phase_magnitude(int32_t enable)
+{
+    ahp_xc.fast_phase_magnitude = enable;
+}
+
+int32_t ahp_xc_fast_phase_magnitude_enabled()
+{
+    return ahp_xc.fast_phase_magnitude;
+}
+
+void ahp_xc_enable_lazy_phase_magnitude(int32_t enable)
+{
+    ahp_xc.lazy_phase_magnitude = enable;
+}
+
+int32_t ahp_xc_lazy_phase_magnitude_enabled()
+{
+    return ahp_xc.lazy_phase_magnitude;
+}
+
+void ahp_xc_get_sample_phase_magnitude(ahp_xc_sample *sample)
+{
+    uint64_t x;
+    if(sample == NULL || sample->correlations == NULL)
+        return;
+    for(x = 0; x < sample->lag_size; x++) {
+        if(isnan(sample->correlations[x].magnitude))
+            complex_phase_magnitude(&sample->correlations[x]);
+    }
+}
+
+static void planes_phase_magnitude(const int64_t *real, const int64_t *imaginary, const uint64_t *counts, double *magnitude, double *phase, uint64_t len)
+{
+    uint64_t x;
+    for(x = 0; x < len; x++) {
+        if(isnan(magnitude[x]))
+            phase_magnitude(real[x], imaginary[x], counts[x], &magnitude[x], &phase[x]);
+    }
+}
+
+void ahp_xc_get_planes_phase_magnitude(ahp_xc_packet_planes *packet)
+{
+    if(packet == NULL)
+        return;
+    planes_phase_magnitude(packet->auto_real, packet->auto_imaginary, packet->auto_counts, packet->auto_magnitude, packet->auto_phase, packet->n_lines * packet->auto_lag);
+    planes_phase_magnitude(packet->cross_real, packet->cross_imaginary, packet->cross_counts, packet->cross_magnitude, packet->cross_phase, packet->n_baselines * packet->cross_lag);
+}
+
+int32_t ahp_xc_intensity_crosscorrelator_enabled()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.intensity_correlator_enabled != 0 || !ahp_xc_has_crosscorrelator();
+}
+
+int32_t ahp_xc_has_crosscorrelator()
+{
+    if(!ahp_xc.detected) return 0;
+    return (ahp_xc.flags & HAS_CROSSCORRELATOR ? ahp_xc.correlator_enabled : 0);
+}
+
+int32_t ahp_xc_has_psu()
+{
+    if(!ahp_xc.detected) return 0;
+    return (ahp_xc.flags & HAS_PSU ? 1 : 0);
+}
+
+int32_t ahp_xc_has_leds()
+{
+    if(!ahp_xc.detected) return 0;
+    return (ahp_xc.flags & HAS_LEDS ? 1 : 0);
+}
+
+int32_t ahp_xc_has_cumulative_only()
+{
+    if(!ahp_xc.detected) return 0;
+    return (ahp_xc.flags & HAS_CUMULATIVE_ONLY ? 1 : 0);
+}
+
+char* ahp_xc_get_header()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.header;
+}
+
+int32_t ahp_xc_get_baudrate()
+{
+    return ahp_xc.baserate << ahp_xc.rate;
+}
+
+uint32_t ahp_xc_get_bps()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.bps;
+}
+
+uint32_t ahp_xc_get_nlines()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.nlines;
+}
+
+uint32_t ahp_xc_get_nbaselines()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - 1) / 2;
+}
+
+uint32_t ahp_xc_get_npolytopes(int32_t order)
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - order + 1) / order;
+}
+
+uint32_t ahp_xc_get_delaysize()
+{
+    if(!ahp_xc.detected) return 0;
+    if(ahp_xc.delaysize == 0 || ahp_xc.delaysize == 4)
+        return pow(2, 24);
+    return ahp_xc.delaysize * 17;
+}
+
+uint32_t ahp_xc_get_autocorrelator_lagsize()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.auto_lagsize;
+}
+
+uint32_t ahp_xc_get_crosscorrelator_lagsize()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.cross_lagsize;
+}
+
+double ahp_xc_get_frequency()
+{
+    if(!ahp_xc.detected) return 0;
+    return ahp_xc.frequency;
+}
+
+double ahp_xc_get_sampletime()
+{
+    return (double)1.0/ahp_xc_get_frequency();
+}
+
+double ahp_xc_get_packettime()
+{
+    return 9.0  * (double)ahp_xc_get_packetsize() / (double)ahp_xc_get_baudrate();
+}
+
+uint32_t ahp_xc_get_packetsize()
+{
+    return ahp_xc.packetsize;
+}
+
+int32_t ahp_xc_get_fd()
+{
+    return serial_get_fd();
+}
+
+int32_t ahp_xc_connect_fd(int32_t fd)
+{
+    if(ahp_xc.detected)
+        return 0;
+    ahp_xc.connected = 0;
+    ahp_xc.detected = 0;
+    ahp_xc.bps = 0;
+    ahp_xc.nlines = 0;
+    ahp_xc.nbaselines = 0;
+    ahp_xc.delaysize = 0;
+    ahp_xc.frequency = 0;
+    ahp_xc.packetsize = 4096;
+    ahp_xc.rate = R_BASE;
+    ahp_xc.fused_decode = 1;
+    if(fd > -1) {
+        ahp_xc.connected = 1;
+        ahp_xc.buf = NULL;
+        ahp_xc.tmp_buf = NULL;
+        ahp_xc.rx_len = 0;
+        alloc_buffers(ahp_xc.packetsize);
+        ahp_xc.detected = 0;
+        serial_set_fd(fd, XC_BASE_RATE);
+        if(ahp_xc.reader_thread_enabled)
+            serial_start_reader();
+        if(!ahp_xc.mutexes_initialized) {
+            pthread_mutex_init(&ahp_xc.mutex, &ahp_serial_mutex_attr);
+            ahp_xc.mutexes_initialized = 1;
+        }
+        ahp_xc.current_input = 0;
+        ahp_xc.commands.depth = 0;
+        ahp_xc.commands.len = 0;
+        reset_shadow();
+        ahp_xc_get_properties();
+    }
+    if(!ahp_xc.detected)
+        ahp_xc_disconnect();
+    ahp_xc.connected = ahp_xc.detected;
+    return !ahp_xc.detected;
+}
+
+int32_t ahp_xc_connect_replay(const char *path, double speed)
+{
+    replay_state *replay = &ahp_xc.replay;
+    if(ahp_xc.detected)
+        return 0;
+    if(path == NULL)
+        return -EINVAL;
+    ahp_xc.connected = 0;
+    ahp_xc.detected = 0;
+    ahp_xc.bps = 0;
+    ahp_xc.nlines = 0;
+    ahp_xc.nbaselines = 0;
+    ahp_xc.delaysize = 0;
+    ahp_xc.frequency = 0;
+    ahp_xc.packetsize = 4096;
+    ahp_xc.rate = R_BASE;
+    ahp_xc.fused_decode = 1;
+    ahp_xc.correlator_enabled = 1;
+    free_replay();
+    int32_t err = list_segments(path);
+    if(!err)
+        err = replay_open_segment(0);
+    if(err) {
+        free_replay();
+        return err;
+    }
+    replay->speed = speed;
+    replay->active = 1;
+    ahp_xc.connected = 1;
+    ahp_xc.buf = NULL;
+    ahp_xc.tmp_buf = NULL;
+    ahp_xc.rx_len = 0;
+    alloc_buffers(ahp_xc.packetsize);
+    ahp_xc.current_input = 0;
+    ahp_xc.commands.depth = 0;
+    ahp_xc.commands.len = 0;
+    reset_shadow();
+    ahp_xc_get_properties();
+    if(ahp_xc.detected && replay_open_segment(0))
+        ahp_xc.detected = 0;
+    if(!ahp_xc.detected) {
+        ahp_xc_disconnect();
+        return -EINVAL;
+    }
+    ahp_xc.rx_len = 0;
+    replay->finished = 0;
+    replay->started = 0;
+    replay->replayed = 0;
+    return 0;
+}
+
+int32_t ahp_xc_replay_running()
+{
+    return ahp_xc.replay.active && !ahp_xc.replay.finished;
+}
+
+uint64_t ahp_xc_get_replayed_packets()
+{
+    return __atomic_load_n(&ahp_xc.replay.replayed, __ATOMIC_RELAXED);
+}
+
+int32_t ahp_xc_connect(const char *port)
+{
+    if(ahp_xc.detected)
+        return 0;
+    sleep(1);
+    ahp_xc.current_input = 0;
+    ahp_xc.commands.depth = 0;
+    ahp_xc.commands.len = 0;
+    reset_shadow();
+    ahp_xc.connected = 0;
+    ahp_xc.detected = 0;
+    ahp_xc.bps = 0;
+    ahp_xc.nlines = 0;
+    ahp_xc.nbaselines = 0;
+    ahp_xc.delaysize = 0;
+    ahp_xc.frequency = 1;
+    ahp_xc.max_threads = 1;
+    ahp_xc.max_lost_packets = 1;
+    ahp_xc.packetsize = 4096;
+    ahp_xc.baserate = XC_BASE_RATE;
+    ahp_xc.rate = R_BASE;
+    ahp_xc.correlator_enabled = 1;
+    ahp_xc.fused_decode = 1;
+    strcpy(ahp_xc.comport, port);
+    if(!serial_connect(port, ahp_xc_get_baudrate(), "8N1")) {
+        if(ahp_xc.reader_thread_enabled)
+            serial_start_reader();
+        ahp_xc.connected = 1;
+        ahp_xc.buf = NULL;
+        ahp_xc.tmp_buf = NULL;
+        ahp_xc.rx_len = 0;
+        alloc_buffers(ahp_xc.packetsize);
+        ahp_xc.buf_allocd = 1;
+        ahp_xc.buf[0] = 0;
+        ahp_xc.tmp_buf[0] = 0;
+        ahp_xc.buf_len = 0;
+        ahp_xc.header = (char*)xc_malloc(1);
+        ahp_xc.header_allocd = 1;
+        ahp_xc.header[0] = 0;
+        ahp_xc.header_len = 0;
+        if(!ahp_xc.mutexes_initialized) {
+            pthread_mutex_init(&ahp_xc.mutex, &ahp_serial_mutex_attr);
+            ahp_xc.mutexes_initialized = 1;
+        }
+        ahp_xc_get_properties();
+    }
+    return !ahp_xc.detected;
+}
+static void free_cache(autocorrelation_cache *cache)
+{
+    free(cache->counts);
+    free(cache->magnitude);
+    free(cache->phase);
+    memset(cache, 0, sizeof(autocorrelation_cache));
+}
+
+static int32_t alloc_cache(autocorrelation_cache *cache, uint32_t rows, uint64_t lag_size)
+{
+    if(cache->counts != NULL && cache->rows == rows && cache->lag_size == lag_size)
+        return 0;
+    free_cache(cache);
+    cache->counts = (uint64_t*)xc_malloc(sizeof(uint64_t) * rows * lag_size);
+    cache->magnitude = (double*)xc_malloc(sizeof(double) * rows * lag_size);
+    cache->phase = (double*)xc_malloc(sizeof(double) * rows * lag_size);
+    if(cache->counts == NULL || cache->magnitude == NULL || cache->phase == NULL) {
+        free_cache(cache);
+        return -ENOMEM;
+    }
+    cache->rows = rows;
+    cache->lag_size = lag_size;
+    return 0;
+}
+
+static void free_scratch()
+{
+    uint32_t x;
+    for(x = 0; x < ahp_xc.nscratch; x++) {
+        free_cache(&ahp_xc.scratch[x].autocorrelations);
+        ahp_xc_free_samples(1, ahp_xc.scratch[x].crosscorrelation);
+        free(ahp_xc.scratch[x].counts);
+        free(ahp_xc.scratch[x].magnitude);
+        free(ahp_xc.scratch[x].phase);
+    }
+    free(ahp_xc.scratch);
+    ahp_xc.scratch = NULL;
+    ahp_xc.nscratch = 0;
+    free_cache(&ahp_xc.auto_cache);
+}
+
+static int32_t reserve_scratch(uint32_t count, uint32_t order)
+{
+    uint32_t x;
+    uint64_t auto_lag = ahp_xc_get_autocorrelator_lagsize();
+    uint64_t cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
+    if(count <= ahp_xc.nscratch && order <= ahp_xc.scratch[0].order &&
+       ahp_xc.scratch[0].auto_lag == auto_lag && ahp_xc.scratch[0].cross_lag == cross_lag)
+        return 0;
+    free_scratch();
+    ahp_xc.scratch = (decode_scratch*)xc_calloc(count, sizeof(decode_scratch));
+    if(ahp_xc.scratch == NULL)
+        return -ENOMEM;
+    for(x = 0; x < count; x++) {
+        decode_scratch *scratch = &ahp_xc.scratch[x];
+        scratch->order = order;
+        scratch->auto_lag = auto_lag;
+        scratch->cross_lag = cross_lag;
+        scratch->crosscorrelation = ahp_xc_alloc_samples(1, cross_lag);
+        scratch->counts = (uint64_t*)xc_malloc(sizeof(uint64_t) * cross_lag);
+        scratch->magnitude = (double*)xc_malloc(sizeof(double) * cross_lag);
+        scratch->phase = (double*)xc_malloc(sizeof(double) * cross_lag);
+        ahp_xc.nscratch++;
+        if(alloc_cache(&scratch->autocorrelations, order, auto_lag) || scratch->crosscorrelation == NULL ||
+           scratch->counts == NULL || scratch->magnitude == NULL || scratch->phase == NULL) {
+            free_scratch();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void flush_packet_cache(uint32_t size)
+{
+    pthread_mutex_lock(&ahp_xc.packet_cache_mutex);
+    while(ahp_xc.packet_cache_len > size) {
+        ahp_xc_packet *packet = ahp_xc.packet_cache[--ahp_xc.packet_cache_len];
+        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
+        free(packet);
+    }
+    pthread_mutex_unlock(&ahp_xc.packet_cache_mutex);
+}
+
+void ahp_xc_disconnect()
+{
+    if(ahp_xc.connected) {
+        ahp_xc_stop_acquisition();
+        ahp_xc_stop_recording();
+        if(ahp_xc.detected) {
+            ahp_xc_send_command(CLEAR, SET_INDEX);
+            ahp_xc_send_command(CLEAR, SET_LEDS);
+            ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
+            ahp_xc_send_command(CLEAR, SET_VOLTAGE);
+            ahp_xc_send_command(CLEAR, SET_DELAY);
+            ahp_xc_send_command(CLEAR, ENABLE_TEST);
+            ahp_xc_send_command(CLEAR, CLEAR);
+        }
+        if(ahp_xc.mutexes_initialized) {
+            pthread_mutex_unlock(&ahp_xc.mutex);
+            pthread_mutex_destroy(&ahp_xc.mutex);
+            ahp_xc.mutexes_initialized = 0;
+        }
+        free(ahp_xc.buf);
+        free(ahp_xc.tmp_buf);
+        free(ahp_xc.header);
+        ahp_xc.buf = NULL;
+        ahp_xc.tmp_buf = NULL;
+        ahp_xc.header = NULL;
+        ahp_xc.header_len = 0;
+        ahp_xc.buf_size = 0;
+        ahp_xc.rx_len = 0;
+        free(ahp_xc.values);
+        free(ahp_xc.tmp_values);
+        ahp_xc.values = NULL;
+        ahp_xc.tmp_values = NULL;
+        ahp_xc.values_frame = NULL;
+        ahp_xc.nvalues = 0;
+        free(ahp_xc.shadow.lines);
+        ahp_xc.shadow.lines = NULL;
+        ahp_xc.shadow.known = 0;
+        free_subscription();
+        free_polytopes();
+        destroy_pool();
+        free_scratch();
+        flush_packet_cache(0);
+        free_replay();
+        free(ahp_xc.leds);
+        free(ahp_xc.test);
+        free(ahp_xc.autocorrelation_thread_args);
+        free(ahp_xc.crosscorrelation_thread_args);
+        free(ahp_xc.auto_channel);
+        free(ahp_xc.cross_channel);
+        ahp_xc.leds = NULL;
+        ahp_xc.test = NULL;
+        ahp_xc.autocorrelation_thread_args = NULL;
+        ahp_xc.crosscorrelation_thread_args = NULL;
+        ahp_xc.auto_channel = NULL;
+        ahp_xc.cross_channel = NULL;
+        serial_close();
+        ahp_xc.connected = 0;
+        ahp_xc.detected = 0;
+    }
+}
+
+ahp_xc_context *ahp_xc_open()
+{
+    ahp_xc_device *device = (ahp_xc_device*)xc_calloc(1, sizeof(ahp_xc_device));
+    if(device == NULL)
+        return NULL;
+    device->port = serial_alloc_port();
+    if(device->port == NULL) {
+        free(device);
+        return NULL;
+    }
+    pthread_mutex_init(&device->packet_cache_mutex, NULL);
+    device->sign = 1;
+    device->fill = 0;
+    return device;
+}
+
+ahp_xc_context *ahp_xc_select(ahp_xc_context *context)
+{
+    return select_device(context != NULL ? context : &xc_default_device);
+}
+
+void ahp_xc_close(ahp_xc_context *context)
+{
+    ahp_xc_device *device = (context != NULL ? context : &xc_default_device);
+    ahp_xc_device *previous = select_device(device);
+    ahp_xc_disconnect();
+    flush_packet_cache(0);
+    free(ahp_xc.packet_cache);
+    ahp_xc.packet_cache = NULL;
+    ahp_xc.packet_cache_size = 0;
+    if(ahp_xc.acquisition.initialized) {
+        pthread_cond_destroy(&ahp_xc.acquisition.cond);
+        pthread_mutex_destroy(&ahp_xc.acquisition.mutex);
+        ahp_xc.acquisition.initialized = 0;
+    }
+    select_device(previous != device ? previous : &xc_default_device);
+    if(device == &xc_default_device)
+        return;
+    pthread_mutex_destroy(&device->packet_cache_mutex);
+    free(device->port);
+    free(device);
+}
+
+uint32_t ahp_xc_is_connected()
+{
+    return ahp_xc.connected;
+}
+
+uint32_t ahp_xc_is_detected()
+{
+    return ahp_xc.detected;
+}
+
+static size_t arena_align(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+static uint32_t slot_capacity()
+{
+    return (ahp_xc.polytopes.order > 1 ? ahp_xc.polytopes.order : 2);
+}
+
+static size_t samples_size(uint64_t nsamples, uint64_t lag_size, uint32_t capacity)
+{
+    return arena_align(sizeof(samples_arena)) + nsamples * sizeof(ahp_xc_sample) +
+           nsamples * (sizeof(index_slot) + lag_size * sizeof(ahp_xc_correlation)) +
+           nsamples * capacity * (sizeof(double) + sizeof(int32_t));
+}
+
+static ahp_xc_sample *init_samples(void *block, uint64_t nsamples, uint64_t lag_size, uint32_t capacity, int32_t embedded)
+{
+    uint64_t x, y;
+    samples_arena *arena = (samples_arena*)block;
+    memset(block, 0, samples_size(nsamples, lag_size, capacity));
+    arena->nsamples = nsamples;
+    arena->embedded = embedded;
+    ahp_xc_sample *samples = (ahp_xc_sample*)((char*)block + arena_align(sizeof(samples_arena)));
+    char *slots = (char*)(samples + nsamples);
+    double *lags = (double*)(slots + nsamples * (sizeof(index_slot) + lag_size * sizeof(ahp_xc_correlation)));
+    int32_t *indexes = (int32_t*)(lags + nsamples * capacity);
+    for(x = 0; x < nsamples; x++) {
+        index_slot *slot = (index_slot*)(slots + x * (sizeof(index_slot) + lag_size * sizeof(ahp_xc_correlation)));
+        slot->capacity = capacity;
+        slot->indexes = &indexes[x * capacity];
+        slot->lags = &lags[x * capacity];
+        samples[x].lag_size = lag_size;
+        samples[x].correlations = (ahp_xc_correlation*)(slot + 1);
+        for(y = 0; y < lag_size; y++) {
+            samples[x].correlations[y].indexes = slot->indexes;
+            samples[x].correlations[y].lags = slot->lags;
+        }
+    }
+    return samples;
+}
+
+static samples_arena *sample_arena(ahp_xc_sample *samples)
+{
+    return (samples_arena*)((char*)samples - arena_align(sizeof(samples_arena)));
+}
+
+static index_slot *sample_slot(ahp_xc_sample *sample)
+{
+    return ((index_slot*)sample->correlations) - 1;
+}
+
+static index_slot *bind_slot(ahp_xc_sample *sample, const int32_t *indexes, const double *lags, uint32_t count)
+{
+    index_slot *slot = sample_slot(sample);
+    if(count > slot->capacity) {
+        int32_t *new_indexes = (int32_t*)xc_malloc(sizeof(int32_t) * count);
+        double *new_lags = (double*)xc_malloc(sizeof(double) * count);
+        if(new_indexes == NULL || new_lags == NULL) {
+            free(new_indexes);
+            free(new_lags);
+            return NULL;
+        }
+        if(slot->owned) {
+            free(slot->indexes);
+            free(slot->lags);
+        }
+        slot->indexes = new_indexes;
+        slot->lags = new_lags;
+        slot->capacity = count;
+        slot->owned = 1;
+    }
+    if(indexes != NULL)
+        memcpy(slot->indexes, indexes, sizeof(int32_t) * count);
+    if(lags != NULL)
+        memcpy(slot->lags, lags, sizeof(double) * count);
+    return slot;
+}
+
+static void release_slots(ahp_xc_sample *samples)
+{
+    uint64_t x;
+    samples_arena *arena = sample_arena(samples);
+    for(x = 0; x < arena->nsamples; x++) {
+        index_slot *slot = sample_slot(&samples[x]);
+        if(slot->owned) {
+            free(slot->indexes);
+            free(slot->lags);
+            slot->owned = 0;
+        }
+    }
+}
+
+static void copy_samples_into(ahp_xc_sample *dst, ahp_xc_sample *src, uint64_t nlines, size_t size)
+{
+    uint64_t x, y;
+    for(x = 0; x < nlines; x++) {
+        uint32_t count = (size > 0 && src[x].correlations[0].num_indexes > 0 ? src[x].correlations[0].num_indexes : 0);
+        dst[x].lag = src[x].lag;
+        memcpy(dst[x].correlations, src[x].correlations, sizeof(ahp_xc_correlation)*size);
+        index_slot *slot = bind_slot(&dst[x], (count > 0 ? src[x].correlations[0].indexes : NULL), (count > 0 ? src[x].correlations[0].lags : NULL), count);
+        for(y = 0; y < size; y++) {
+            dst[x].correlations[y].indexes = (slot != NULL ? slot->indexes : NULL);
+            dst[x].correlations[y].lags = (slot != NULL ? slot->lags : NULL);
+        }
+    }
+}
+
+ahp_xc_sample *ahp_xc_alloc_samples(uint64_t nlines, size_t size)
+{
+    void *block = xc_malloc(samples_size(nlines, size, slot_capacity()));
+    if(block == NULL)
+        return NULL;
+    return init_samples(block, nlines, size, slot_capacity(), 0);
+}
+
+ahp_xc_sample *ahp_xc_copy_samples(ahp_xc_sample* src, uint64_t nlines, size_t size)
+{
+    ahp_xc_sample* samples = ahp_xc_alloc_samples(nlines, size);
+    if(samples != NULL)
+        copy_samples_into(samples, src, nlines, size);
+    return samples;
+}
+
+void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples)
+{
+    (void)nlines;
+    if(samples != NULL) {
+        samples_arena *arena = sample_arena(samples);
+        release_slots(samples);
+        if(!arena->embedded)
+            free(arena);
+    }
+}
+
+static size_t packet_size(uint64_t nlines, uint64_t nbaselines, uint64_t auto_lag, uint64_t cross_lag, uint32_t capacity)
+{
+    return arena_align(sizeof(packet_arena)) + arena_align(sizeof(uint64_t) * nlines) +
+           arena_align(samples_size(nlines, auto_lag, capacity)) + samples_size(nbaselines, cross_lag, capacity);
+}
+
+static void init_packet(ahp_xc_packet *packet, uint32_t capacity)
+{
+    char *block = (char*)packet + arena_align(sizeof(packet_arena));
+    packet->timestamp = 0;
+    packet->buf = NULL;
+    packet->counts = (uint64_t*)block;
+    memset(packet->counts, 0, sizeof(uint64_t) * packet->n_lines);
+    block += arena_align(sizeof(uint64_t) * packet->n_lines);
+    packet->autocorrelations = init_samples(block, packet->n_lines, packet->auto_lag, capacity, 1);
+    block += arena_align(samples_size(packet->n_lines, packet->auto_lag, capacity));
+    packet->crosscorrelations = init_samples(block, packet->n_baselines, packet->cross_lag, capacity, 1);
+}
+
+static ahp_xc_packet *alloc_packet(uint64_t nlines, uint64_t nbaselines, uint64_t auto_lag, uint64_t cross_lag)
+{
+    uint32_t x;
+    ahp_xc_packet *packet = NULL;
+    pthread_mutex_lock(&ahp_xc.packet_cache_mutex);
+    for(x = 0; x < ahp_xc.packet_cache_len; x++) {
+        ahp_xc_packet *cached = ahp_xc.packet_cache[x];
+        if(cached->n_lines == nlines && cached->n_baselines == nbaselines && cached->auto_lag == auto_lag && cached->cross_lag == cross_lag) {
+            packet = cached;
+            ahp_xc.packet_cache[x] = ahp_xc.packet_cache[--ahp_xc.packet_cache_len];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ahp_xc.packet_cache_mutex);
+    if(packet != NULL) {
+        init_packet(packet, ((packet_arena*)packet)->capacity);
+        return packet;
+    }
+    packet_arena *arena = (packet_arena*)xc_malloc(packet_size(nlines, nbaselines, auto_lag, cross_lag, slot_capacity()));
+    if(arena == NULL)
+        return NULL;
+    packet = &arena->packet;
+    packet->n_lines = nlines;
+    packet->n_baselines = nbaselines;
+    packet->auto_lag = auto_lag;
+    packet->cross_lag = cross_lag;
+    packet->lock = &arena->lock;
+    pthread_mutex_init(((pthread_mutex_t*)packet->lock), &ahp_serial_mutex_attr);
+    arena->capacity = slot_capacity();
+    init_packet(packet, arena->capacity);
+    return packet;
+}
+
+ahp_xc_packet *ahp_xc_alloc_packet()
+{
+    ahp_xc_packet *packet = alloc_packet((uint64_t)ahp_xc_get_nlines(), (uint64_t)ahp_xc_get_nbaselines(), ahp_xc_get_autocorrelator_lagsize(), ahp_xc_get_crosscorrelator_lagsize()*2-1);
+    if(packet == NULL)
+        return NULL;
+    packet->bps = (uint64_t)ahp_xc_get_bps();
+    packet->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
+    return packet;
+}
+
+ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet)
+{
+    ahp_xc_packet *copy = alloc_packet(packet->n_lines, packet->n_baselines, packet->auto_lag, packet->cross_lag);
+    if(copy == NULL)
+        return NULL;
+    copy->timestamp = packet->timestamp;
+    copy->bps = packet->bps;
+    copy->tau = packet->tau;
+    memcpy(copy->counts, packet->counts, sizeof(uint64_t) * (uint64_t)copy->n_lines);
+    copy_samples_into(copy->autocorrelations, packet->autocorrelations, copy->n_lines, copy->auto_lag);
+    copy_samples_into(copy->crosscorrelations, packet->crosscorrelations, copy->n_baselines, copy->cross_lag);
+    return copy;
+}
+
+void ahp_xc_free_packet(ahp_xc_packet *packet)
+{
+    if(packet != NULL) {
+        release_slots(packet->autocorrelations);
+        release_slots(packet->crosscorrelations);
+        pthread_mutex_lock(&ahp_xc.packet_cache_mutex);
+        if(ahp_xc.packet_cache_len < ahp_xc.packet_cache_size) {
+            ahp_xc.packet_cache[ahp_xc.packet_cache_len++] = packet;
+            packet = NULL;
+        }
+        pthread_mutex_unlock(&ahp_xc.packet_cache_mutex);
+        if(packet == NULL)
+            return;
+        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
+        free(packet);
+    }
+}
+
+int32_t ahp_xc_set_packet_cache_size(uint32_t size)
+{
+    flush_packet_cache(size);
+    pthread_mutex_lock(&ahp_xc.packet_cache_mutex);
+    ahp_xc_packet **cache = (ahp_xc_packet**)xc_realloc(ahp_xc.packet_cache, sizeof(ahp_xc_packet*) * (size > 0 ? size : 1));
+    if(cache == NULL) {
+        pthread_mutex_unlock(&ahp_xc.packet_cache_mutex);
+        return -ENOMEM;
+    }
+    ahp_xc.packet_cache = cache;
+    ahp_xc.packet_cache_size = size;
+    pthread_mutex_unlock(&ahp_xc.packet_cache_mutex);
+    return 0;
+}
+
+uint32_t ahp_xc_get_packet_cache_size()
+{
+    return ahp_xc.packet_cache_size;
+}
+
+static void *alloc_planes(size_t size)
+{
+    void *planes = NULL;
+    __atomic_add_fetch(&ahp_xc.allocations, 1, __ATOMIC_RELAXED);
+#ifdef _WIN32
+    planes = _aligned_malloc(size, 64);
+#else
+    if(posix_memalign(&planes, 64, size))
+        planes = NULL;
+#endif
+    if(planes != NULL)
+        memset(planes, 0, size);
+    return planes;
+}
+
+static void free_planes(void *planes)
+{
+#ifdef _WIN32
+    _aligned_free(planes);
+#else
+    free(planes);
+#endif
+}
+
+static size_t plane_size(uint64_t elements)
+{
+    return (elements * sizeof(int64_t) + 63) & ~(size_t)63;
+}
+
+ahp_xc_packet_planes *ahp_xc_alloc_packet_planes()
+{
+    uint64_t nlines = (uint64_t)ahp_xc_get_nlines();
+    uint64_t nbaselines = (uint64_t)ahp_xc_get_nbaselines();
+    uint64_t auto_lag = ahp_xc_get_autocorrelator_lagsize();
+    uint64_t cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
+    size_t header_size = (sizeof(ahp_xc_packet_planes) + sizeof(pthread_mutex_t) + 63) & ~(size_t)63;
+    size_t auto_size = plane_size(nlines * auto_lag);
+    size_t cross_size = plane_size(nbaselines * cross_lag);
+    size_t lines_size = plane_size(nlines);
+    size_t baselines_size = plane_size(nbaselines);
+    char *planes = (char*)alloc_planes(header_size + lines_size * 2 + auto_size * 5 + baselines_size + cross_size * 5);
+    if(planes == NULL)
+        return NULL;
+    ahp_xc_packet_planes *packet = (ahp_xc_packet_planes*)planes;
+    packet->bps = (uint64_t)ahp_xc_get_bps();
+    packet->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
+    packet->n_lines = nlines;
+    packet->n_baselines = nbaselines;
+    packet->auto_lag = auto_lag;
+    packet->cross_lag = cross_lag;
+    packet->lock = (pthread_mutex_t*)(packet + 1);
+    planes += header_size;
+    packet->planes = planes;
+    packet->counts = (uint64_t*)planes;
+    planes += lines_size;
+    packet->auto_offsets = (double*)planes;
+    planes += lines_size;
+    packet->auto_real = (int64_t*)planes;
+    planes += auto_size;
+    packet->auto_imaginary = (int64_t*)planes;
+    planes += auto_size;
+    packet->auto_counts = (uint64_t*)planes;
+    planes += auto_size;
+    packet->auto_magnitude = (double*)planes;
+    planes += auto_size;
+    packet->auto_phase = (double*)planes;
+    planes += auto_size;
+    packet->cross_offsets = (double*)planes;
+    planes += baselines_size;
+    packet->cross_real = (int64_t*)planes;
+    planes += cross_size;
+    packet->cross_imaginary = (int64_t*)planes;
+    planes += cross_size;
+    packet->cross_counts = (uint64_t*)planes;
+    planes += cross_size;
+    packet->cross_magnitude = (double*)planes;
+    planes += cross_size;
+    packet->cross_phase = (double*)planes;
+    pthread_mutex_init(((pthread_mutex_t*)packet->lock), &ahp_serial_mutex_attr);
+    return packet;
+}
+
+void ahp_xc_free_packet_planes(ahp_xc_packet_planes *packet)
+{
+    if(packet != NULL) {
+        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
+        free_planes(packet);
+    }
+}
+
+static void ahp_xc_start_autocorrelation_scan(uint32_t index)
+{
+    if(!ahp_xc.detected) return;
+    int flags = ahp_xc_get_capture_flags();
+    ahp_xc_set_capture_flags((flags|CAP_RESET_TIMESTAMP)&~(CAP_ENABLE|CAP_EXTRA_CMD));
+    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
+    ahp_xc_set_capture_flags(flags);
+}
+
+static void ahp_xc_end_autocorrelation_scan(uint32_t index)
+{
+    if(!ahp_xc.detected) return;
+    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+}
+
+static const int64_t *frame_values(const char *data, uint32_t offset, uint32_t count)
+{
+    if(!ahp_xc.fused_decode || data == NULL || data != ahp_xc.values_frame)
+        return NULL;
+    if(offset + count > ahp_xc.nvalues)
+        return NULL;
+    return ahp_xc.values;
+}
+
+static void cache_autocorrelation(autocorrelation_cache *cache, uint64_t offset, const double *magnitude, const double *phase, const ahp_xc_correlation *correlations, const int64_t *fields, uint64_t count, uint32_t len)
+{
+    uint32_t x;
+    uint64_t *cache_counts = &cache->counts[offset];
+    double *cache_magnitude = &cache->magnitude[offset];
+    double *cache_phase = &cache->phase[offset];
+    for(x = 0; x < len; x++)
+        cache_counts[x] = count;
+    if(ahp_xc.lazy_phase_magnitude) {
+        phase_magnitude_batch(fields, count, cache_magnitude, cache_phase, len);
+    } else if(magnitude != NULL) {
+        memcpy(cache_magnitude, magnitude, sizeof(double) * len);
+        memcpy(cache_phase, phase, sizeof(double) * len);
+    } else if(correlations != NULL) {
+        for(x = 0; x < len; x++) {
+            cache_magnitude[x] = correlations[x].magnitude;
+            cache_phase[x] = correlations[x].phase;
+        }
+    } else {
+        phase_magnitude_batch(fields, count, cache_magnitude, cache_phase, len);
+    }
+}
+
+/* rows maps each input to its cache row, NULL when the cache holds the inputs in order */
+static void combine_intensity(const autocorrelation_cache *cache, const int32_t *rows, uint32_t num_indexes, uint64_t len, uint64_t *counts, double *magnitude, double *phase)
+{
+    uint64_t y;
+    uint32_t x;
+    const uint64_t *row_counts = cache->counts;
+    const double *row_magnitude = cache->magnitude;
+    const double *row_phase = cache->phase;
+    if(rows != NULL) {
+        row_counts += rows[0]*cache->lag_size;
+        row_magnitude += rows[0]*cache->lag_size;
+        row_phase += rows[0]*cache->lag_size;
+    }
+    memcpy(counts, row_counts, sizeof(uint64_t) * len);
+    memcpy(magnitude, row_magnitude, sizeof(double) * len);
+    memcpy(phase, row_phase, sizeof(double) * len);
+    for(x = 1; x < num_indexes; x++) {
+        uint64_t offset = (rows != NULL ? (uint64_t)rows[x] : x) * cache->lag_size;
+        row_counts = &cache->counts[offset];
+        row_magnitude = &cache->magnitude[offset];
+        row_phase = &cache->phase[offset];
+        for(y = 0; y < len; y++) {
+            counts[y] += row_counts[y];
+            magnitude[y] *= row_magnitude[y];
+            phase[y] += row_phase[y];
+        }
+    }
+    for(y = 0; y < len; y++) {
+        counts[y] /= num_indexes;
+        magnitude[y] = pow(magnitude[y], 1.0/num_indexes);
+        phase[y] = fmod(phase[y], M_PI*2.0);
+    }
+}
+
+static void* _get_autocorrelation(void *o)
+{
+    thread_argument *arg = (thread_argument*)o;
+    ahp_xc_sample *sample = arg->sample;
+    int32_t index = arg->index;
+    const char *data = arg->data;
+    const int64_t *decoded = arg->values;
+    const packet_layout *layout = &ahp_xc.layout;
+    double lag = arg->lag;
+    uint32_t y, z;
+    int32_t n = layout->field_len;
+    const char *packet = data + layout->autocorrelations + index * layout->auto_stride;
+    int64_t values[64];
+    const int64_t *fields = values;
+    uint32_t offset = layout->auto_field + index * layout->auto_field_stride;
+    ahp_xc_packet_planes *planes = arg->planes;
+    autocorrelation_cache *cache = arg->cache;
+    uint64_t lag_size = ahp_xc_get_autocorrelator_lagsize();
+    uint64_t row = arg->row * lag_size;
+    if(decoded != NULL)
+        values[0] = decoded[index];
+    else
+        hex_decode(&data[layout->counts + index*n], n, values, 1, 0, NULL);
+    uint64_t counts = (uint64_t)values[0]|1;
+    double channel_lag = ahp_xc_get_current_channel_auto(index, data) * ahp_xc_get_sampletime();
+    if(planes != NULL) {
+        planes->auto_offsets[arg->row] = channel_lag;
+    } else if(sample != NULL) {
+        sample->lag_size = lag_size;
+        sample->lag = lag;
+    }
+    for(y = 0; y < lag_size; y += 32) {
+        uint32_t len = (lag_size - y < 32 ? lag_size - y : 32);
+        if(decoded != NULL)
+            fields = &decoded[offset+y*2];
+        else
+            hex_decode(packet, n, values, len*2, 1, NULL);
+        packet += n*len*2;
+        if(planes != NULL) {
+            store_planes(&planes->auto_real[row+y], &planes->auto_imaginary[row+y], &planes->auto_counts[row+y], &planes->auto_magnitude[row+y], &planes->auto_phase[row+y], fields, counts, len);
+        } else if(sample != NULL) {
+            store_correlations(&sample->correlations[y], fields, counts, len);
+            for(z = 0; z < len; z++)
+                sample->correlations[y+z].lag = channel_lag;
+        }
+        if(cache != NULL)
+            cache_autocorrelation(cache, row+y, planes != NULL ? &planes->auto_magnitude[row+y] : NULL, planes != NULL ? &planes->auto_phase[row+y] : NULL,
+                                  sample != NULL ? &sample->correlations[y] : NULL, fields, counts, len);
+    }
+    return NULL;
+}
+
+static void prepare_autocorrelation(thread_argument *arg, ahp_xc_sample *sample, int32_t index, const char *data, double lag)
+{
+    arg->sample = sample;
+    arg->index = index;
+    arg->data = data;
+    arg->values = frame_values(data, ahp_xc.layout.auto_field + index*ahp_xc.layout.auto_field_stride, ahp_xc.layout.auto_field_stride);
+    arg->lag = lag;
+    arg->planes = NULL;
+    arg->row = index;
+    arg->scratch = NULL;
+    arg->cache = NULL;
+}
+
+void ahp_xc_get_autocorrelation(ahp_xc_sample *sample, int32_t index, const char *data, double lag)
+{
+    if(!ahp_xc.mutexes_initialized)
+        return;
+    prepare_autocorrelation(&ahp_xc.autocorrelation_thread_args[index], sample, index, data, lag);
+    _get_autocorrelation(&ahp_xc.autocorrelation_thread_args[index]);
+}
+
+static void *pipeline_thread(void *arg)
+{
+    scan_pipeline *pipeline = (scan_pipeline*)arg;
+    select_device(pipeline->device);
+    pthread_mutex_lock(&pipeline->mutex);
+    while(1) {
+        while(pipeline->tail == pipeline->head && !pipeline->done)
+            pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+        if(pipeline->tail == pipeline->head)
+            break;
+        uint64_t step = pipeline->tail;
+        uint32_t slot = (uint32_t)(step % pipeline->nslots);
+        pthread_mutex_unlock(&pipeline->mutex);
+        if(!__atomic_load_n(pipeline->interrupt, __ATOMIC_RELAXED) && !__atomic_load_n(&pipeline->stopped, __ATOMIC_RELAXED)) {
+            if(pipeline->decode(pipeline->frames + slot * pipeline->frame_size, step, pipeline->tags[slot], pipeline->context))
+                __atomic_store_n(&pipeline->stopped, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->tail++;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+static int32_t start_pipeline(scan_pipeline *pipeline, uint32_t depth, int32_t (*decode)(const char *, uint64_t, uint64_t, void *), void *context, int32_t *interrupt)
+{
+    pipeline->nslots = (depth > 0 ? depth : SCAN_PIPELINE_DEPTH);
+    pipeline->frame_size = ahp_xc_get_packetsize();
+    pipeline->frames = (char*)xc_malloc((size_t)pipeline->nslots * pipeline->frame_size);
+    pipeline->tags = (uint64_t*)xc_malloc(sizeof(uint64_t) * pipeline->nslots);
+    if(pipeline->frames == NULL || pipeline->tags == NULL) {
+        free(pipeline->frames);
+        free(pipeline->tags);
+        return -ENOMEM;
+    }
+    pipeline->head = 0;
+    pipeline->tail = 0;
+    pipeline->done = 0;
+    pipeline->stopped = 0;
+    pipeline->interrupt = interrupt;
+    pipeline->decode = decode;
+    pipeline->context = context;
+    pipeline->device = xc_current_device;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    if(pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline)) {
+        pthread_cond_destroy(&pipeline->cond);
+        pthread_mutex_destroy(&pipeline->mutex);
+        free(pipeline->frames);
+        free(pipeline->tags);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+static char *pipeline_slot(scan_pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    while(pipeline->head - pipeline->tail >= pipeline->nslots)
+        pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    pthread_mutex_unlock(&pipeline->mutex);
+    return pipeline->frames + (pipeline->head % pipeline->nslots) * pipeline->frame_size;
+}
+
+static void pipeline_push(scan_pipeline *pipeline, uint64_t tag)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->tags[pipeline->head % pipeline->nslots] = tag;
+    pipeline->head++;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+static void finish_pipeline(scan_pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->done = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->mutex);
+    pthread_join(pipeline->thread, NULL);
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline->frames);
+    free(pipeline->tags);
+    pipeline->frames = NULL;
+    pipeline->tags = NULL;
+}
+
+static int32_t pipeline_stopped(scan_pipeline *pipeline)
+{
+    return *pipeline->interrupt || __atomic_load_n(&pipeline->stopped, __ATOMIC_RELAXED);
+}
+
+static void pipeline_push_packet(scan_pipeline *pipeline, uint64_t tag)
+{
+    memcpy(pipeline_slot(pipeline), ahp_xc.buf, pipeline->frame_size);
+    pipeline_push(pipeline, tag);
+}
+
+static int32_t pipeline_grab(scan_pipeline *pipeline, uint64_t tag)
+{
+    int32_t ntries = 5;
+    while(ntries-- > 0) {
+        if(grab_packet(NULL) < 0)
+            continue;
+        pipeline_push_packet(pipeline, tag);
+        return 0;
+    }
+    return -ENOENT;
+}
+
+typedef struct {
+    ahp_xc_scan_request *lines;
+    uint32_t nlines;
+    int32_t order;
+    ahp_xc_sample *correlations;
+    ahp_xc_sample *samples;
+    uint32_t *positions;
+    int32_t *inputs;
+    double *lags;
+    uint32_t *counts;
+    int32_t concurrent;
+    ahp_xc_scan_callback callback;
+    void *user_data;
+    int32_t decoded;
+} scan_context;
+
+static size_t clamp_scan_requests(ahp_xc_scan_request *lines, uint32_t nlines, size_t *len)
+{
+    uint32_t i;
+    size_t size = 0;
+    *len = 0;
+    for(i = 0; i < nlines; i++) {
+        lines[i].start = (lines[i].start < ahp_xc_get_delaysize()-2 ? lines[i].start : (off_t)ahp_xc_get_delaysize()-2);
+        lines[i].len = (lines[i].start+(off_t)lines[i].len < ahp_xc_get_delaysize() ? (off_t)lines[i].len : (off_t)ahp_xc_get_delaysize()-1-lines[i].start);
+        *len = fmax(*len, lines[i].len/lines[i].step);
+        size += lines[i].len/lines[i].step;
+    }
+    return size;
+}
+
+static int32_t deliver_block(scan_context *scan, uint64_t step, uint32_t count)
+{
+    scan->decoded += (int32_t)count;
+    if(scan->callback == NULL || count == 0)
+        return 0;
+    ahp_xc_scan_block block;
+    block.step = step;
+    block.count = count;
+    block.lines = scan->positions;
+    block.samples = scan->samples;
+    return scan->callback(&block, scan->user_data);
+}
+
+static void scan_autocorrelation_job(uint32_t job, uint32_t worker)
+{
+    (void)worker;
+    _get_autocorrelation(&ahp_xc.autocorrelation_thread_args[job]);
+}
+
+static int32_t decode_autocorrelation_step(const char *packet, uint64_t step, uint64_t tag, void *context)
+{
+    scan_context *scan = (scan_context*)context;
+    uint32_t x, njobs = 0;
+    size_t off = 0;
+    (void)tag;
+    for(x = 0; x < scan->nlines; x++) {
+        ahp_xc_scan_request *line = &scan->lines[x];
+        if(step < line->len/line->step) {
+            ahp_xc_sample *sample = (scan->correlations != NULL ? &scan->correlations[step+off] : &scan->samples[njobs]);
+            if(scan->positions != NULL)
+                scan->positions[njobs] = x;
+            prepare_autocorrelation(&ahp_xc.autocorrelation_thread_args[njobs++], sample, line->index, packet, ahp_xc_get_current_channel_auto(line->index, packet));
+        }
+        off += line->len/line->step;
+    }
+    run_jobs(scan_autocorrelation_job, njobs);
+    return deliver_block(scan, step, njobs);
+}
+
+static int32_t scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, scan_context *scan, uint32_t depth, int32_t *interrupt, double *percent)
+{
+    uint32_t i = 0;
+    size_t len = 0;
+    clamp_scan_requests(lines, nlines, &len);
+    scan_pipeline pipeline;
+    if(start_pipeline(&pipeline, depth, decode_autocorrelation_step, scan, interrupt))
+        return -ENOMEM;
+    int32_t fused_decode = ahp_xc.fused_decode;
+    ahp_xc.fused_decode = 0;
+    for(i = 0; i < nlines; i++) {
+        ahp_xc_select_input(lines[i].index);
+        int capture_flags = ahp_xc_get_capture_flags();
+        ahp_xc_set_capture_flags(capture_flags & ~CAP_EXTRA_CMD);
+        ahp_xc_select_input(lines[i].index);
+        ahp_xc_send_command(CLEAR, SET_DELAY);
+        ahp_xc_set_capture_flags(capture_flags);
+        ahp_xc_set_channel_auto(lines[i].index, lines[i].start, lines[i].len, lines[i].step);
+        ahp_xc_start_autocorrelation_scan(lines[i].index);
+    }
+    ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
+    flush_rx();
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
+    for(i = 0; i < len; i++) {
+        if(pipeline_stopped(&pipeline))
+            break;
+        if(pipeline_grab(&pipeline, i))
+            break;
+        (*percent) += 100.0 / len;
+    }
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
     for(i = 0; i < nlines; i++) {
         ahp_xc_select_input(lines[i].index);
         int capture_flags = ahp_xc_get_capture_flags();
@@ -758,334 +3333,1150 @@ static int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t
         ahp_xc_set_capture_flags(capture_flags);
         ahp_xc_end_autocorrelation_scan(lines[i].index);
     }
-    i = 0;
-    while((int)i < r) {
-        if(*interrupt)
-            break;
-        char *packet = (char*)data+i*ahp_xc_get_packetsize();
-        size_t off = 0;
-        for(x = 0; x < nlines; x++) {
-            if(i < lines[x].len/lines[x].step) {
-                ahp_xc_get_autocorrelation(&correlations[i+off], lines[x].index, packet+y*ahp_xc_get_packetsize(), ahp_xc_get_current_channel_auto(lines[x].index, data));
-                s++;
+    finish_pipeline(&pipeline);
+    ahp_xc.fused_decode = fused_decode;
+    return scan->decoded;
+}
+
+static int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent)
+{
+    size_t len = 0;
+    scan_context scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.lines = lines;
+    scan.nlines = nlines;
+    size_t size = clamp_scan_requests(lines, nlines, &len);
+    scan.correlations = ahp_xc_alloc_samples(size, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
+    if(scan.correlations == NULL)
+        return -ENOMEM;
+    int32_t s = scan_autocorrelations(lines, nlines, &scan, 0, interrupt, percent);
+    if(s < 0) {
+        ahp_xc_free_samples(size, scan.correlations);
+        return s;
+    }
+    *autocorrelations = scan.correlations;
+    return s;
+}
+
+static void ahp_xc_end_crosscorrelation_scan(uint32_t index)
+{
+    if(!ahp_xc.detected) return;
+    if(!ahp_xc_intensity_crosscorrelator_enabled())
+        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_CROSS);
+    else
+        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+}
+
+static void ahp_xc_start_crosscorrelation_scan(uint32_t index)
+{
+    if(!ahp_xc.detected) return;
+    ahp_xc_end_crosscorrelation_scan(index);
+    int flags = ahp_xc_get_capture_flags();
+    ahp_xc_set_capture_flags((flags|CAP_RESET_TIMESTAMP)&~(CAP_ENABLE|CAP_EXTRA_CMD));
+    if(!ahp_xc_intensity_crosscorrelator_enabled())
+        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_CROSS);
+    else
+        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
+    ahp_xc_set_capture_flags(flags);
+}
+
+static void *_get_crosscorrelation(void *o)
+{
+    thread_argument *arg = (thread_argument*)o;
+    ahp_xc_sample *sample = arg->sample;
+    int32_t *indexes = arg->indexes;
+    int32_t index = arg->index;
+    uint32_t num_indexes = arg->order;
+    const char *data = arg->data;
+    uint32_t x, y;
+    int32_t n = ahp_xc_get_bps() / 4;
+    const char *packet = data;
+    double channel_lag = ahp_xc_get_current_channel_auto(indexes[0], data) * ahp_xc_get_sampletime();
+    ahp_xc_packet_planes *planes = arg->planes;
+    uint64_t lag_size = ahp_xc_get_crosscorrelator_lagsize()*2-1;
+    uint64_t row = arg->row * lag_size;
+    decode_scratch *scratch = arg->scratch;
+    if(planes != NULL)
+        planes->cross_offsets[arg->row] = channel_lag;
+    else if(sample != NULL) {
+        sample->lag_size = lag_size;
+        sample->lag = 0;
+    }
+    if(ahp_xc_intensity_crosscorrelator_enabled()) {
+        uint64_t auto_lag = ahp_xc_get_autocorrelator_lagsize();
+        uint64_t len = (auto_lag < lag_size ? auto_lag : lag_size);
+        autocorrelation_cache local;
+        autocorrelation_cache *cache = arg->cache;
+        const int32_t *rows = indexes;
+        uint64_t *counts = NULL;
+        double *magnitude = NULL;
+        double *phase = NULL;
+        memset(&local, 0, sizeof(local));
+        if(cache == NULL) {
+            cache = (scratch != NULL ? &scratch->autocorrelations : &local);
+            if(cache == &local && alloc_cache(&local, num_indexes, auto_lag))
+                return NULL;
+            for(y = 0; y < num_indexes; y++) {
+                thread_argument auto_arg;
+                prepare_autocorrelation(&auto_arg, NULL, indexes[y], packet, 0);
+                auto_arg.row = y;
+                auto_arg.cache = cache;
+                _get_autocorrelation(&auto_arg);
+            }
+            rows = NULL;
+        }
+        if(planes != NULL) {
+            counts = &planes->cross_counts[row];
+            magnitude = &planes->cross_magnitude[row];
+            phase = &planes->cross_phase[row];
+        } else if(scratch != NULL) {
+            counts = scratch->counts;
+            magnitude = scratch->magnitude;
+            phase = scratch->phase;
+        } else {
+            counts = (uint64_t*)xc_malloc(sizeof(uint64_t) * len);
+            magnitude = (double*)xc_malloc(sizeof(double) * len);
+            phase = (double*)xc_malloc(sizeof(double) * len);
+        }
+        if(counts != NULL && magnitude != NULL && phase != NULL) {
+            combine_intensity(cache, rows, num_indexes, len, counts, magnitude, phase);
+            if(planes != NULL) {
+                for (y = 0; y < len; y++) {
+                    planes->cross_real[row+y] = (long)(sin(phase[y]) * magnitude[y]);
+                    planes->cross_imaginary[row+y] = (long)(cos(phase[y]) * magnitude[y]);
+                }
+                for (; y < lag_size; y++) {
+                    planes->cross_real[row+y] = 0;
+                    planes->cross_imaginary[row+y] = 0;
+                    planes->cross_counts[row+y] = 0;
+                    planes->cross_magnitude[row+y] = 0;
+                    planes->cross_phase[row+y] = 0;
+                }
+            } else if(sample != NULL) {
+                index_slot *slot = bind_slot(sample, arg->indexes, arg->lags, num_indexes);
+                for (y = 0; y < len; y++) {
+                    ahp_xc_correlation *correlation = &sample->correlations[y];
+                    correlation->num_indexes = num_indexes;
+                    correlation->indexes = (slot != NULL ? slot->indexes : NULL);
+                    correlation->lags = (slot != NULL ? slot->lags : NULL);
+                    correlation->lag = (num_indexes > 1 ? channel_lag+y*ahp_xc_get_sampletime() : channel_lag);
+                    correlation->counts = counts[y];
+                    correlation->magnitude = magnitude[y];
+                    correlation->phase = phase[y];
+                    correlation->real = (long)(sin(phase[y]) * magnitude[y]);
+                    correlation->imaginary = (long)(cos(phase[y]) * magnitude[y]);
+                }
+            }
+        }
+        if(planes == NULL && scratch == NULL) {
+            free(counts);
+            free(magnitude);
+            free(phase);
+        }
+        free_cache(&local);
+    } else {
+        int64_t values[64];
+        const int64_t *decoded = arg->values;
+        const int64_t *fields = values;
+        const packet_layout *layout = &ahp_xc.layout;
+        uint32_t offset = layout->cross_field + index * layout->cross_field_stride;
+        index_slot *slot = (planes == NULL ? bind_slot(sample, arg->indexes, arg->lags, num_indexes) : NULL);
+        uint64_t counts = 0;
+        for(y = 0; y < num_indexes; y++) {
+            if(decoded != NULL)
+                values[0] = decoded[indexes[y]];
+            else
+                hex_decode(&packet[layout->counts + indexes[y]*n], n, values, 1, 0, NULL);
+            counts += (uint64_t)values[0]|1;
+        }
+        packet += layout->crosscorrelations + index * layout->cross_stride;
+        for(y = 0; y < lag_size; y += 32) {
+            uint32_t len = (lag_size - y < 32 ? lag_size - y : 32);
+            if(decoded != NULL)
+                fields = &decoded[offset+y*2];
+            else
+                hex_decode(packet, n, values, len*2, 1, NULL);
+            packet += n*len*2;
+            if(planes != NULL) {
+                store_planes(&planes->cross_real[row+y], &planes->cross_imaginary[row+y], &planes->cross_counts[row+y], &planes->cross_magnitude[row+y], &planes->cross_phase[row+y], fields, counts, len);
+                continue;
+            }
+            store_correlations(&sample->correlations[y], fields, counts, len);
+            for(x = 0; x < len; x++) {
+                ahp_xc_correlation *correlation = &sample->correlations[y+x];
+                correlation->num_indexes = num_indexes;
+                correlation->indexes = (slot != NULL ? slot->indexes : NULL);
+                correlation->lags = (slot != NULL ? slot->lags : NULL);
+                correlation->lag = channel_lag;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void prepare_crosscorrelation(thread_argument *arg, ahp_xc_sample *sample, int32_t index, int32_t *indexes, int32_t order, const char *data, double *lags)
+{
+    arg->sample = sample;
+    arg->index = index;
+    arg->indexes = indexes;
+    arg->order = order;
+    arg->data = data;
+    arg->values = frame_values(data, ahp_xc.layout.cross_field + index*ahp_xc.layout.cross_field_stride, (ahp_xc_get_crosscorrelator_lagsize()*2-1)*2);
+    arg->lags = lags;
+    arg->planes = NULL;
+    arg->row = index;
+    arg->scratch = NULL;
+    arg->cache = NULL;
+}
+
+void ahp_xc_get_crosscorrelation(ahp_xc_sample *sample, int32_t *indexes, int32_t order, const char *data, double *lags)
+{
+    if(!ahp_xc.mutexes_initialized)
+        return;
+    int32_t index = ahp_xc_get_crosscorrelation_index(indexes, order);
+    prepare_crosscorrelation(&ahp_xc.crosscorrelation_thread_args[index], sample, index, indexes, order, data, lags);
+    _get_crosscorrelation(&ahp_xc.crosscorrelation_thread_args[index]);
+}
+
+static void decode_crosscorrelation_job(uint32_t job, uint32_t worker)
+{
+    thread_argument *arg = &ahp_xc.crosscorrelation_thread_args[job];
+    arg->scratch = (worker < ahp_xc.nscratch ? &ahp_xc.scratch[worker] : NULL);
+    _get_crosscorrelation(arg);
+}
+
+static void decode_autocorrelation_job(uint32_t job, uint32_t worker)
+{
+    (void)worker;
+    _get_autocorrelation(&ahp_xc.autocorrelation_thread_args[job]);
+}
+
+static void decode_packet_job(uint32_t job, uint32_t worker)
+{
+    uint32_t ncross = ahp_xc.subscription.ncross;
+    if(job < ncross)
+        decode_crosscorrelation_job(job, worker);
+    else
+        decode_autocorrelation_job(job - ncross, worker);
+}
+
+static int32_t reserve_intensity_scratch(uint32_t order)
+{
+    if(!ahp_xc_intensity_crosscorrelator_enabled())
+        return 0;
+    return reserve_scratch((ahp_xc.max_threads > 1 ? ahp_xc.max_threads : 1), order);
+}
+
+static autocorrelation_cache *reserve_autocorrelation_cache()
+{
+    if(!ahp_xc_intensity_crosscorrelator_enabled())
+        return NULL;
+    if(reserve_intensity_scratch(ahp_xc.polytopes.order))
+        return NULL;
+    if(alloc_cache(&ahp_xc.auto_cache, ahp_xc_get_nlines(), ahp_xc_get_autocorrelator_lagsize()))
+        return NULL;
+    return &ahp_xc.auto_cache;
+}
+
+static int compare_scan_request_asc(const void *a, const  void *b)
+{
+    return ((ahp_xc_scan_request*)a)->len / ((ahp_xc_scan_request*)a)->step < ((ahp_xc_scan_request*)b)->len / ((ahp_xc_scan_request*)b)->step? 1 : -1;
+}
+
+static uint32_t scan_count(ahp_xc_scan_request *line)
+{
+    return (uint32_t)(line->len / line->step);
+}
+
+static uint32_t concurrent_count(ahp_xc_scan_request *lines, uint32_t nlines, int32_t order, uint32_t x)
+{
+    int32_t y, z;
+    uint32_t count = 0;
+    int32_t moving = 0;
+    for(y = 0; y < order; y++) {
+        uint32_t pos = get_line_index(nlines, x, y);
+        if(pos == 0) {
+            moving = 1;
+            continue;
+        }
+        if(scan_count(&lines[pos]) > count)
+            count = scan_count(&lines[pos]);
+        for(z = 0; z < y; z++) {
+            uint32_t other = get_line_index(nlines, x, z);
+            if(other != 0 && lines[other].step != lines[pos].step)
+                moving = 1;
+        }
+    }
+    return (moving ? count : 0);
+}
+
+static int32_t prepare_crosscorrelation_scan(scan_context *scan, ahp_xc_scan_request *lines, uint32_t nlines, size_t *size)
+{
+    uint32_t x;
+    int32_t y;
+    size_t len = 0;
+    int32_t order = scan->order;
+    uint32_t npolytopes = get_npolytopes(nlines, order);
+    uint32_t nblock = (scan->concurrent ? npolytopes : 1);
+    qsort(lines, nlines, sizeof(ahp_xc_scan_request), &compare_scan_request_asc);
+    clamp_scan_requests(lines, nlines, &len);
+    scan->lines = lines;
+    scan->nlines = nlines;
+    *size = 0;
+    if(scan->concurrent) {
+        scan->counts = (uint32_t*)xc_malloc(sizeof(uint32_t) * (npolytopes > 0 ? npolytopes : 1));
+        if(scan->counts == NULL)
+            return -ENOMEM;
+        for(x = 0; x < npolytopes; x++) {
+            scan->counts[x] = concurrent_count(lines, nlines, order, x);
+            *size += scan->counts[x];
+        }
+    } else {
+        for(x = 0; x < npolytopes; x++) {
+            for(y = 1; y < order; y++)
+                *size += scan_count(&lines[get_line_index(nlines, x, y)]);
+        }
+    }
+    scan->positions = (uint32_t*)xc_malloc(sizeof(uint32_t) * (nblock > 0 ? nblock : 1));
+    scan->inputs = (int32_t*)xc_malloc(sizeof(int32_t) * order * (nblock > 0 ? nblock : 1));
+    scan->lags = (double*)xc_malloc(sizeof(double) * order * (nblock > 0 ? nblock : 1));
+    if(scan->positions == NULL || scan->inputs == NULL || scan->lags == NULL)
+        return -ENOMEM;
+    return (int32_t)nblock;
+}
+
+static void free_scan_context(scan_context *scan)
+{
+    free(scan->positions);
+    free(scan->inputs);
+    free(scan->lags);
+    free(scan->counts);
+    scan->positions = NULL;
+    scan->inputs = NULL;
+    scan->lags = NULL;
+    scan->counts = NULL;
+}
+
+static int32_t decode_crosscorrelation_step(const char *packet, uint64_t step, uint64_t tag, void *context)
+{
+    scan_context *scan = (scan_context*)context;
+    int32_t *inputs = scan->inputs;
+    double *lags = scan->lags;
+    uint32_t x = (uint32_t)(tag / scan->order);
+    int32_t y = (int32_t)(tag % scan->order);
+    int32_t z;
+    for(z = 0; z < scan->order; z++) {
+        inputs[z] = scan->lines[get_line_index(scan->nlines, x, z)].index;
+        lags[z] = ahp_xc_get_current_channel_cross(inputs[z], packet) * ahp_xc_get_sampletime();
+    }
+    scan->positions[0] = get_line_index(scan->nlines, x, y);
+    reserve_intensity_scratch(scan->order);
+    prepare_crosscorrelation(&ahp_xc.crosscorrelation_thread_args[0], scan->correlations != NULL ? &scan->correlations[step] : scan->samples, ahp_xc_get_crosscorrelation_index(inputs, scan->order), inputs, scan->order, packet, lags);
+    decode_crosscorrelation_job(0, 0);
+    return deliver_block(scan, step, 1);
+}
+
+static ahp_xc_scan_request *scan_step(ahp_xc_scan_request *lines, uint32_t nlines, int32_t order, uint32_t step, uint64_t *tag)
+{
+    uint32_t x = step / (order - 1);
+    int32_t y = 1 + (int32_t)(step % (order - 1));
+    *tag = (uint64_t)x * order + y;
+    return &lines[get_line_index(nlines, x, y)];
+}
+
+static int32_t polytope_has_input(ahp_xc_scan_request *lines, uint32_t nlines, int32_t order, uint64_t tag, uint32_t index)
+{
+    int32_t y;
+    for(y = 0; y < order; y++) {
+        if(lines[get_line_index(nlines, (uint32_t)(tag / order), y)].index == index)
+            return 1;
+    }
+    return 0;
+}
+
+static void program_scan_line(ahp_xc_scan_request *line)
+{
+    write_channel_delays(line->index, line->start, line->len, line->step, !ahp_xc_intensity_crosscorrelator_enabled(), 1);
+}
+
+static off_t scan_line_channel(ahp_xc_scan_request *line, const char *packet)
+{
+    if(ahp_xc_intensity_crosscorrelator_enabled())
+        return (off_t)ahp_xc_get_current_channel_auto(line->index, packet);
+    return (off_t)ahp_xc_get_current_channel_cross(line->index, packet);
+}
+
+/**
+* \brief Push the first packets of a line scan, skipping those sent before its commands reached the device
+* Stale packets can already show the line at its start channel, the first step of the scan is the last packet
+* at the start channel before one at the next channel. Returns the number of packets pushed.
+*/
+static uint32_t sync_scan_line(scan_pipeline *pipeline, ahp_xc_scan_request *line, uint64_t tag)
+{
+    uint32_t size = ahp_xc_get_packetsize();
+    uint32_t nsteps = (uint32_t)(line->len / line->step);
+    int32_t held = 0;
+    if(!ahp_xc.replay.active)
+        serial_drain_tx();
+    uint32_t npackets = (uint32_t)(ahp_xc.rx_len + serial_rx_pending() + size - 1) / size + nsteps + SCAN_SYNC_PACKETS;
+    while(npackets-- > 0 && !pipeline_stopped(pipeline)) {
+        if(grab_packet(NULL) < 0)
+            continue;
+        off_t channel = scan_line_channel(line, ahp_xc.buf);
+        if(held && channel == line->start + (off_t)line->step) {
+            pipeline_push(pipeline, tag);
+            pipeline_push_packet(pipeline, tag);
+            return 2;
+        }
+        held = (channel == line->start);
+        if(held) {
+            memcpy(pipeline_slot(pipeline), ahp_xc.buf, pipeline->frame_size);
+            if(nsteps < 2) {
+                pipeline_push(pipeline, tag);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int32_t scan_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nlines, scan_context *scan, size_t size, uint32_t depth, int32_t *interrupt, double *percent)
+{
+    uint32_t x = 0;
+    int32_t y = 0;
+    size_t k = 0;
+    int32_t order = scan->order;
+    uint32_t step = 0;
+    uint32_t nsteps = get_npolytopes(nlines, order) * (order - 1);
+    scan_pipeline pipeline;
+    if(start_pipeline(&pipeline, depth, decode_crosscorrelation_step, scan, interrupt))
+        return -ENOMEM;
+    int32_t fused_decode = ahp_xc.fused_decode;
+    ahp_xc.fused_decode = 0;
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    for(x = 0; x < get_npolytopes(nlines, order); x++) {
+        for(y = 0; y < order; y++) {
+            int index = get_line_index(nlines, x, y);
+            if(ahp_xc_intensity_crosscorrelator_enabled()) {
+                ahp_xc_end_autocorrelation_scan(lines[index].index);
+            } else {
+                ahp_xc_end_crosscorrelation_scan(lines[index].index);
             }
-            off += lines[x].len/lines[x].step;
+            lines[index].cur_chan = lines[index].start;
+        }
+    }
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    ahp_xc_scan_request *line = NULL;
+    uint64_t tag = 0;
+    uint32_t synced = 0;
+    if(nsteps > 0) {
+        line = scan_step(lines, nlines, order, 0, &tag);
+        program_scan_line(line);
+        ahp_xc_start_crosscorrelation_scan(line->index);
+        ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+        flush_rx();
+        ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
+    }
+    for(step = 0; step < nsteps && !pipeline_stopped(&pipeline); step++) {
+        ahp_xc_scan_request *next = NULL;
+        uint64_t next_tag = 0;
+        int32_t programmed = 0;
+        if(step + 1 < nsteps) {
+            next = scan_step(lines, nlines, order, step + 1, &next_tag);
+            if(!polytope_has_input(lines, nlines, order, tag, next->index)) {
+                program_scan_line(next);
+                programmed = 1;
+            }
+        }
+        for(k = 0; k < line->len/line->step; k++) {
+            if(pipeline_stopped(&pipeline))
+                break;
+            if(synced > 0)
+                synced--;
+            else if(pipeline_grab(&pipeline, tag))
+                break;
+            line->cur_chan += line->step;
+            (*percent) += 100.0 / size;
+        }
+        if(next == NULL || pipeline_stopped(&pipeline))
+            break;
+        ahp_xc_begin_commands();
+        if(ahp_xc_intensity_crosscorrelator_enabled()) {
+            ahp_xc_end_autocorrelation_scan(line->index);
+        } else {
+            ahp_xc_end_crosscorrelation_scan(line->index);
+        }
+        if(!programmed)
+            program_scan_line(next);
+        ahp_xc_start_crosscorrelation_scan(next->index);
+        ahp_xc_end_commands();
+        synced = sync_scan_line(&pipeline, next, next_tag);
+        line = next;
+        tag = next_tag;
+    }
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    if(line != NULL) {
+        if(ahp_xc_intensity_crosscorrelator_enabled()) {
+            ahp_xc_end_autocorrelation_scan(line->index);
+        } else {
+            ahp_xc_end_crosscorrelation_scan(line->index);
+        }
+    }
+    finish_pipeline(&pipeline);
+    ahp_xc.fused_decode = fused_decode;
+    return scan->decoded;
+}
+
+static int32_t decode_concurrent_step(const char *packet, uint64_t step, uint64_t tag, void *context)
+{
+    scan_context *scan = (scan_context*)context;
+    int32_t order = scan->order;
+    uint32_t x, njobs = 0;
+    int32_t y;
+    autocorrelation_cache *cache = reserve_autocorrelation_cache();
+    (void)tag;
+    if(cache != NULL) {
+        for(x = 0; x < ahp_xc_get_nlines(); x++) {
+            prepare_autocorrelation(&ahp_xc.autocorrelation_thread_args[x], NULL, x, packet, 0);
+            ahp_xc.autocorrelation_thread_args[x].cache = cache;
+        }
+        run_jobs(decode_autocorrelation_job, ahp_xc_get_nlines());
+    }
+    for(x = 0; x < get_npolytopes(scan->nlines, order); x++) {
+        if(step >= scan->counts[x])
+            continue;
+        int32_t *inputs = &scan->inputs[njobs*order];
+        double *lags = &scan->lags[njobs*order];
+        scan->positions[njobs] = 0;
+        for(y = 0; y < order; y++) {
+            uint32_t pos = get_line_index(scan->nlines, x, y);
+            inputs[y] = scan->lines[pos].index;
+            lags[y] = ahp_xc_get_current_channel_cross(inputs[y], packet) * ahp_xc_get_sampletime();
+            if(scan->positions[njobs] == 0)
+                scan->positions[njobs] = pos;
+        }
+        ahp_xc_sample *sample = (scan->correlations != NULL ? &scan->correlations[scan->decoded+njobs] : &scan->samples[njobs]);
+        prepare_crosscorrelation(&ahp_xc.crosscorrelation_thread_args[njobs], sample, ahp_xc_get_crosscorrelation_index(inputs, order), inputs, order, packet, lags);
+        ahp_xc.crosscorrelation_thread_args[njobs].cache = cache;
+        njobs++;
+    }
+    run_jobs(decode_crosscorrelation_job, njobs);
+    return deliver_block(scan, step, njobs);
+}
+
+static int32_t scan_concurrent_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nlines, scan_context *scan, uint32_t depth, int32_t *interrupt, double *percent)
+{
+    uint32_t x = 0;
+    uint32_t len = 0;
+    scan_pipeline pipeline;
+    for(x = 1; x < nlines; x++)
+        len = (scan_count(&lines[x]) > len ? scan_count(&lines[x]) : len);
+    if(start_pipeline(&pipeline, depth, decode_concurrent_step, scan, interrupt))
+        return -ENOMEM;
+    int32_t fused_decode = ahp_xc.fused_decode;
+    ahp_xc.fused_decode = 0;
+    ahp_xc_begin_commands();
+    for(x = 0; x < nlines; x++) {
+        if(ahp_xc_intensity_crosscorrelator_enabled())
+            ahp_xc_end_autocorrelation_scan(lines[x].index);
+        else
+            ahp_xc_end_crosscorrelation_scan(lines[x].index);
+        lines[x].cur_chan = lines[x].start;
+    }
+    for(x = 1; x < nlines; x++)
+        program_scan_line(&lines[x]);
+    for(x = 1; x < nlines; x++)
+        ahp_xc_start_crosscorrelation_scan(lines[x].index);
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    ahp_xc_end_commands();
+    flush_rx();
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
+    for(x = 0; x < len; x++) {
+        if(pipeline_stopped(&pipeline))
+            break;
+        if(pipeline_grab(&pipeline, x))
+            break;
+        (*percent) = 100.0 * (x + 1) / len;
+    }
+    ahp_xc_begin_commands();
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    for(x = 1; x < nlines; x++) {
+        lines[x].cur_chan = lines[x].start + (off_t)lines[x].step * (off_t)(len < scan_count(&lines[x]) ? len : scan_count(&lines[x]));
+        if(ahp_xc_intensity_crosscorrelator_enabled())
+            ahp_xc_end_autocorrelation_scan(lines[x].index);
+        else
+            ahp_xc_end_crosscorrelation_scan(lines[x].index);
+    }
+    ahp_xc_end_commands();
+    finish_pipeline(&pipeline);
+    ahp_xc.fused_decode = fused_decode;
+    return scan->decoded;
+}
+
+static int32_t run_crosscorrelation_scan(scan_context *scan, size_t size, uint32_t depth, int32_t *interrupt, double *percent)
+{
+    if(scan->concurrent)
+        return scan_concurrent_crosscorrelations(scan->lines, scan->nlines, scan, depth, interrupt, percent);
+    return scan_crosscorrelations(scan->lines, scan->nlines, scan, size, depth, interrupt, percent);
+}
+
+static int32_t ahp_xc_scan_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **crosscorrelations, int32_t *interrupt, double *percent)
+{
+    scan_context scan;
+    size_t size = 0;
+    memset(&scan, 0, sizeof(scan));
+    scan.order = ahp_xc_get_correlation_order();
+    scan.concurrent = ahp_xc.concurrent_scan;
+    int32_t s = prepare_crosscorrelation_scan(&scan, lines, nlines, &size);
+    if(s >= 0) {
+        scan.correlations = ahp_xc_alloc_samples(size, (unsigned int)ahp_xc_get_crosscorrelator_lagsize()*2-1);
+        s = (scan.correlations != NULL ? run_crosscorrelation_scan(&scan, size, 0, interrupt, percent) : -ENOMEM);
+    }
+    free_scan_context(&scan);
+    if(s < 0) {
+        ahp_xc_free_samples(size, scan.correlations);
+        return s;
+    }
+    *crosscorrelations = scan.correlations;
+    return s;
+}
+
+int32_t ahp_xc_scan_correlations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **correlations, int32_t *interrupt, double *percent)
+{
+    if(!ahp_xc.detected) return 0;
+    *correlations = NULL;
+    (*percent) = 0;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    if(nlines > ahp_xc_get_nlines())
+        nlines = ahp_xc_get_nlines();
+    if(ahp_xc_get_correlation_order() < 2)
+        return ahp_xc_scan_autocorrelations(lines, nlines, correlations, interrupt, percent);
+    else
+        return ahp_xc_scan_crosscorrelations(lines, nlines, correlations, interrupt, percent);
+}
+
+int32_t ahp_xc_scan_correlations_stream(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user_data, uint32_t depth, int32_t *interrupt, double *percent)
+{
+    if(!ahp_xc.detected) return 0;
+    int32_t no_interrupt = 0;
+    double no_percent = 0;
+    if(lines == NULL || callback == NULL)
+        return -EINVAL;
+    if(interrupt == NULL)
+        interrupt = &no_interrupt;
+    if(percent == NULL)
+        percent = &no_percent;
+    (*percent) = 0;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    if(nlines > ahp_xc_get_nlines())
+        nlines = ahp_xc_get_nlines();
+    scan_context scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.lines = lines;
+    scan.nlines = nlines;
+    scan.order = ahp_xc_get_correlation_order();
+    scan.callback = callback;
+    scan.user_data = user_data;
+    int32_t s = -ENOMEM;
+    if(scan.order < 2) {
+        scan.positions = (uint32_t*)xc_malloc(sizeof(uint32_t) * nlines);
+        scan.samples = ahp_xc_alloc_samples(nlines, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
+        if(scan.positions != NULL && scan.samples != NULL)
+            s = scan_autocorrelations(lines, nlines, &scan, depth, interrupt, percent);
+        ahp_xc_free_samples(nlines, scan.samples);
+    } else {
+        size_t size = 0;
+        scan.concurrent = ahp_xc.concurrent_scan;
+        s = prepare_crosscorrelation_scan(&scan, lines, nlines, &size);
+        if(s >= 0) {
+            uint32_t nblock = (uint32_t)s;
+            scan.samples = ahp_xc_alloc_samples(nblock, (unsigned int)ahp_xc_get_crosscorrelator_lagsize()*2-1);
+            s = (scan.samples != NULL ? run_crosscorrelation_scan(&scan, size, depth, interrupt, percent) : -ENOMEM);
+            ahp_xc_free_samples(nblock, scan.samples);
         }
-        wait_no_threads();
-        i++;
     }
-    free(data);
-    *autocorrelations = correlations;
+    free_scan_context(&scan);
     return s;
 }
 
-static void ahp_xc_end_crosscorrelation_scan(uint32_t index)
+static void decode_packet(uint64_t *counts, ahp_xc_sample *autocorrelations, ahp_xc_sample *crosscorrelations, ahp_xc_packet_planes *planes)
+{
+    uint32_t x = 0, y = 0;
+    const int64_t *decoded = frame_values(ahp_xc.buf, 0, ahp_xc_get_nlines());
+    if(decoded != NULL)
+        memcpy(counts, decoded, sizeof(uint64_t)*ahp_xc_get_nlines());
+    else
+        hex_decode(ahp_xc.buf + ahp_xc.layout.counts, ahp_xc.layout.field_len, (int64_t*)counts, ahp_xc_get_nlines(), 0, NULL);
+    for(x = 0; x < ahp_xc_get_nlines(); x++)
+        counts[x] = (counts[x] == 0 ? 1 : counts[x]);
+    int32_t order = ahp_xc.polytopes.order;
+    uint32_t nbaselines = ahp_xc.polytopes.npolytopes;
+    uint32_t ncross = 0, nauto = 0;
+    subscription_mask *mask = &ahp_xc.subscription;
+    autocorrelation_cache *cache = reserve_autocorrelation_cache();
+    for(x = 0; x < nbaselines; x++) {
+        if(baseline_masked(x))
+            continue;
+        thread_argument *arg = &ahp_xc.crosscorrelation_thread_args[ncross++];
+        int32_t *inputs = (int32_t*)ahp_xc_get_polytope_lines(x);
+        double *lags = &ahp_xc.polytopes.lags[x*order];
+        for(y = 0; y < (unsigned int)order; y++) {
+            ahp_xc.cross_channel[inputs[y]].cur_chan = ahp_xc_get_current_channel_cross(inputs[y], ahp_xc.buf) * ahp_xc_get_packettime();
+            lags[y] = (double)ahp_xc.cross_channel[inputs[y]].cur_chan;
+            if(mask->needed != NULL)
+                mask->needed[inputs[y]] = 1;
+        }
+        prepare_crosscorrelation(arg, (planes != NULL ? NULL : &crosscorrelations[x]), ahp_xc.polytopes.indexes[x], inputs, order, ahp_xc.buf, lags);
+        arg->planes = planes;
+        arg->row = x;
+        arg->cache = cache;
+    }
+    for(x = 0; x < ahp_xc_get_nlines(); x++) {
+        int32_t subscribed = !line_masked(x);
+        int32_t needed = (mask->needed != NULL && mask->needed[x]);
+        if(mask->needed != NULL)
+            mask->needed[x] = 0;
+        if(!subscribed && (cache == NULL || !needed))
+            continue;
+        thread_argument *arg = &ahp_xc.autocorrelation_thread_args[nauto++];
+        prepare_autocorrelation(arg, (planes != NULL || !subscribed ? NULL : &autocorrelations[x]), x, ahp_xc.buf, ahp_xc_get_current_channel_auto(x, ahp_xc.buf) * ahp_xc_get_packettime());
+        arg->planes = (subscribed ? planes : NULL);
+        arg->cache = cache;
+    }
+    mask->ncross = ncross;
+    if(cache != NULL) {
+        run_jobs(decode_autocorrelation_job, nauto);
+        run_jobs(decode_crosscorrelation_job, ncross);
+    } else
+        run_jobs(decode_packet_job, ncross + nauto);
+}
+
+int32_t ahp_xc_get_packet(ahp_xc_packet *packet)
+{
+    if(!ahp_xc.detected) return 0;
+    int32_t ret = 1;
+    if(packet == NULL) {
+        return -EINVAL;
+    }
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE) && !pthread_equal(pthread_self(), ahp_xc.acquisition.thread))
+        return -EBUSY;
+    if(pthread_mutex_trylock(((pthread_mutex_t*)packet->lock))) {
+        ret = -EBUSY;
+        goto end;
+    }
+    if(grab_packet(&packet->timestamp) < 0){
+        ret = -ENOENT;
+        goto end;
+    }
+    packet->buf = ahp_xc.buf;
+    decode_packet(packet->counts, packet->autocorrelations, packet->crosscorrelations, NULL);
+    ret = 0;
+end:
+    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
+    return ret;
+}
+
+int32_t ahp_xc_get_packet_planes(ahp_xc_packet_planes *packet)
+{
+    if(!ahp_xc.detected) return 0;
+    int32_t ret = 1;
+    if(packet == NULL) {
+        return -EINVAL;
+    }
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    if(packet->n_lines != ahp_xc_get_nlines() || packet->n_baselines < ahp_xc.polytopes.npolytopes ||
+       packet->auto_lag != ahp_xc_get_autocorrelator_lagsize() || packet->cross_lag != ahp_xc_get_crosscorrelator_lagsize()*2-1)
+        return -EINVAL;
+    if(pthread_mutex_trylock(((pthread_mutex_t*)packet->lock))) {
+        ret = -EBUSY;
+        goto end;
+    }
+    if(grab_packet(&packet->timestamp) < 0){
+        ret = -ENOENT;
+        goto end;
+    }
+    packet->buf = ahp_xc.buf;
+    decode_packet(packet->counts, NULL, NULL, packet);
+    ret = 0;
+end:
+    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
+    return ret;
+}
+
+int32_t ahp_xc_get_packet_counts(uint64_t *counts, double *timestamp)
+{
+    if(!ahp_xc.detected) return -ENOENT;
+    if(counts == NULL)
+        return -EINVAL;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    ahp_xc.validate_only = 1;
+    int32_t err = grab_packet(timestamp);
+    ahp_xc.validate_only = 0;
+    if(err < 0)
+        return -ENOENT;
+    hex_decode(ahp_xc.buf + ahp_xc.layout.counts, ahp_xc.layout.field_len, (int64_t*)counts, ahp_xc_get_nlines(), 0, NULL);
+    return 0;
+}
+
+int32_t ahp_xc_subscribe_line(uint32_t index, int32_t subscribe)
+{
+    if(!ahp_xc.detected) return -ENOENT;
+    if(index >= ahp_xc_get_nlines() || ahp_xc.subscription.lines == NULL)
+        return -EINVAL;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    set_masked(&ahp_xc.subscription.lines[index], !subscribe);
+    return 0;
+}
+
+int32_t ahp_xc_subscribe_baseline(uint32_t index, int32_t subscribe)
+{
+    if(!ahp_xc.detected) return -ENOENT;
+    if(index >= ahp_xc_get_nbaselines() || ahp_xc.subscription.baselines == NULL)
+        return -EINVAL;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    set_masked(&ahp_xc.subscription.baselines[index], !subscribe);
+    return 0;
+}
+
+int32_t ahp_xc_subscribe_all(int32_t subscribe)
 {
-    if(!ahp_xc.detected) return;
-    if(!ahp_xc_intensity_crosscorrelator_enabled())
-        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_CROSS);
-    else
-        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+    uint32_t x;
+    if(!ahp_xc.detected) return -ENOENT;
+    if(ahp_xc.subscription.lines == NULL)
+        return -EINVAL;
+    if(__atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    for(x = 0; x < ahp_xc_get_nlines(); x++)
+        set_masked(&ahp_xc.subscription.lines[x], !subscribe);
+    for(x = 0; x < ahp_xc_get_nbaselines(); x++)
+        set_masked(&ahp_xc.subscription.baselines[x], !subscribe);
+    return 0;
 }
 
-static void ahp_xc_start_crosscorrelation_scan(uint32_t index)
+int32_t ahp_xc_line_subscribed(uint32_t index)
 {
-    if(!ahp_xc.detected) return;
-    ahp_xc_end_crosscorrelation_scan(index);
-    int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags((flags|CAP_RESET_TIMESTAMP)&~(CAP_ENABLE|CAP_EXTRA_CMD));
-    if(!ahp_xc_intensity_crosscorrelator_enabled())
-        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_CROSS);
-    else
-        ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
-    ahp_xc_set_capture_flags(flags);
+    if(!ahp_xc.detected || index >= ahp_xc_get_nlines()) return 0;
+    return !line_masked(index);
 }
 
-static void *_get_crosscorrelation(void *o)
+int32_t ahp_xc_baseline_subscribed(uint32_t index)
 {
-    thread_argument *arg = (thread_argument*)o;
-    ahp_xc_sample *sample = arg->sample;
-    int32_t *indexes = arg->indexes;
-    int32_t index = arg->index;
-    uint32_t num_indexes = arg->order;
-    const char *data = arg->data;
-    uint32_t x, y;
-    int32_t n = ahp_xc_get_bps() / 4;
-    const char *packet = data;
-    sample->lag_size = (ahp_xc_get_crosscorrelator_lagsize()*2-1);
-    sample->lag = 0;
-    if(ahp_xc_intensity_crosscorrelator_enabled()) {
-        ahp_xc_sample **samples = (ahp_xc_sample**)malloc(sizeof(ahp_xc_sample*)*num_indexes);
-        for(y = 0; y < num_indexes; y++) {
-            samples[y] = ahp_xc_alloc_samples(1, ahp_xc_get_autocorrelator_lagsize());
-            ahp_xc_get_autocorrelation(samples[y], indexes[y], packet, ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime());
-        }
-        wait_no_threads();
-        for (y = 0; y < ahp_xc_get_autocorrelator_lagsize(); y++) {
-            sample->correlations[y].num_indexes = num_indexes;
-            sample->correlations[y].indexes = (int*)malloc(sizeof(int) * num_indexes);
-            sample->correlations[y].lags = (double*)malloc(sizeof(double) * num_indexes);
-            memcpy(sample->correlations[y].indexes, arg->indexes, sizeof(int)*num_indexes);
-            memcpy(sample->correlations[y].lags, arg->lags, sizeof(double)*num_indexes);
-            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime();
-            sample->correlations[y].counts = samples[0]->correlations[y].counts;
-            sample->correlations[y].magnitude = samples[0]->correlations[y].magnitude;
-            sample->correlations[y].phase = samples[0]->correlations[y].phase;
-            sample->correlations[y].real = samples[0]->correlations[y].real;
-            sample->correlations[y].imaginary = samples[0]->correlations[y].imaginary;
-            ahp_xc_free_samples(1, samples[0]);
-            for (x = 1; x < num_indexes; x++) {
-                sample->correlations[y].lag = samples[0]->lag+y*ahp_xc_get_sampletime();
-                sample->correlations[y].lags[x] = arg->lags[x];
-                sample->correlations[y].indexes[x] = arg->indexes[x];
-                sample->correlations[y].counts += samples[x]->correlations[y].counts;
-                sample->correlations[y].magnitude *= samples[x]->correlations[y].magnitude;
-                sample->correlations[y].phase += samples[x]->correlations[y].phase;
-                ahp_xc_free_samples(1, samples[x]);
-            }
-            sample->correlations[y].counts /= num_indexes;
-            sample->correlations[y].magnitude = pow(sample->correlations[y].magnitude, 1.0/num_indexes);
-            sample->correlations[y].phase = fmod(sample->correlations[y].phase, M_PI*2.0);
-            sample->correlations[y].real = (long)(sin(sample->correlations[y].phase) * sample->correlations[y].magnitude);
-            sample->correlations[y].imaginary = (long)(cos(sample->correlations[y].phase) * sample->correlations[y].magnitude);
+    if(!ahp_xc.detected || index >= ahp_xc_get_nbaselines()) return 0;
+    return !baseline_masked(index);
+}
+
+static int32_t queue_init(packet_queue *queue, uint32_t size)
+{
+    uint64_t x, capacity = 2;
+    while(capacity < size)
+        capacity <<= 1;
+    queue->cells = (packet_cell*)xc_calloc(capacity, sizeof(packet_cell));
+    if(queue->cells == NULL)
+        return -ENOMEM;
+    for(x = 0; x < capacity; x++)
+        queue->cells[x].sequence = x;
+    queue->mask = capacity - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return 0;
+}
+
+static void queue_free(packet_queue *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+static int32_t queue_push(packet_queue *queue, ahp_xc_packet *packet)
+{
+    packet_cell *cell;
+    uint64_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while(1) {
+        cell = &queue->cells[pos & queue->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (int64_t)pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return -EAGAIN;
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
         }
-        free(samples);
-    } else {
-        char *subpacket = (char*)malloc(n+1);
-        memset(subpacket, 0, n+1);
-        packet += ahp_xc.header_len;
-        uint64_t counts = 0;
-        for(y = 0; y < num_indexes; y++) {
-            memcpy(subpacket, &packet[indexes[y]*n], (unsigned int)n);
-            counts += strtoul(subpacket, NULL, 16)|1;
-        }
-        packet += n*ahp_xc_get_nlines();
-        packet += n*ahp_xc_get_autocorrelator_lagsize()*ahp_xc_get_nlines()*2;
-        packet += n*index*2;
-        for(y = 0; y < sample->lag_size; y++) {
-            sample->correlations[y].num_indexes = num_indexes;
-            if(sample->correlations[y].indexes == NULL)
-                sample->correlations[y].indexes = (int*)malloc(sizeof(int) * num_indexes);
-            if(sample->correlations[y].lags == NULL)
-                sample->correlations[y].lags = (double*)malloc(sizeof(double) * num_indexes);
-            memcpy(sample->correlations[y].indexes, arg->indexes, sizeof(int)*num_indexes);
-            memcpy(sample->correlations[y].lags, arg->lags, sizeof(double)*num_indexes);
-            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime();
-            sample->correlations[y].counts = counts;
-            memcpy(subpacket, packet, (unsigned int)n);
-            sscanf(subpacket, "%lX",  &sample->correlations[y].real);
-            if(sample->correlations[y].real >= sign) {
-                sample->correlations[y].real ^= fill;
-                sample->correlations[y].real ++;
-                sample->correlations[y].real = ~sample->correlations[y].real;
-                sample->correlations[y].real ++;
-            }
-            packet += n;
-            memcpy(subpacket, packet, (unsigned int)n);
-            sscanf(subpacket, "%lX",  &sample->correlations[y].imaginary);
-            if(sample->correlations[y].imaginary >= sign) {
-                sample->correlations[y].imaginary ^= fill;
-                sample->correlations[y].imaginary ++;
-                sample->correlations[y].imaginary = ~sample->correlations[y].imaginary;
-                sample->correlations[y].imaginary ++;
-            }
-            packet += n;
-            complex_phase_magnitude(&sample->correlations[y]);
+    }
+    cell->packet = packet;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int32_t queue_pop(packet_queue *queue, ahp_xc_packet **packet)
+{
+    packet_cell *cell;
+    uint64_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while(1) {
+        cell = &queue->cells[pos & queue->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return -EAGAIN;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *packet = cell->packet;
+    __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *acquisition_thread(void *arg)
+{
+    select_device((ahp_xc_device*)arg);
+    acquisition_state *acquisition = &ahp_xc.acquisition;
+    ahp_xc_packet *current = NULL;
+    ahp_xc_packet *next = NULL;
+    queue_pop(&acquisition->available, &current);
+    while(__atomic_load_n(&acquisition->running, __ATOMIC_ACQUIRE)) {
+        char *frame = current->buf;
+        if(ahp_xc_get_packet(current)) {
+            current->buf = frame;
+            continue;
+        }
+        memcpy(frame, ahp_xc.buf, ahp_xc_get_packetsize());
+        current->buf = frame;
+        if(queue_pop(&acquisition->available, &next)) {
+            __atomic_add_fetch(&acquisition->dropped, 1, __ATOMIC_RELAXED);
+            if(queue_pop(&acquisition->ready, &next))
+                continue;
+        }
+        queue_push(&acquisition->ready, current);
+        current = next;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&acquisition->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&acquisition->mutex);
+            pthread_cond_broadcast(&acquisition->cond);
+            pthread_mutex_unlock(&acquisition->mutex);
         }
-        free(subpacket);
     }
-    if(ahp_xc.nthreads > 0)
-        ahp_xc.nthreads--;
+    queue_push(&acquisition->available, current);
+    pthread_mutex_lock(&acquisition->mutex);
+    pthread_cond_broadcast(&acquisition->cond);
+    pthread_mutex_unlock(&acquisition->mutex);
     return NULL;
 }
 
-void ahp_xc_get_crosscorrelation(ahp_xc_sample *sample, int32_t *indexes, int32_t order, const char *data, double *lags)
+static void free_acquisition()
 {
-    if(!ahp_xc.mutexes_initialized)
+    acquisition_state *acquisition = &ahp_xc.acquisition;
+    uint32_t x;
+    if(acquisition->packets != NULL) {
+        for(x = 0; x < acquisition->npackets; x++)
+            ahp_xc_free_packet(acquisition->packets[x]);
+    }
+    free(acquisition->packets);
+    free(acquisition->frames);
+    queue_free(&acquisition->ready);
+    queue_free(&acquisition->available);
+    acquisition->packets = NULL;
+    acquisition->frames = NULL;
+    acquisition->npackets = 0;
+}
+
+int32_t ahp_xc_start_acquisition(uint32_t npackets)
+{
+    acquisition_state *acquisition = &ahp_xc.acquisition;
+    uint32_t x;
+    if(!ahp_xc.detected)
+        return -ENOENT;
+    if(acquisition->running)
+        return -EBUSY;
+    if(npackets < 1)
+        return -EINVAL;
+    npackets++;
+    acquisition->packets = (ahp_xc_packet**)xc_calloc(npackets, sizeof(ahp_xc_packet*));
+    acquisition->frames = (char*)xc_malloc((size_t)npackets * ahp_xc_get_packetsize());
+    if(acquisition->packets == NULL || acquisition->frames == NULL ||
+       queue_init(&acquisition->ready, npackets) || queue_init(&acquisition->available, npackets))
+        goto err_end;
+    for(x = 0; x < npackets; x++) {
+        acquisition->packets[x] = ahp_xc_alloc_packet();
+        if(acquisition->packets[x] == NULL)
+            goto err_end;
+        acquisition->npackets++;
+        acquisition->packets[x]->buf = &acquisition->frames[(size_t)x * ahp_xc_get_packetsize()];
+        queue_push(&acquisition->available, acquisition->packets[x]);
+    }
+    acquisition->dropped = 0;
+    acquisition->waiting = 0;
+    if(!acquisition->initialized) {
+        pthread_mutex_init(&acquisition->mutex, NULL);
+        pthread_cond_init(&acquisition->cond, NULL);
+        acquisition->initialized = 1;
+    }
+    __atomic_store_n(&acquisition->running, 1, __ATOMIC_RELEASE);
+    if(pthread_create(&acquisition->thread, NULL, acquisition_thread, xc_current_device)) {
+        __atomic_store_n(&acquisition->running, 0, __ATOMIC_RELEASE);
+        goto err_end;
+    }
+    return 0;
+err_end:
+    free_acquisition();
+    return -ENOMEM;
+}
+
+void ahp_xc_stop_acquisition()
+{
+    acquisition_state *acquisition = &ahp_xc.acquisition;
+    if(!__atomic_load_n(&acquisition->running, __ATOMIC_ACQUIRE))
         return;
-    int32_t index = ahp_xc_get_crosscorrelation_index(indexes, order);
-    ahp_xc.crosscorrelation_thread_args[index].sample = sample;
-    ahp_xc.crosscorrelation_thread_args[index].index = index;
-    ahp_xc.crosscorrelation_thread_args[index].indexes = indexes;
-    ahp_xc.crosscorrelation_thread_args[index].order = order;
-    ahp_xc.crosscorrelation_thread_args[index].data = data;
-    ahp_xc.crosscorrelation_thread_args[index].lags = lags;
-    _get_crosscorrelation(&ahp_xc.crosscorrelation_thread_args[index]);
+    __atomic_store_n(&acquisition->running, 0, __ATOMIC_RELEASE);
+    pthread_join(acquisition->thread, NULL);
+    free_acquisition();
 }
 
-static int compare_scan_request_asc(const void *a, const  void *b)
+int32_t ahp_xc_acquisition_running()
 {
-    return ((ahp_xc_scan_request*)a)->len / ((ahp_xc_scan_request*)a)->step < ((ahp_xc_scan_request*)b)->len / ((ahp_xc_scan_request*)b)->step? 1 : -1;
+    return __atomic_load_n(&ahp_xc.acquisition.running, __ATOMIC_ACQUIRE);
 }
 
-static int32_t ahp_xc_scan_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **crosscorrelations, int32_t *interrupt, double *percent)
+int32_t ahp_xc_dequeue_packet(ahp_xc_packet **packet, uint32_t timeout)
 {
-    if(!ahp_xc.detected) return 0;
-    size_t k = 0;
-    int i = 0;
-    int o = 0;
-    uint32_t x = 0;
-    int y = 0;
-    int z = 0;
-    int order = ahp_xc_get_correlation_order();
-    uint32_t n = ahp_xc_get_bps()/4;
-    *crosscorrelations = NULL;
-    qsort(lines, nlines, sizeof(ahp_xc_scan_request), &compare_scan_request_asc);
-    int32_t size = 1;
-    for(i = 0; i < order; i++) {
+    acquisition_state *acquisition = &ahp_xc.acquisition;
+    int32_t err = 0;
+    if(packet == NULL)
+        return -EINVAL;
+    if(!__atomic_load_n(&acquisition->running, __ATOMIC_ACQUIRE))
+        return -ENOENT;
+    if(!queue_pop(&acquisition->ready, packet))
+        return 0;
+    if(timeout == 0)
+        return -EAGAIN;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000000;
+    deadline.tv_nsec += (timeout % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000;
     }
-    int32_t *inputs = (int*)malloc(sizeof(int)*ahp_xc_get_correlation_order());
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    for(x = 0; x < get_npolytopes(nlines, order); x++) {
-        for(y = 0; y < order; y++) {
-            int index = get_line_index(nlines, x, y);
-            inputs[y] = lines[index].index;
-            if(ahp_xc_intensity_crosscorrelator_enabled()) {
-                ahp_xc_end_autocorrelation_scan(lines[index].index);
-            } else {
-                ahp_xc_end_crosscorrelation_scan(lines[index].index);
-            }
-            lines[index].cur_chan = lines[index].start;
-            size *= (lines[index].len / lines[index].step);
+    pthread_mutex_lock(&acquisition->mutex);
+    __atomic_add_fetch(&acquisition->waiting, 1, __ATOMIC_SEQ_CST);
+    while(queue_pop(&acquisition->ready, packet)) {
+        if(!__atomic_load_n(&acquisition->running, __ATOMIC_ACQUIRE)) {
+            err = -ENOENT;
+            break;
         }
-    }
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    char *buffer = (char*)malloc(ahp_xc_get_packetsize() * lines[0].len / lines[0].step);
-    ahp_xc_sample *correlations = ahp_xc_alloc_samples((unsigned int)size, (unsigned int)ahp_xc_get_crosscorrelator_lagsize());
-    char* sample = (char*)malloc((unsigned int)n+1);
-    sample[n] = 0;
-    (*percent) = 0;
-    o = 0;
-    while(o < size && !*interrupt) {
-        for(x = 0; x < get_npolytopes(nlines, order) && !*interrupt; x++) {
-            for(y = 1; y < order && !*interrupt; y++) {
-                int index = get_line_index(nlines, x, y);
-                if(lines[0].cur_chan >= lines[0].start + (off_t)lines[0].step * (off_t)lines[0].len)
-                    continue;
-                if(lines[index].cur_chan >= lines[index].start + (off_t)lines[index].step * (off_t)lines[index].len)
-                    continue;
-                int capture_flags = ahp_xc_get_capture_flags();
-                ahp_xc_set_capture_flags(capture_flags | CAP_EXTRA_CMD);
-                ahp_xc_select_input(index);
-                ahp_xc_send_command(CLEAR, SET_DELAY);
-                ahp_xc_set_capture_flags(capture_flags);
-                if(ahp_xc_intensity_crosscorrelator_enabled())
-                    ahp_xc_set_channel_auto(index, lines[0].start, lines[0].len, lines[0].step);
-                else
-                    ahp_xc_set_channel_cross(index, lines[0].start, lines[0].len, lines[0].step);
-
-                ahp_xc_start_crosscorrelation_scan(lines[0].index);
-                lines[index].cur_chan += lines[index].step;
-                int i = 0;
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                serial_flush_rx();
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
-                while(i < (int)(lines[0].len/lines[0].step)) {
-                    if(*interrupt)
-                        break;
-                    unsigned char *buf = (unsigned char*)malloc(ahp_xc_get_packetsize());
-                    serial_read((unsigned char*)buf, ahp_xc_get_packetsize());
-                    memcpy(buffer+i*ahp_xc_get_packetsize(), buf+1, ahp_xc_get_packetsize()-1);
-                    *((char*)buffer+i*ahp_xc_get_packetsize()+ahp_xc_get_packetsize()) = '\r';
-                    free(buf);
-                    (*percent) += 100.0 / size;
-                    i++;
-                }
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                if(ahp_xc_intensity_crosscorrelator_enabled()) {
-                    ahp_xc_end_autocorrelation_scan(lines[0].index);
-                } else {
-                    ahp_xc_end_crosscorrelation_scan(lines[0].index);
-                }
-                k = 0;
-                while(k < lines[0].len/lines[0].step) {
-                    if(*interrupt)
-                        break;
-                    char *packet = (char*)buffer+k*ahp_xc_get_packetsize();
-                    double *lags = (double*)malloc(sizeof(double)*order);
-                    for(z = 0; z < order && !*interrupt; z++)
-                        lags[z] = ahp_xc_get_current_channel_cross(lines[0].index, packet);
-                    ahp_xc_get_crosscorrelation(&correlations[o], inputs, order, packet, lags);
-                    free(lags);
-                    wait_no_threads();
-                    o++;
-                    k++;
-                }
-            }
+        if(pthread_cond_timedwait(&acquisition->cond, &acquisition->mutex, &deadline) == ETIMEDOUT) {
+            if(!queue_pop(&acquisition->ready, packet))
+                break;
+            err = -ETIMEDOUT;
+            break;
         }
     }
-    free(inputs);
-    free(buffer);
-    free(sample);
-    *crosscorrelations = correlations;
-    return o;
+    __atomic_sub_fetch(&acquisition->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&acquisition->mutex);
+    return err;
 }
 
-int32_t ahp_xc_scan_correlations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **correlations, int32_t *interrupt, double *percent)
+void ahp_xc_release_packet(ahp_xc_packet *packet)
 {
-    if(ahp_xc_get_correlation_order() < 2)
-        return ahp_xc_scan_autocorrelations(lines, nlines, correlations, interrupt, percent);
-    else
-        return ahp_xc_scan_crosscorrelations(lines, nlines, correlations, interrupt, percent);
+    if(packet != NULL && ahp_xc.acquisition.packets != NULL)
+        queue_push(&ahp_xc.acquisition.available, packet);
 }
 
-int32_t ahp_xc_get_packet(ahp_xc_packet *packet)
+uint64_t ahp_xc_get_dropped_packets()
 {
-    if(!ahp_xc.detected) return 0;
-    char *sample = NULL;
-    int32_t ret = 1;
-    uint32_t x = 0, y = 0;
-    int32_t n = ahp_xc_get_bps()/4;
-    if(packet == NULL) {
+    return __atomic_load_n(&ahp_xc.acquisition.dropped, __ATOMIC_RELAXED);
+}
+
+int32_t ahp_xc_start_recording(const char *path, uint64_t segment_size)
+{
+    recording_state *recording = &ahp_xc.recording;
+    if(!ahp_xc.detected)
+        return -ENOENT;
+    if(path == NULL || ahp_xc.header_len >= (int32_t)sizeof(((recording_header*)NULL)->header))
         return -EINVAL;
+    if(recording->running || ahp_xc_acquisition_running())
+        return -EBUSY;
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    if(mkdir(path, 0755) && errno != EEXIST)
+        return -errno;
+    recording->path = strdup(path);
+    if(recording->path == NULL)
+        return -ENOMEM;
+    recording->segment_size = (segment_size > 0 ? segment_size : RECORDING_SEGMENT_SIZE);
+    recording->segment = 0;
+    recording->recorded = 0;
+    recording->fd = -1;
+    int32_t err = open_segment();
+    if(err) {
+        free(recording->path);
+        recording->path = NULL;
+        return err;
     }
-    if(pthread_mutex_trylock(((pthread_mutex_t*)packet->lock))) {
-        ret = -EBUSY;
-        goto end;
-    }
-    if(grab_packet(&packet->timestamp) < 0){
-        ret = -ENOENT;
-        goto end;
-    }
-    sample = (char*)malloc((unsigned int)n+1);
-    packet->buf = ahp_xc.buf;
-    const char *buf = packet->buf;
-    buf += ahp_xc.header_len;
-    for(x = 0; x < ahp_xc_get_nlines(); x++) {
-        sample[n] = 0;
-        memcpy(sample, buf, (unsigned int)n);
-        if(1<sscanf(sample, "%lX", &packet->counts[x])) {
-            ret = -ENOENT;
-            goto err_end;
-        }
-        packet->counts[x] = (packet->counts[x] == 0 ? 1 : packet->counts[x]);
-        buf += n;
+    recording->running = 1;
+    return 0;
+#endif
+}
+
+int32_t ahp_xc_stop_recording()
+{
+    recording_state *recording = &ahp_xc.recording;
+    if(ahp_xc_acquisition_running())
+        return -EBUSY;
+    close_segment();
+    free(recording->path);
+    recording->path = NULL;
+    recording->running = 0;
+    return 0;
+}
+
+int32_t ahp_xc_recording_running()
+{
+    return ahp_xc.recording.running;
+}
+
+uint64_t ahp_xc_get_recorded_packets()
+{
+    return __atomic_load_n(&ahp_xc.recording.recorded, __ATOMIC_RELAXED);
+}
+
+int64_t ahp_xc_recording_seek(const char *segment, double timestamp)
+{
+    if(segment == NULL)
+        return -EINVAL;
+#ifdef _WIN32
+    return -ENOSYS;
+#else
+    struct stat st;
+    int fd = open(segment, O_RDONLY);
+    if(fd < 0)
+        return -errno;
+    if(fstat(fd, &st)) {
+        close(fd);
+        return -errno;
     }
-    int32_t *inputs = (int*)malloc(sizeof(int)*ahp_xc_get_correlation_order());
-    double *lags = (double*)malloc(sizeof(double)*ahp_xc_get_correlation_order());
-    for(x = 0; x < ahp_xc_get_nbaselines(); x++) {
-        for(y = 0; y < (unsigned int)ahp_xc_get_correlation_order(); y++) {
-            inputs[y] = ahp_xc_get_line_index(x, y);
-            ahp_xc.cross_channel[inputs[y]].cur_chan = ahp_xc_get_current_channel_cross(inputs[y], ahp_xc.buf) * ahp_xc_get_packettime();
-            lags[y] = (double)ahp_xc.cross_channel[inputs[y]].cur_chan;
-        }
-        ahp_xc_get_crosscorrelation(&packet->crosscorrelations[x], inputs, ahp_xc_get_correlation_order(), ahp_xc.buf, lags);
+    char *map = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -errno;
+    int64_t offset = -EINVAL;
+    const recording_header *header = check_segment(map, (uint64_t)st.st_size);
+    if(header != NULL) {
+        uint64_t record = find_record(map, header, timestamp);
+        offset = (record < header->count ? (int64_t)(header->data_offset + record * header->record_size) : -ENOENT);
     }
-    free(inputs);
-    free(lags);
-    wait_no_threads();
-    for(x = 0; x < ahp_xc_get_nlines(); x++)
-        ahp_xc_get_autocorrelation(&packet->autocorrelations[x], x, ahp_xc.buf, ahp_xc_get_current_channel_auto(x, ahp_xc.buf) * ahp_xc_get_packettime());
-    wait_no_threads();
-    ret = 0;
-    goto free_end;
-err_end:
-    fprintf(stderr, "%s: %s\n", __func__, strerror(-ret));
-free_end:
-    free(sample);
-end:
-    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
-    return ret;
+    munmap(map, (size_t)st.st_size);
+    return offset;
+#endif
 }
 
 int32_t ahp_xc_get_properties()
@@ -1101,86 +4492,106 @@ int32_t ahp_xc_get_properties()
             continue;
         ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_ENABLE);
         int len = 0;
-        char *n = (char*)malloc(2);
+        char *n = (char*)xc_malloc(2);
         char *buf = ahp_xc.buf;
         int xc_header_len = 0;
-        n = (char*)realloc(n, 3);
+        n = (char*)xc_realloc(n, 3);
         strncpy(n, buf, 2);
         n[2] = 0;
         int n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
-        n = (char*)realloc(n, len+1);
+        }
+        n = (char*)xc_realloc(n, len+1);
         buf += 2;
         strncpy(n, buf, len);
         n[len] = 0;
         n_read = sscanf(n, "%X", &_nlines);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
+        }
         xc_header_len += len + 2;
         _nlines++;
         buf += len;
-        n = (char*)realloc(n, 3);
+        n = (char*)xc_realloc(n, 3);
         strncpy(n, buf, 2);
         n[2] = 0;
         n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
-        n = (char*)realloc(n, len+1);
+        }
+        n = (char*)xc_realloc(n, len+1);
         buf += 2;
         strncpy(n, buf, len);
         n[len] = 0;
         n_read = sscanf(n, "%X", &_bps);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
+        }
         xc_header_len += len + 2;
         _bps++;
         buf += len;
-        n = (char*)realloc(n, 3);
+        n = (char*)xc_realloc(n, 3);
         strncpy(n, buf, 2);
         n[2] = 0;
         n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
-        n = (char*)realloc(n, len+1);
+        }
+        n = (char*)xc_realloc(n, len+1);
         buf += 2;
         strncpy(n, buf, len);
         n[len] = 0;
         n_read = sscanf(n, "%X", &_delaysize);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
+        }
         ahp_xc.delaysize_len = len;
         xc_header_len += len + 2;
         buf += len;
-        n = (char*)realloc(n, 3);
+        n = (char*)xc_realloc(n, 3);
         strncpy(n, buf, 2);
         n[2] = 0;
         n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
-        n = (char*)realloc(n, len+1);
+        }
+        n = (char*)xc_realloc(n, len+1);
         buf += 2;
         strncpy(n, buf, len);
         n[len] = 0;
         n_read = sscanf(n, "%X", &_auto_lagsize);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
+        }
         xc_header_len += len + 2;
         _auto_lagsize++;
         buf += len;
-        n = (char*)realloc(n, 3);
+        n = (char*)xc_realloc(n, 3);
         strncpy(n, buf, 2);
         n[2] = 0;
         n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
-        n = (char*)realloc(n, len+1);
+        }
+        n = (char*)xc_realloc(n, len+1);
         buf += 2;
         strncpy(n, buf, len);
         n[len] = 0;
         n_read = sscanf(n, "%X", &_cross_lagsize);
-        if(n_read < 1)
+        if(n_read < 1) {
+            free(n);
             return 1;
+        }
         xc_header_len += len + 2;
         _cross_lagsize++;
         buf += len;
@@ -1188,7 +4599,7 @@ int32_t ahp_xc_get_properties()
         if(n_read == 2) {
             xc_header_len += 6;
             ahp_xc.header_len = xc_header_len;
-            ahp_xc.header = (char*)realloc(ahp_xc.header, ahp_xc.header_len+1);
+            ahp_xc.header = (char*)xc_realloc(ahp_xc.header, ahp_xc.header_len+1);
             strncpy(ahp_xc.header, ahp_xc.buf, ahp_xc.header_len);
             ahp_xc.header[ahp_xc.header_len] = 0;
             ahp_xc.nlines = _nlines;
@@ -1203,23 +4614,28 @@ int32_t ahp_xc_get_properties()
                 ahp_xc.packetsize = ahp_xc.nlines*(ahp_xc.nlines+2)*ahp_xc.bps/4+ahp_xc.header_len+16+2+1;
             else
                 ahp_xc.packetsize = ahp_xc.nlines*3*ahp_xc.bps/4+ahp_xc.header_len+16+2+1;
+            alloc_buffers(ahp_xc.packetsize);
+            build_layout();
+            alloc_values();
+            build_polytopes(ahp_xc.correlation_order > 0 ? ahp_xc.correlation_order : 2);
             if(ahp_xc.leds == NULL)
-                ahp_xc.leds = (unsigned char*)malloc(ahp_xc.nlines);
+                ahp_xc.leds = (unsigned char*)xc_calloc(ahp_xc.nlines, 1);
             if(ahp_xc.test == NULL)
-                ahp_xc.test = (unsigned char*)malloc(ahp_xc.nlines);
+                ahp_xc.test = (unsigned char*)xc_calloc(ahp_xc.nlines, 1);
+            if(ahp_xc.shadow.lines == NULL)
+                ahp_xc.shadow.lines = (line_registers*)xc_calloc(ahp_xc.nlines, sizeof(line_registers));
+            if(ahp_xc.subscription.lines == NULL)
+                alloc_subscription();
             if(ahp_xc.autocorrelation_thread_args == NULL)
-                ahp_xc.autocorrelation_thread_args = (thread_argument *)malloc(sizeof(thread_argument)*ahp_xc.nlines);
+                ahp_xc.autocorrelation_thread_args = (thread_argument *)xc_malloc(sizeof(thread_argument)*ahp_xc.nlines);
             if(ahp_xc.crosscorrelation_thread_args == NULL)
-                ahp_xc.crosscorrelation_thread_args = (thread_argument *)malloc(sizeof(thread_argument)*ahp_xc.nlines);
-            if(ahp_xc.autocorrelation_threads == NULL)
-                ahp_xc.autocorrelation_threads = (pthread_t *)malloc(sizeof(pthread_t)*ahp_xc.nlines);
-            if(ahp_xc.crosscorrelation_threads == NULL)
-                ahp_xc.crosscorrelation_threads = (pthread_t *)malloc(sizeof(pthread_t)*ahp_xc.nlines);
+                ahp_xc.crosscorrelation_thread_args = (thread_argument *)xc_malloc(sizeof(thread_argument)*ahp_xc.nbaselines);
             if(ahp_xc.auto_channel == NULL)
-                ahp_xc.auto_channel = (ahp_xc_scan_request *)malloc(sizeof(ahp_xc_scan_request)*ahp_xc.nlines);
+                ahp_xc.auto_channel = (ahp_xc_scan_request *)xc_malloc(sizeof(ahp_xc_scan_request)*ahp_xc.nlines);
             if(ahp_xc.cross_channel == NULL)
-                ahp_xc.cross_channel = (ahp_xc_scan_request *)malloc(sizeof(ahp_xc_scan_request)*ahp_xc.nbaselines);
+                ahp_xc.cross_channel = (ahp_xc_scan_request *)xc_malloc(sizeof(ahp_xc_scan_request)*ahp_xc.nbaselines);
             ahp_xc.detected = 1;
+            free(n);
             break;
         }
         free(n);
@@ -1231,9 +4647,20 @@ int32_t ahp_xc_get_properties()
 int32_t ahp_xc_set_capture_flags(xc_capture_flags flags)
 {
     if(!ahp_xc.connected) return -ENOENT;
+    register_shadow *shadow = &ahp_xc.shadow;
     ahp_xc.max_lost_packets = 1;
+    ahp_xc_begin_commands();
+    if(shadow->capture_pending) {
+        if((shadow->known & REG_CAPTURE) && !((shadow->capture_flags ^ ahp_xc.capture_flags) & ~CAP_EXTRA_CMD)) {
+            shadow->capture_pending = 0;
+            shadow->saved++;
+        } else {
+            sync_capture_flags();
+        }
+    }
     ahp_xc.capture_flags = flags;
-    return (int)ahp_xc_send_command(ENABLE_CAPTURE, (unsigned char)ahp_xc.capture_flags);
+    shadow->capture_pending = 1;
+    return ahp_xc_end_commands();
 }
 
 xc_capture_flags ahp_xc_get_capture_flags()
@@ -1245,13 +4672,25 @@ xc_capture_flags ahp_xc_get_capture_flags()
 void ahp_xc_set_baudrate(baud_rate rate)
 {
     if(!ahp_xc.detected) return;
+    if((ahp_xc.shadow.known & REG_RATE) && ahp_xc.shadow.rate == rate) {
+        ahp_xc.shadow.saved++;
+        return;
+    }
     ahp_xc.rate = rate;
     int flags = ahp_xc_get_capture_flags();
+    ahp_xc_begin_commands();
     ahp_xc_set_capture_flags((xc_capture_flags)(flags&~CAP_EXTRA_CMD));
-    ahp_xc_send_command(SET_BAUD_RATE, (unsigned char)rate);
+    send_command(SET_BAUD_RATE, (unsigned char)rate);
     ahp_xc_set_capture_flags((xc_capture_flags)(flags));
+    ahp_xc_end_commands();
+    ahp_xc.shadow.rate = rate;
+    ahp_xc.shadow.known |= REG_RATE;
+    if(ahp_xc.replay.active)
+        return;
     serial_close();
     serial_connect(ahp_xc.comport, ahp_xc.baserate*pow(2, (int)ahp_xc.rate), "8N1");
+    if(ahp_xc.reader_thread_enabled)
+        serial_start_reader();
 }
 
 void ahp_xc_set_correlation_order(uint32_t order)
@@ -1263,17 +4702,27 @@ void ahp_xc_set_correlation_order(uint32_t order)
     if(order < 1)
         return;
     ahp_xc.correlation_order = order;
+    build_polytopes(order);
+    if((ahp_xc.shadow.known & REG_ORDER) && ahp_xc.shadow.order == order) {
+        ahp_xc.shadow.saved++;
+        return;
+    }
+    ahp_xc.shadow.order = order;
     order --;
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_EXTRA_CMD);
+    int flags = ahp_xc_get_capture_flags();
+    ahp_xc_begin_commands();
+    ahp_xc_set_capture_flags((xc_capture_flags)(flags|CAP_EXTRA_CMD));
     int len = (((int)log2(order) & ~3) + 4) / 4;
     if(len < 0) len = 1;
-    ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
-    ahp_xc_send_command(SET_BAUD_RATE, (unsigned char)(len&0xf));
+    send_command(CLEAR, SET_BAUD_RATE);
+    send_command(SET_BAUD_RATE, (unsigned char)(len&0xf));
     for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_BAUD_RATE, (unsigned char)(order&0xf));
+        send_command(SET_BAUD_RATE, (unsigned char)(order&0xf));
         order >>= 4;
     }
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
+    ahp_xc_set_capture_flags((xc_capture_flags)(flags&~CAP_EXTRA_CMD));
+    ahp_xc_end_commands();
+    ahp_xc.shadow.known |= REG_ORDER;
 }
 
 int32_t ahp_xc_get_correlation_order()
@@ -1299,150 +4748,45 @@ void ahp_xc_set_leds(uint32_t index, int32_t leds)
 {
     if(!ahp_xc.detected) return;
     ahp_xc.leds[index] = (unsigned char)leds;
-    ahp_xc_select_input(index);
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_LEDS, (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0)));
+    unsigned char lo = (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0));
     leds >>= 4;
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_LEDS, (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0)));
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
+    unsigned char hi = (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0));
+    line_registers *line = shadow_line(index);
+    write_line_register(index, SET_LEDS, REG_LEDS, line != NULL ? &line->leds : NULL, lo, hi, 0);
 }
 
 void ahp_xc_set_channel_cross(uint32_t index, off_t value, size_t size, size_t step)
 {
     if(!ahp_xc.detected) return;
-    int32_t idx = 0;
-    if(value+size >= ahp_xc_get_delaysize())
-        return;
-    ahp_xc.cross_channel[index].start = value;
-    ahp_xc.cross_channel[index].len = size;
-    ahp_xc.cross_channel[index].step = step;
-    int capture_flags = ahp_xc_get_capture_flags();
-    int flags = ahp_xc_get_test_flags(index)&~TEST_STEP;
-    int len = (((int)log2(step) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_set_test_flags(index, flags);
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_select_input(index);
-    ahp_xc_send_command(CLEAR, SET_DELAY);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(step&0xf));
-        step >>= 4;
-    }
-    len = (((int)log2(size) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x10);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(size&0xf));
-        size >>= 4;
-    }
-    len = (((int)log2(value) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x20);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(value&0xf));
-        value >>= 4;
-    }
-    ahp_xc_set_test_flags(index, flags|TEST_STEP);
-    ahp_xc_set_capture_flags(capture_flags);
+    write_channel_delays(index, value, size, step, 1, 0);
 }
 
 void ahp_xc_set_channel_auto(uint32_t index, off_t value, size_t size, size_t step)
 {
     if(!ahp_xc.detected) return;
-    int32_t idx = 0;
-    if(value+size >= ahp_xc_get_delaysize())
-        return;
-    ahp_xc.auto_channel[index].start = value;
-    ahp_xc.auto_channel[index].len = size;
-    ahp_xc.auto_channel[index].step = step;
-    int capture_flags = ahp_xc_get_capture_flags();
-    int flags = ahp_xc_get_test_flags(index)&~TEST_STEP;
-    int len = (((int)log2(step) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_set_test_flags(index, flags);
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_select_input(index);
-    ahp_xc_send_command(CLEAR, SET_DELAY);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(step&0xf));
-        step >>= 4;
-    }
-    len = (((int)log2(size) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x10);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(size&0xf));
-        size >>= 4;
-    }
-    len = (((int)log2(value) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x20);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(value&0xf));
-        value >>= 4;
-    }
-    ahp_xc_set_test_flags(index, flags|TEST_STEP);
-    ahp_xc_set_capture_flags(capture_flags);
+    write_channel_delays(index, value, size, step, 0, 0);
 }
 
 void ahp_xc_set_voltage(uint32_t index, unsigned char value)
 {
     if(!ahp_xc.detected) return;
-    ahp_xc_select_input(index);
     value = (unsigned char)(value < 0xff ? value : 0xff);
     ahp_xc.voltage = value;
-    int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_send_command(SET_VOLTAGE, (unsigned char)(ahp_xc.voltage&0xf));
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_VOLTAGE, (unsigned char)((ahp_xc.voltage>>4)&0xf));
-    ahp_xc_set_capture_flags(flags);
+    line_registers *line = shadow_line(index);
+    write_line_register(index, SET_VOLTAGE, REG_VOLTAGE, line != NULL ? &line->voltage : NULL, (unsigned char)(value&0xf), (unsigned char)((value>>4)&0xf), 1);
 }
 
 void ahp_xc_set_test_flags(uint32_t index, int32_t value)
 {
     if(!ahp_xc.detected) return;
-    ahp_xc_select_input(index);
     ahp_xc.test[index] = value;
-    int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_send_command(ENABLE_TEST, (unsigned char)(ahp_xc.test[index]&0xf));
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_send_command(ENABLE_TEST, (unsigned char)((ahp_xc.test[index]>>4)&0xf));
-    ahp_xc_set_capture_flags(flags);
-}
-
- int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value)
-{
-    if(!ahp_xc.connected) return -ENOENT;
-    int32_t err = 0;
-    unsigned char c = (unsigned char)(cmd|(value<<4));
-    serial_flush_tx();
-    perr("%02X ", c);
-    err |= serial_write(&c, 1);
-    return err;
+    line_registers *line = shadow_line(index);
+    write_line_register(index, ENABLE_TEST, REG_TEST, line != NULL ? &line->test : NULL, (unsigned char)(ahp_xc.test[index]&0xf), (unsigned char)((ahp_xc.test[index]>>4)&0xf), 1);
 }
 
 double* ahp_xc_get_2d_projection(double alt, double az, double *baseline)
 {
-    double* uv = (double*)malloc(sizeof(double)*3);
+    double* uv = (double*)xc_malloc(sizeof(double)*3);
     memset(uv, 0, sizeof(double)*3);
     az *= M_PI / 180.0;
     alt *= M_PI / 180.0;
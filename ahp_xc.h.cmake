@@ -221,9 +221,9 @@ int64_t real;
 int64_t imaginary;
 ///Pulses count
 uint64_t counts;
-///Magnitude of this sample
+///Magnitude of this sample, NAN until computed when lazy magnitude and phase is enabled
 double magnitude;
-///Phase of this sample
+///Phase of this sample, NAN until computed when lazy magnitude and phase is enabled
 double phase;
 } ahp_xc_correlation;
 
@@ -255,6 +255,28 @@ uint64_t lag_size;
 ahp_xc_correlation *correlations;
 } ahp_xc_sample;
 
+/**
+* \brief Block of samples decoded from one packet of a streaming scan
+*/
+typedef struct {
+///Scan step, the number of packets acquired before this one
+uint64_t step;
+///Number of samples in this block
+uint32_t count;
+///Position in the scan request array of the line swept to produce each sample
+const uint32_t *lines;
+///The decoded samples, owned by the library and valid until the callback returns
+ahp_xc_sample *samples;
+} ahp_xc_scan_block;
+
+/**
+* \brief Streaming scan callback, invoked once per decoded block
+* \param block The decoded block
+* \param user_data The pointer passed to ahp_xc_scan_correlations_stream
+* \return non-zero to stop the scan
+*/
+typedef int32_t (*ahp_xc_scan_callback)(const ahp_xc_scan_block *block, void *user_data);
+
 /**
 * \brief Packet structure
 */
@@ -285,6 +307,65 @@ void *lock;
 char* buf;
 } ahp_xc_packet;
 
+/**
+* \brief Structure-of-arrays packet structure
+* Each plane is a contiguous 64-byte aligned array indexed [line][lag] for the autocorrelations
+* and [baseline][lag] for the crosscorrelations, with auto_lag and cross_lag elements per row.
+*/
+typedef struct {
+///Timestamp of the packet (seconds)
+double timestamp;
+///Number of lines in this correlator
+uint64_t n_lines;
+///Total number of baselines obtainable
+uint64_t n_baselines;
+///Bandwidth inverse frequency
+uint64_t tau;
+///Bits capacity in each sample
+uint64_t bps;
+///Crosscorrelators channels per packet
+uint64_t cross_lag;
+///Autocorrelators channels per packet
+uint64_t auto_lag;
+///Counts in the current packet
+uint64_t* counts;
+///Autocorrelations I samples count plane
+int64_t* auto_real;
+///Autocorrelations Q samples count plane
+int64_t* auto_imaginary;
+///Autocorrelations pulses count plane
+uint64_t* auto_counts;
+///Autocorrelations magnitude plane
+double* auto_magnitude;
+///Autocorrelations phase plane
+double* auto_phase;
+///Time lag offset of each line
+double* auto_offsets;
+///Crosscorrelations I samples count plane
+int64_t* cross_real;
+///Crosscorrelations Q samples count plane
+int64_t* cross_imaginary;
+///Crosscorrelations pulses count plane
+uint64_t* cross_counts;
+///Crosscorrelations magnitude plane
+double* cross_magnitude;
+///Crosscorrelations phase plane
+double* cross_phase;
+///Time lag offset of each baseline
+double* cross_offsets;
+///Packet lock mutex
+void *lock;
+///Packet buffer string
+char* buf;
+///Planes storage
+void *planes;
+} ahp_xc_packet_planes;
+
+/**
+* \brief Opaque correlator context, each one drives its own device
+*/
+typedef struct ahp_xc_context ahp_xc_context;
+
 /**\}*/
 /**
  * \defgroup Utilities Utility functions
@@ -302,6 +383,7 @@ DLL_EXPORT double* ahp_xc_get_2d_projection(double alt, double az, double *basel
 
 /**
 * \brief Set or get the maximum number of concurrent threads
+* ahp_xc_get_packet decodes autocorrelations per line and crosscorrelations per baseline on a worker pool of value-1 threads plus the calling thread.
 * \param value If non-zero set the maximum numnber of threads to this value, otherwise just return the current value
 * \return Returns The maximum number of threads
 */DLL_EXPORT uint64_t ahp_xc_max_threads(uint64_t value);
@@ -312,6 +394,33 @@ DLL_EXPORT double* ahp_xc_get_2d_projection(double alt, double az, double *basel
 */
 /**\{*/
 
+/**
+* \brief Create a new correlator context
+* Every context has its own port, buffers, packet layout, worker pool and locks, so several correlators
+* can be acquired in parallel from one process. The functions of this library operate on the context
+* selected by the calling thread with ahp_xc_select, by default the one used before contexts were introduced.
+* \return Returns the new disconnected context or NULL if out of memory
+* \sa ahp_xc_select
+* \sa ahp_xc_close
+*/
+DLL_EXPORT ahp_xc_context *ahp_xc_open(void);
+
+/**
+* \brief Make the calling thread operate on a context
+* Threads started by the library inherit the context of the thread that started them.
+* \param context The context returned by ahp_xc_open, or NULL for the default context
+* \return Returns the context previously selected by the calling thread
+*/
+DLL_EXPORT ahp_xc_context *ahp_xc_select(ahp_xc_context *context);
+
+/**
+* \brief Disconnect a context and release its resources
+* The context must not be selected by any other thread, the calling thread falls back to the default context
+* if it had this one selected. The default context is only disconnected and emptied.
+* \param context The context returned by ahp_xc_open, or NULL for the default context
+*/
+DLL_EXPORT void ahp_xc_close(ahp_xc_context *context);
+
 /**
 * \brief Connect to a serial port
 * \param port The serial port name or filename
@@ -327,6 +436,45 @@ DLL_EXPORT int32_t ahp_xc_connect(const char *port);
 */
 DLL_EXPORT int32_t ahp_xc_connect_fd(int32_t fd);
 
+/**
+* \brief Connect to a recording made with ahp_xc_start_recording instead of a device
+* Recorded frames are fed to the same parsing and decoding as frames read from the serial port,
+* and the device geometry is taken from the recorded header. Commands are accepted and ignored.
+* To process a recording in parallel, connect one context per segment file.
+* \param path A segment file or a directory of segments, which are replayed in name order
+* \param speed 1 to release frames at the pace they were received, N for N times faster, 0 as fast as possible
+* \return Returns 0 on success or a negative error code
+* \sa ahp_xc_open
+* \sa ahp_xc_replay_running
+*/
+DLL_EXPORT int32_t ahp_xc_connect_replay(const char *path, double speed);
+
+/**
+* \brief Report whether recorded frames remain to be replayed
+* \return Returns non-zero while connected to a recording that has not reached its end
+*/
+DLL_EXPORT int32_t ahp_xc_replay_running(void);
+
+/**
+* \brief Get the number of frames replayed
+* \return Returns the number of recorded frames fed to the decoder since ahp_xc_connect_replay
+*/
+DLL_EXPORT uint64_t ahp_xc_get_replayed_packets(void);
+
+/**
+* \brief Enable the background reader thread
+* When enabled a thread drains the serial port into a receive ring as soon as data arrives,
+* and the packet and scan functions consume from the ring instead of polling the port.
+* \param enable set to non-zero to enable the reader thread
+*/
+DLL_EXPORT void ahp_xc_enable_reader_thread(int32_t enable);
+
+/**
+* \brief Return non-zero if the background reader thread is running
+* \return Returns non-zero if the reader thread is running
+*/
+DLL_EXPORT int32_t ahp_xc_reader_thread_enabled(void);
+
 /**
 * \brief Obtain the serial port file descriptor
 * \return The file descriptor of the stream
@@ -424,6 +572,13 @@ DLL_EXPORT uint32_t ahp_xc_get_nbaselines(void);
 */
 DLL_EXPORT int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order);
 
+/**
+* \brief Return the line indexes of a polytope of the current crosscorrelation order
+* \param idx The cross-correlation index of the polytope
+* \return Returns an array of ahp_xc_get_correlation_order() line indexes, or NULL if idx is out of range
+*/
+DLL_EXPORT const int32_t *ahp_xc_get_polytope_lines(uint32_t idx);
+
 /**
 * \brief Return the cross-correlation index of the polytopes correlating the lines array
 * \param idx The crosscorrelation indexes
@@ -487,6 +642,61 @@ DLL_EXPORT uint32_t ahp_xc_get_packetsize(void);
 */
 DLL_EXPORT void ahp_xc_enable_intensity_crosscorrelator(int32_t enable);
 
+/**
+* \brief Validate the checksum and decode the payload of each packet in a single pass
+* When disabled the checksum is verified first and the payload is decoded only if it matches.
+* \param enable set to non-zero to enable the fused decoder, enabled by default
+*/
+DLL_EXPORT void ahp_xc_enable_fused_decode(int32_t enable);
+
+/**
+* \brief Return non-zero if the fused checksum and decode pass is enabled
+* \return Returns non-zero if the fused decoder is enabled
+*/
+DLL_EXPORT int32_t ahp_xc_fused_decode_enabled(void);
+
+/**
+* \brief Sweep all the crosscorrelation scan lines at once
+* When enabled the longest scan request is used as a fixed reference and all the other lines are
+* swept concurrently, so a scan lasts as long as the longest window instead of the sum of all windows.
+* Baselines whose relative delay does not change during the sweep are skipped.
+* \param enable set to non-zero to enable concurrent scanning, disabled by default
+*/
+DLL_EXPORT void ahp_xc_enable_concurrent_scan(int32_t enable);
+
+/**
+* \brief Return non-zero if concurrent crosscorrelation scanning is enabled
+* \return Returns non-zero if concurrent scanning is enabled
+*/
+DLL_EXPORT int32_t ahp_xc_concurrent_scan_enabled(void);
+
+/**
+* \brief Approximate the phase of decoded samples with a polynomial
+* The magnitude is not affected, the absolute phase error is below 3e-8 radians.
+* \param enable set to non-zero to enable the fast phase approximation, disabled by default
+*/
+DLL_EXPORT void ahp_xc_enable_fast_phase_magnitude(int32_t enable);
+
+/**
+* \brief Return non-zero if the fast phase approximation is enabled
+* \return Returns non-zero if the fast phase approximation is enabled
+*/
+DLL_EXPORT int32_t ahp_xc_fast_phase_magnitude_enabled(void);
+
+/**
+* \brief Defer the magnitude and phase computation of decoded packets
+* When enabled the magnitude and phase of the decoded samples are set to NAN, call
+* ahp_xc_get_sample_phase_magnitude or ahp_xc_get_planes_phase_magnitude to compute them.
+* \param enable set to non-zero to enable lazy magnitude and phase, disabled by default
+*/
+DLL_EXPORT void ahp_xc_enable_lazy_phase_magnitude(int32_t enable);
+
+/**
+* \brief Return non-zero if lazy magnitude and phase computation is enabled
+* \return Returns non-zero if lazy magnitude and phase is enabled
+*/
+DLL_EXPORT int32_t ahp_xc_lazy_phase_magnitude_enabled(void);
+
 /**
 * \brief Return non-zero if intensity crosscorrelation was enabled
 * \return Returns non-zero if intensity crosscorrelation was enabled
@@ -547,6 +757,42 @@ DLL_EXPORT ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet);
 */
 DLL_EXPORT void ahp_xc_free_packet(ahp_xc_packet *packet);
 
+/**
+* \brief Allocate and return a structure-of-arrays packet
+* \return Returns a new ahp_xc_packet_planes structure pointer
+* \sa ahp_xc_get_packet_planes
+* \sa ahp_xc_free_packet_planes
+*/
+DLL_EXPORT ahp_xc_packet_planes *ahp_xc_alloc_packet_planes(void);
+
+/**
+* \brief Free a previously allocated structure-of-arrays packet
+* \param packet pointer to the ahp_xc_packet_planes structure to be freed
+*/
+DLL_EXPORT void ahp_xc_free_packet_planes(ahp_xc_packet_planes *packet);
+
+/**
+* \brief Set the number of freed packets kept for reuse by ahp_xc_alloc_packet
+* Packets passed to ahp_xc_free_packet are recycled while the cache is not full and are reused when
+* their geometry matches the connected device. The cache is emptied on ahp_xc_disconnect.
+* \param size The maximum number of cached packets, 0 disables the cache
+* \return Returns non-zero on error
+*/
+DLL_EXPORT int32_t ahp_xc_set_packet_cache_size(uint32_t size);
+
+/**
+* \brief Get the number of freed packets kept for reuse
+* \return Returns the maximum number of cached packets
+*/
+DLL_EXPORT uint32_t ahp_xc_get_packet_cache_size(void);
+
+/**
+* \brief Get the number of heap allocations made for the current context since it was opened
+* Sample this before and after a loop of ahp_xc_get_packet calls to check that the steady state does not allocate.
+* \return Returns the number of allocation calls issued
+*/
+DLL_EXPORT uint64_t ahp_xc_get_allocations(void);
+
 /**
 * \brief Allocate and return a samples array
 * \param nlines The Number of samples to be allocated.
@@ -595,6 +841,172 @@ DLL_EXPORT void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples);
 */
 DLL_EXPORT int32_t ahp_xc_get_packet(ahp_xc_packet *packet);
 
+/**
+* \brief Grab a data packet into a structure-of-arrays packet
+* \param packet The ahp_xc_packet_planes structure to be filled.
+* \return Returns non-zero on error
+* \sa ahp_xc_get_packet
+* \sa ahp_xc_alloc_packet_planes
+* \sa ahp_xc_free_packet_planes
+* \sa ahp_xc_packet_planes
+*/
+DLL_EXPORT int32_t ahp_xc_get_packet_planes(ahp_xc_packet_planes *packet);
+
+/**
+* \brief Compute the magnitude and phase of the lags of a sample not computed yet
+* \param sample The ahp_xc_sample decoded with lazy magnitude and phase enabled
+* \sa ahp_xc_enable_lazy_phase_magnitude
+*/
+DLL_EXPORT void ahp_xc_get_sample_phase_magnitude(ahp_xc_sample *sample);
+
+/**
+* \brief Compute the magnitude and phase planes of a packet where they were not computed yet
+* \param packet The ahp_xc_packet_planes decoded with lazy magnitude and phase enabled
+* \sa ahp_xc_enable_lazy_phase_magnitude
+*/
+DLL_EXPORT void ahp_xc_get_planes_phase_magnitude(ahp_xc_packet_planes *packet);
+
+/**
+* \brief Grab a data packet and decode only its pulse counts
+* The packet checksum is verified, the correlations are not parsed.
+* \param counts The array of ahp_xc_get_nlines() raw pulse counts to be filled.
+* \param timestamp Filled with the timestamp of the packet if not NULL.
+* \return Returns 0 on success or a negative error code
+* \sa ahp_xc_get_packet
+*/
+DLL_EXPORT int32_t ahp_xc_get_packet_counts(uint64_t *counts, double *timestamp);
+
+/**
+* \brief Select whether the autocorrelation of a line is decoded by ahp_xc_get_packet and ahp_xc_get_packet_planes
+* The samples of unsubscribed lines are left untouched. All lines and baselines are subscribed on connection.
+* \param index The line index
+* \param subscribe Non-zero to decode the line, zero to skip it
+* \return Returns 0 on success, -EINVAL if the index is out of range, -EBUSY while the acquisition thread runs
+*/
+DLL_EXPORT int32_t ahp_xc_subscribe_line(uint32_t index, int32_t subscribe);
+
+/**
+* \brief Select whether a crosscorrelation baseline is decoded by ahp_xc_get_packet and ahp_xc_get_packet_planes
+* The samples of unsubscribed baselines are left untouched.
+* \param index The baseline index in the crosscorrelations of the packet
+* \param subscribe Non-zero to decode the baseline, zero to skip it
+* \return Returns 0 on success, -EINVAL if the index is out of range, -EBUSY while the acquisition thread runs
+*/
+DLL_EXPORT int32_t ahp_xc_subscribe_baseline(uint32_t index, int32_t subscribe);
+
+/**
+* \brief Subscribe or unsubscribe all the lines and baselines at once
+* \param subscribe Non-zero to decode everything, zero to decode only the pulse counts
+* \return Returns 0 on success, -EBUSY while the acquisition thread runs
+*/
+DLL_EXPORT int32_t ahp_xc_subscribe_all(int32_t subscribe);
+
+/**
+* \brief Return non-zero if the autocorrelation of a line is decoded
+* \param index The line index
+* \return Returns non-zero if the line is subscribed
+*/
+DLL_EXPORT int32_t ahp_xc_line_subscribed(uint32_t index);
+
+/**
+* \brief Return non-zero if a crosscorrelation baseline is decoded
+* \param index The baseline index
+* \return Returns non-zero if the baseline is subscribed
+*/
+DLL_EXPORT int32_t ahp_xc_baseline_subscribed(uint32_t index);
+
+/**
+* \brief Start the acquisition thread
+* A pool of npackets packets is allocated and an internal thread decodes packets into it,
+* queuing them for ahp_xc_dequeue_packet. When every pool packet is queued or held by consumers,
+* the oldest queued packet is overwritten and counted as dropped.
+* While the acquisition thread runs, ahp_xc_get_packet and ahp_xc_get_packet_planes return -EBUSY.
+* \param npackets The number of packets in the pool
+* \return Returns non-zero on error
+* \sa ahp_xc_stop_acquisition
+* \sa ahp_xc_dequeue_packet
+* \sa ahp_xc_release_packet
+*/
+DLL_EXPORT int32_t ahp_xc_start_acquisition(uint32_t npackets);
+
+/**
+* \brief Stop the acquisition thread and free its packet pool
+* Packets still held by consumers become invalid.
+* \sa ahp_xc_start_acquisition
+*/
+DLL_EXPORT void ahp_xc_stop_acquisition(void);
+
+/**
+* \brief Report whether the acquisition thread is running
+* \return Returns non-zero if the acquisition thread is running
+*/
+DLL_EXPORT int32_t ahp_xc_acquisition_running(void);
+
+/**
+* \brief Take the oldest decoded packet from the acquisition queue
+* The packet buffer holds a private copy of the packet frame.
+* Any number of threads can dequeue concurrently.
+* \param packet Will be set to the dequeued packet, which must be returned with ahp_xc_release_packet
+* \param timeout Maximum time to wait for a packet in microseconds, 0 to return immediately
+* \return Returns 0 on success, -EAGAIN or -ETIMEDOUT if no packet is available, -ENOENT if acquisition is not running
+* \sa ahp_xc_release_packet
+*/
+DLL_EXPORT int32_t ahp_xc_dequeue_packet(ahp_xc_packet **packet, uint32_t timeout);
+
+/**
+* \brief Return a dequeued packet to the acquisition pool
+* \param packet The packet obtained from ahp_xc_dequeue_packet
+*/
+DLL_EXPORT void ahp_xc_release_packet(ahp_xc_packet *packet);
+
+/**
+* \brief Get the number of decoded packets overwritten because no consumer took them in time
+* \return Returns the number of dropped packets since ahp_xc_start_acquisition
+*/
+DLL_EXPORT uint64_t ahp_xc_get_dropped_packets(void);
+
+/**
+* \brief Start recording every validated raw frame into memory-mapped segment files
+* Each segment holds the device header, a sparse timestamp index and fixed-size records made of
+* the host receive time, the device timestamp and the frame as received. Segments are named
+* segment-NNNNNN.xcr inside path, existing segments are never overwritten. A new segment is started
+* when the current one is full or the device timestamp goes back, e.g. after CAP_RESET_TIMESTAMP.
+* Frames are recorded from whichever call reads them, including the acquisition thread.
+* \param path The directory receiving the segments, created if missing
+* \param segment_size The size of each segment in bytes, 0 for 256 MiB
+* \return Returns 0 on success, -EBUSY if recording or the acquisition thread is running, -ENOSYS if not supported
+* \sa ahp_xc_stop_recording
+* \sa ahp_xc_recording_seek
+*/
+DLL_EXPORT int32_t ahp_xc_start_recording(const char *path, uint64_t segment_size);
+
+/**
+* \brief Stop recording and trim the last segment to its records
+* \return Returns 0 on success, -EBUSY if the acquisition thread is running
+*/
+DLL_EXPORT int32_t ahp_xc_stop_recording(void);
+
+/**
+* \brief Report whether frames are being recorded
+* \return Returns non-zero while recording, recording stops by itself if a segment cannot be created
+*/
+DLL_EXPORT int32_t ahp_xc_recording_running(void);
+
+/**
+* \brief Get the number of frames recorded
+* \return Returns the number of frames recorded since ahp_xc_start_recording
+*/
+DLL_EXPORT uint64_t ahp_xc_get_recorded_packets(void);
+
+/**
+* \brief Locate the first record of a segment not earlier than a device timestamp
+* The search takes O(log n) steps using the segment index, also while the segment is being recorded.
+* \param segment The segment file path
+* \param timestamp The device timestamp in seconds
+* \return Returns the file offset of the record, -ENOENT if every record is earlier, -EINVAL if the file is not a segment
+*/
+DLL_EXPORT int64_t ahp_xc_recording_seek(const char *segment, double timestamp);
+
 /**
 * \brief Scan all available delay channels and get the visibilities of the variety
 * \param lines the input lines structure array.
@@ -602,12 +1014,29 @@ DLL_EXPORT int32_t ahp_xc_get_packet(ahp_xc_packet *packet);
 * \param correlations An ahp_xc_sample array pointer, can be NULL. Will be allocated by reference and filled by this function.
 * \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
 * \param percent Like interrupt a variable, passed by reference that will be updated with the percent of completion.
-* \return Returns the number of channels scanned
+* \return Returns the number of channels scanned, or a negative error code if the scan could not start
 * \sa ahp_xc_get_delaysize
 * \sa ahp_xc_sample
 */
 DLL_EXPORT int32_t ahp_xc_scan_correlations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **correlations, int32_t *interrupt, double *percent);
 
+/**
+* \brief Scan all available delay channels, passing each decoded block to a callback as soon as it is ready
+* The callback runs on a decoding thread while the next packets are acquired. Up to depth packets are buffered,
+* when the callback is slower than the device the acquisition waits for it.
+* \param lines the input lines structure array.
+* \param nlines the element size of the input lines array.
+* \param callback The function receiving each decoded block, returning non-zero stops the scan.
+* \param user_data Pointer passed to the callback.
+* \param depth The number of packets to buffer between acquisition and decoding, 0 for the default.
+* \param interrupt Optional pointer to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
+* \param percent Optional pointer updated with the percent of completion.
+* \return Returns the number of samples delivered, or a negative error code if the scan could not start
+* \sa ahp_xc_scan_correlations
+* \sa ahp_xc_scan_block
+*/
+DLL_EXPORT int32_t ahp_xc_scan_correlations_stream(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user_data, uint32_t depth, int32_t *interrupt, double *percent);
+
 /**\}*/
 /**
  * \defgroup Cmds Commands and setup of the correlator
@@ -705,6 +1134,34 @@ DLL_EXPORT uint32_t ahp_xc_current_input();
 */
 DLL_EXPORT int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value);
 
+/**
+* \brief Start collecting commands into a batch
+* Commands sent until the matching ahp_xc_end_commands are queued and transmitted with a single serial write.
+* Batches can be nested, only the outermost ahp_xc_end_commands transmits.
+* \sa ahp_xc_end_commands
+*/
+DLL_EXPORT void ahp_xc_begin_commands(void);
+
+/**
+* \brief Close a command batch, transmitting the queued commands if it is the outermost one
+* \return non-zero on failure
+* \sa ahp_xc_begin_commands
+*/
+DLL_EXPORT int32_t ahp_xc_end_commands(void);
+
+/**
+* \brief Get the number of commands not transmitted because the device already held the requested value
+* The library shadows the registers written by the setters and only sends the nibbles that change.
+* \return The count of commands saved since the library was loaded
+*/
+DLL_EXPORT uint64_t ahp_xc_get_saved_commands(void);
+
+/**
+* \brief Forget the shadowed register state, the next setters will transmit their full command sequence
+* Call this when the device has been reset or configured outside of this library.
+*/
+DLL_EXPORT void ahp_xc_invalidate_registers(void);
+
 /**
 * \brief Obtain the current libahp-xc version
 * \return The current version code
@@ -0,0 +1,664 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Throughput benchmarks of the driver against the emulated device.
+* The library source is compiled into this translation unit so that the internal
+* checksum and decode kernels can be timed on their own, over canned packets.
+* Results are printed as JSON, one record per benchmark and device geometry.
+*/
+
+#include "ahp_xc.c"
+#include <time.h>
+#include <unistd.h>
+#include "ahp_xc_emulator.h"
+
+#define BENCH_MAX_VALUES 8
+#define BENCH_CANNED_PACKETS 64
+#define CHECK_RECORDED_PACKETS (RECORDING_INDEX_INTERVAL * 3)
+
+typedef struct {
+    uint32_t values[BENCH_MAX_VALUES];
+    uint32_t count;
+} bench_list;
+
+typedef struct {
+    bench_list nlines;
+    bench_list bps;
+    bench_list lagsize;
+    uint64_t decode_packets;
+    uint64_t serial_packets;
+    uint32_t scan_len;
+    FILE *out;
+    int32_t records;
+} bench_options;
+
+typedef struct {
+    char *packets;
+    uint32_t packetsize;
+    uint32_t count;
+    int64_t *values;
+} bench_canned;
+
+typedef void (*bench_decoder)(const char *, int32_t, int64_t *, size_t, int32_t, uint32_t *);
+
+static volatile uint64_t bench_sink;
+
+static double bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+static int32_t bench_parse_list(bench_list *list, const char *arg)
+{
+    char *end = NULL;
+    list->count = 0;
+    while(*arg && list->count < BENCH_MAX_VALUES) {
+        uint32_t value = (uint32_t)strtoul(arg, &end, 0);
+        if(end == arg || value == 0)
+            return -EINVAL;
+        list->values[list->count++] = value;
+        arg = end;
+        if(*arg == ',')
+            arg++;
+    }
+    return list->count > 0 ? 0 : -EINVAL;
+}
+
+static void bench_record(bench_options *options, ahp_xc_emulator_config *config, const char *benchmark, const char *variant, uint64_t packets, double seconds, int32_t err)
+{
+    FILE *out = options->out;
+    fprintf(out, "%s\n    {\"nlines\": %u, \"bps\": %u, \"auto_lagsize\": %u, \"cross_lagsize\": %u, \"packetsize\": %u, ",
+            options->records++ > 0 ? "," : "", config->nlines, config->bps, config->auto_lagsize, config->cross_lagsize,
+            ahp_xc_get_packetsize());
+    fprintf(out, "\"benchmark\": \"%s\", \"variant\": \"%s\", \"packets\": %llu, \"seconds\": %.6f, ",
+            benchmark, variant, (unsigned long long)packets, seconds);
+    if(packets > 0 && seconds > 0)
+        fprintf(out, "\"packets_per_second\": %.1f, \"ns_per_packet\": %.1f, ", packets / seconds, seconds * 1000000000.0 / packets);
+    else
+        fprintf(out, "\"packets_per_second\": null, \"ns_per_packet\": null, ");
+    fprintf(out, "\"error\": %d}", err);
+    fflush(out);
+}
+
+static int32_t bench_can_packets(ahp_xc_emulator *emulator, bench_canned *canned)
+{
+    uint32_t x;
+    canned->packetsize = ahp_xc_emulator_get_packetsize(emulator);
+    canned->count = BENCH_CANNED_PACKETS;
+    canned->packets = (char*)malloc((size_t)canned->packetsize * canned->count + 16);
+    canned->values = (int64_t*)malloc(sizeof(int64_t) * ahp_xc.layout.nvalues);
+    if(canned->packets == NULL || canned->values == NULL)
+        return -ENOMEM;
+    memset(canned->packets, 0, (size_t)canned->packetsize * canned->count + 16);
+    for(x = 0; x < canned->count; x++)
+        ahp_xc_emulator_build_packet(emulator, x, canned->packets + (size_t)x * canned->packetsize);
+    return 0;
+}
+
+static void bench_free_canned(bench_canned *canned)
+{
+    free(canned->packets);
+    free(canned->values);
+}
+
+static void bench_checksum(bench_options *options, ahp_xc_emulator_config *config, bench_canned *canned)
+{
+    uint64_t x;
+    int32_t err = 0;
+    double start = bench_now();
+    for(x = 0; x < options->decode_packets; x++)
+        err |= calc_checksum(canned->packets + (x % canned->count) * canned->packetsize);
+    bench_record(options, config, "checksum", "nibble_sum", options->decode_packets, bench_now() - start, err);
+}
+
+static void bench_decoder_run(bench_options *options, ahp_xc_emulator_config *config, bench_canned *canned, const char *variant, bench_decoder decoder)
+{
+    uint64_t x;
+    int32_t n = ahp_xc.layout.field_len;
+    int32_t nlines = ahp_xc.layout.auto_field;
+    uint32_t nvalues = ahp_xc.layout.nvalues;
+    double start = bench_now();
+    for(x = 0; x < options->decode_packets; x++) {
+        const char *payload = canned->packets + (x % canned->count) * canned->packetsize + ahp_xc.layout.counts;
+        decoder(payload, n, canned->values, nlines, 0, NULL);
+        decoder(payload + nlines * n, n, canned->values + nlines, nvalues - nlines, 1, NULL);
+        bench_sink += (uint64_t)canned->values[x % nvalues];
+    }
+    bench_record(options, config, "hex_decode", variant, options->decode_packets, bench_now() - start, 0);
+}
+
+static void bench_decode_frame(bench_options *options, ahp_xc_emulator_config *config, bench_canned *canned, int32_t fused)
+{
+    uint64_t x;
+    int32_t err = 0;
+    int32_t fused_decode = ahp_xc.fused_decode;
+    ahp_xc.fused_decode = fused;
+    double start = bench_now();
+    for(x = 0; x < options->decode_packets; x++)
+        err |= decode_frame(canned->packets + (x % canned->count) * canned->packetsize, canned->values);
+    bench_record(options, config, "decode_frame", fused ? "fused" : "separate", options->decode_packets, bench_now() - start, err);
+    ahp_xc.fused_decode = fused_decode;
+}
+
+static void bench_get_packet(bench_options *options, ahp_xc_emulator_config *config, int32_t counts_only)
+{
+    uint64_t x;
+    uint64_t received = 0;
+    int32_t err = 0;
+    uint64_t *counts = (uint64_t*)malloc(sizeof(uint64_t) * ahp_xc_get_nlines());
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    double timestamp = 0;
+    if(packet == NULL || counts == NULL) {
+        bench_record(options, config, counts_only ? "get_packet_counts" : "get_packet", "serial", 0, 0, -ENOMEM);
+        goto end;
+    }
+    ahp_xc_set_capture_flags(CAP_ENABLE|CAP_RESET_TIMESTAMP);
+    if(counts_only)
+        ahp_xc_get_packet_counts(counts, &timestamp);
+    else
+        ahp_xc_get_packet(packet);
+    double start = bench_now();
+    for(x = 0; x < options->serial_packets; x++) {
+        int32_t ret = counts_only ? ahp_xc_get_packet_counts(counts, &timestamp) : ahp_xc_get_packet(packet);
+        if(ret)
+            err = ret;
+        else
+            received++;
+    }
+    bench_record(options, config, counts_only ? "get_packet_counts" : "get_packet", "serial", received, bench_now() - start, err);
+    ahp_xc_set_capture_flags(CAP_NONE);
+end:
+    ahp_xc_free_packet(packet);
+    free(counts);
+}
+
+static void bench_scan(bench_options *options, ahp_xc_emulator_config *config, uint32_t order)
+{
+    uint32_t x;
+    uint32_t nlines = ahp_xc_get_nlines();
+    ahp_xc_scan_request *requests = (ahp_xc_scan_request*)calloc(nlines, sizeof(ahp_xc_scan_request));
+    ahp_xc_sample *samples = NULL;
+    int32_t interrupt = 0;
+    double percent = 0;
+    if(requests == NULL) {
+        bench_record(options, config, order > 1 ? "scan_cross" : "scan_auto", "serial", 0, 0, -ENOMEM);
+        return;
+    }
+    for(x = 0; x < nlines; x++) {
+        requests[x].index = x;
+        requests[x].start = 0;
+        requests[x].len = options->scan_len;
+        requests[x].step = 1;
+    }
+    ahp_xc_set_correlation_order(order);
+    double start = bench_now();
+    int32_t nsamples = ahp_xc_scan_correlations(requests, nlines, &samples, &interrupt, &percent);
+    double seconds = bench_now() - start;
+    bench_record(options, config, order > 1 ? "scan_cross" : "scan_auto", "serial", nsamples > 0 ? (uint64_t)nsamples : 0, seconds, nsamples < 0 ? nsamples : 0);
+    if(nsamples > 0)
+        ahp_xc_free_samples(nsamples, samples);
+    ahp_xc_set_correlation_order(1);
+    free(requests);
+}
+
+static ahp_xc_emulator *bench_open_device(ahp_xc_emulator_config *config)
+{
+    ahp_xc_emulator *emulator = ahp_xc_emulator_open(config);
+    if(emulator == NULL) {
+        fprintf(stderr, "cannot create an emulator for %u lines %u bps: %s\n", config->nlines, config->bps, strerror(errno));
+        return NULL;
+    }
+    int32_t fd = ahp_xc_emulator_get_fd(emulator);
+    if(fd < 0 || ahp_xc_emulator_start(emulator)) {
+        fprintf(stderr, "cannot start the emulator\n");
+        if(fd >= 0)
+            close(fd);
+        ahp_xc_emulator_close(emulator);
+        return NULL;
+    }
+    if(ahp_xc_connect_fd(fd)) {
+        fprintf(stderr, "the emulated device with %u lines %u bps was not detected\n", config->nlines, config->bps);
+        ahp_xc_emulator_stop(emulator);
+        ahp_xc_emulator_close(emulator);
+        return NULL;
+    }
+    return emulator;
+}
+
+static void bench_close_device(ahp_xc_emulator *emulator)
+{
+    ahp_xc_disconnect();
+    ahp_xc_emulator_stop(emulator);
+    ahp_xc_emulator_close(emulator);
+}
+
+static int32_t bench_geometry(bench_options *options, ahp_xc_emulator_config *config)
+{
+    bench_canned canned;
+    ahp_xc_emulator *emulator = bench_open_device(config);
+    if(emulator == NULL)
+        return 1;
+    memset(&canned, 0, sizeof(canned));
+    if(!bench_can_packets(emulator, &canned)) {
+        bench_checksum(options, config, &canned);
+        bench_decoder_run(options, config, &canned, "scalar", hex_decode_scalar);
+#if defined(__SSE2__)
+        bench_decoder_run(options, config, &canned, "sse2", hex_decode_sse2);
+#endif
+#ifdef HAVE_AVX2_DECODER
+        if(__builtin_cpu_supports("avx2"))
+            bench_decoder_run(options, config, &canned, "avx2", hex_decode_avx2);
+#endif
+        bench_decoder_run(options, config, &canned, "dispatch", hex_decode);
+        bench_decode_frame(options, config, &canned, 0);
+        bench_decode_frame(options, config, &canned, 1);
+    }
+    bench_get_packet(options, config, 0);
+    bench_get_packet(options, config, 1);
+    if(options->scan_len > 0 && options->scan_len < ahp_xc_get_delaysize()) {
+        bench_scan(options, config, 1);
+        bench_scan(options, config, 2);
+    }
+    bench_free_canned(&canned);
+    bench_close_device(emulator);
+    return 0;
+}
+
+static int32_t bench_geometries(bench_options *options, int32_t (*run)(bench_options *, ahp_xc_emulator_config *))
+{
+    uint32_t l, b, a;
+    int32_t failures = 0;
+    for(l = 0; l < options->nlines.count; l++) {
+        for(b = 0; b < options->bps.count; b++) {
+            for(a = 0; a < options->lagsize.count; a++) {
+                ahp_xc_emulator_config config;
+                ahp_xc_emulator_default_config(&config);
+                config.nlines = options->nlines.values[l];
+                config.bps = options->bps.values[b];
+                config.auto_lagsize = options->lagsize.values[a];
+                config.cross_lagsize = options->lagsize.values[a];
+                config.unthrottled = 1;
+                if(config.auto_lagsize * 2 > config.nlines + 1)
+                    continue;
+                failures += run(options, &config);
+            }
+        }
+    }
+    return failures;
+}
+
+/**
+* Reference decoder, the sscanf based parser the vector kernels replaced.
+*/
+static void check_reference_decode(const char *src, int32_t n, int64_t *dst, size_t count, int32_t is_signed, uint32_t *sum)
+{
+    char field[17];
+    unsigned long long value;
+    size_t x;
+    int32_t y;
+    for(x = 0; x < count; x++) {
+        memcpy(field, src, (size_t)n);
+        field[n] = 0;
+        sscanf(field, "%llX", &value);
+        dst[x] = (int64_t)value;
+        if(is_signed && dst[x] >= ahp_xc.sign) {
+            dst[x] ^= ahp_xc.fill;
+            dst[x] ++;
+            dst[x] = ~dst[x];
+            dst[x] ++;
+        }
+        if(sum != NULL) {
+            for(y = 0; y < n; y++)
+                *sum += src[y] < 'A' ? (uint32_t)(src[y] - '0') : (uint32_t)(src[y] - 'A' + 10);
+        }
+        src += n;
+    }
+}
+
+static int32_t check_decoder(const char *variant, bench_decoder decoder, const char *src, int32_t n, size_t count, const int64_t *expected, int64_t *values, int32_t is_signed, uint32_t expected_sum, int32_t with_sum)
+{
+    uint32_t sum = 0;
+    size_t x;
+    memset(values, 0xa5, sizeof(int64_t) * count);
+    decoder(src, n, values, count, is_signed, with_sum ? &sum : NULL);
+    for(x = 0; x < count; x++) {
+        if(values[x] != expected[x]) {
+            fprintf(stderr, "hex_decode %s: width %d count %zu %s field %zu: got %lld expected %lld\n", variant, n, count,
+                    is_signed ? "signed" : "unsigned", x, (long long)values[x], (long long)expected[x]);
+            return 1;
+        }
+    }
+    if(with_sum && sum != expected_sum) {
+        fprintf(stderr, "hex_decode %s: width %d count %zu %s checksum %u expected %u\n", variant, n, count,
+                is_signed ? "signed" : "unsigned", sum, expected_sum);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* Compare every hex_decode kernel with the reference parser, for all the field widths,
+* signed and unsigned fields, with and without checksum accumulation.
+*/
+static int32_t check_hex_decode(bench_options *options)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    const size_t max_count = 40;
+    char *src = (char*)malloc(16 * max_count + 16);
+    int64_t *expected = (int64_t*)malloc(sizeof(int64_t) * max_count);
+    int64_t *values = (int64_t*)malloc(sizeof(int64_t) * max_count);
+    uint32_t cases = 0;
+    int32_t failures = 0;
+    int32_t n, is_signed, with_sum, round;
+    size_t x, count;
+    if(src == NULL || expected == NULL || values == NULL) {
+        free(src);
+        free(expected);
+        free(values);
+        return 1;
+    }
+    srand(1);
+    for(n = 1; n <= 16; n++) {
+        for(count = 1; count <= max_count; count++) {
+            for(round = 0; round < 4; round++) {
+                for(x = 0; x < 16 * max_count + 16; x++)
+                    src[x] = digits[rand() % 16];
+                if(round == 1)
+                    memset(src, 'F', (size_t)n * count);
+                else if(round == 2)
+                    memset(src, '0', (size_t)n * count);
+                for(is_signed = 0; is_signed < 2; is_signed++) {
+                    for(with_sum = 0; with_sum < 2; with_sum++) {
+                        uint32_t expected_sum = 0;
+                        check_reference_decode(src, n, expected, count, is_signed, &expected_sum);
+                        failures += check_decoder("scalar", hex_decode_scalar, src, n, count, expected, values, is_signed, expected_sum, with_sum);
+#if defined(__SSE2__)
+                        failures += check_decoder("sse2", hex_decode_sse2, src, n, count, expected, values, is_signed, expected_sum, with_sum);
+#endif
+#ifdef HAVE_AVX2_DECODER
+                        if(__builtin_cpu_supports("avx2"))
+                            failures += check_decoder("avx2", hex_decode_avx2, src, n, count, expected, values, is_signed, expected_sum, with_sum);
+#endif
+                        failures += check_decoder("dispatch", hex_decode, src, n, count, expected, values, is_signed, expected_sum, with_sum);
+                        cases++;
+                    }
+                }
+            }
+        }
+    }
+    fprintf(options->out, "hex_decode: %u cases, %d failures\n", cases, failures);
+    free(src);
+    free(expected);
+    free(values);
+    return failures;
+}
+
+/**
+* Require the packet grabbing calls not to allocate once warmed up.
+*/
+static int32_t check_allocations(bench_options *options, ahp_xc_emulator_config *config)
+{
+    const char *names[3] = { "get_packet", "get_packet_planes", "get_packet_counts" };
+    const uint32_t warmup = 8;
+    int32_t failures = 0;
+    uint32_t mode;
+    uint64_t x;
+    ahp_xc_emulator *emulator = bench_open_device(config);
+    if(emulator == NULL)
+        return 1;
+    uint64_t *counts = (uint64_t*)malloc(sizeof(uint64_t) * ahp_xc_get_nlines());
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    ahp_xc_packet_planes *planes = ahp_xc_alloc_packet_planes();
+    double timestamp = 0;
+    if(counts == NULL || packet == NULL || planes == NULL) {
+        failures++;
+        goto end;
+    }
+    ahp_xc_set_capture_flags(CAP_ENABLE);
+    for(mode = 0; mode < 3; mode++) {
+        uint64_t received = 0;
+        uint64_t allocations = 0;
+        for(x = 0; x < warmup + options->serial_packets; x++) {
+            int32_t ret;
+            if(x == warmup)
+                allocations = ahp_xc_get_allocations();
+            if(mode == 0)
+                ret = ahp_xc_get_packet(packet);
+            else if(mode == 1)
+                ret = ahp_xc_get_packet_planes(planes);
+            else
+                ret = ahp_xc_get_packet_counts(counts, &timestamp);
+            if(!ret && x >= warmup)
+                received++;
+        }
+        allocations = ahp_xc_get_allocations() - allocations;
+        fprintf(options->out, "%s: %u lines %u bps lag %u, %llu packets, %llu allocations\n", names[mode], config->nlines, config->bps,
+                config->auto_lagsize, (unsigned long long)received, (unsigned long long)allocations);
+        if(allocations > 0 || received == 0)
+            failures++;
+    }
+    ahp_xc_set_capture_flags(CAP_NONE);
+end:
+    ahp_xc_free_packet_planes(planes);
+    ahp_xc_free_packet(packet);
+    free(counts);
+    bench_close_device(emulator);
+    return failures;
+}
+
+static const recording_record *check_record(const char *map, const recording_header *header, uint64_t record)
+{
+    return (const recording_record*)(map + header->data_offset + record * header->record_size);
+}
+
+/**
+* Repeat one device timestamp over the records around the first index boundary of a segment, and its index entry.
+* \return Returns the first repeated record
+*/
+static uint64_t check_repeat_timestamp(char *map, recording_header *header)
+{
+    uint64_t first = header->index_interval - 4;
+    uint64_t x;
+    double timestamp = check_record(map, header, first)->timestamp;
+    for(x = first; x <= header->index_interval + 4; x++)
+        ((recording_record*)check_record(map, header, x))->timestamp = timestamp;
+    ((recording_index*)(map + header->index_offset))[1].timestamp = timestamp;
+    return first;
+}
+
+static int32_t check_seek(const char *segment, const char *map, const recording_header *header, uint64_t repeated)
+{
+    int32_t failures = 0;
+    uint64_t x;
+    for(x = 0; x < header->count; x++) {
+        uint64_t first = (x >= repeated && x <= header->index_interval + 4 ? repeated : x);
+        int64_t offset = ahp_xc_recording_seek(segment, check_record(map, header, x)->timestamp);
+        if(offset != (int64_t)(header->data_offset + first * header->record_size))
+            failures++;
+    }
+    if(ahp_xc_recording_seek(segment, check_record(map, header, 0)->timestamp - 1) != (int64_t)header->data_offset)
+        failures++;
+    if(ahp_xc_recording_seek(segment, check_record(map, header, header->count - 1)->timestamp + 1) != -ENOENT)
+        failures++;
+    return failures;
+}
+
+static int32_t check_replay(const char *path, const char *map, const recording_header *header, uint64_t *replayed)
+{
+    int32_t failures = 0;
+    uint64_t x;
+    *replayed = 0;
+    if(ahp_xc_connect_replay(path, 0))
+        return 1;
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    for(x = 0; packet != NULL && x < header->count; x++) {
+        if(ahp_xc_get_packet(packet) || memcmp(ahp_xc.buf, check_record(map, header, x) + 1, header->packetsize - 1))
+            failures++;
+    }
+    if(packet == NULL || !ahp_xc_get_packet(packet) || ahp_xc_replay_running())
+        failures++;
+    *replayed = ahp_xc_get_replayed_packets();
+    ahp_xc_free_packet(packet);
+    ahp_xc_disconnect();
+    return failures + (*replayed != header->count);
+}
+
+/**
+* Record the emulated device, seek every record of the segment and replay it frame by frame.
+* A timestamp repeated across an index boundary must seek to its first record.
+*/
+static int32_t check_recording(bench_options *options, ahp_xc_emulator_config *config)
+{
+    char path[] = "/tmp/ahp_xc_bench_XXXXXX";
+    char segment[64];
+    int32_t failures = 0;
+    int32_t seek_failures = 0;
+    uint64_t x, replayed = 0;
+    struct stat st;
+    if(mkdtemp(path) == NULL) {
+        perror(path);
+        return 1;
+    }
+    ahp_xc_emulator *emulator = bench_open_device(config);
+    if(emulator == NULL) {
+        rmdir(path);
+        return 1;
+    }
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    if(packet != NULL && !ahp_xc_start_recording(path, 0)) {
+        ahp_xc_set_capture_flags(CAP_ENABLE);
+        for(x = 0; x < CHECK_RECORDED_PACKETS * 2 && ahp_xc_get_recorded_packets() < CHECK_RECORDED_PACKETS; x++)
+            ahp_xc_get_packet(packet);
+        ahp_xc_set_capture_flags(CAP_NONE);
+        ahp_xc_stop_recording();
+    }
+    ahp_xc_free_packet(packet);
+    bench_close_device(emulator);
+    snprintf(segment, sizeof(segment), "%s/segment-000000.xcr", path);
+    int fd = open(segment, O_RDWR);
+    char *map = MAP_FAILED;
+    if(fd >= 0 && !fstat(fd, &st))
+        map = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    recording_header *header = (map != MAP_FAILED ? (recording_header*)check_segment(map, (uint64_t)st.st_size) : NULL);
+    if(header == NULL || header->count < CHECK_RECORDED_PACKETS) {
+        fprintf(options->out, "recording: %u lines %u bps lag %u, no segment of %u records\n", config->nlines, config->bps,
+                config->auto_lagsize, CHECK_RECORDED_PACKETS);
+        failures++;
+    } else {
+        uint64_t repeated = check_repeat_timestamp(map, header);
+        seek_failures = check_seek(segment, map, header, repeated);
+        failures += seek_failures;
+        failures += check_replay(path, map, header, &replayed);
+        fprintf(options->out, "recording: %u lines %u bps lag %u, %llu records, %d wrong seeks, %llu replayed\n", config->nlines, config->bps,
+                config->auto_lagsize, (unsigned long long)header->count, seek_failures, (unsigned long long)replayed);
+    }
+    if(map != MAP_FAILED)
+        munmap(map, (size_t)st.st_size);
+    if(fd >= 0)
+        close(fd);
+    for(x = 0; snprintf(segment, sizeof(segment), "%s/segment-%06u.xcr", path, (uint32_t)x) > 0 && !unlink(segment); x++);
+    rmdir(path);
+    return failures;
+}
+
+static int32_t check(bench_options *options)
+{
+    int32_t failures = 0;
+    failures += check_hex_decode(options);
+    failures += bench_geometries(options, check_allocations);
+    failures += bench_geometries(options, check_recording);
+    fflush(options->out);
+    return failures;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+            "  -l lines       comma separated numbers of input lines (4,8,16)\n"
+            "  -b bps         comma separated bits per sample (16,24,32)\n"
+            "  -a lagsize     comma separated lag sizes of both correlators (1,4)\n"
+            "  -n count       canned packets per decode benchmark (100000)\n"
+            "  -p count       packets per serial benchmark (1000)\n"
+            "  -s len         channels per line in the scan benchmarks, 0 to skip them (16)\n"
+            "  -o file        write the JSON report to file instead of stdout\n"
+            "  -c             run the self checks instead of the benchmarks\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    int32_t self_check = 0;
+    int opt;
+    memset(&options, 0, sizeof(options));
+    bench_parse_list(&options.nlines, "4,8,16");
+    bench_parse_list(&options.bps, "16,24,32");
+    bench_parse_list(&options.lagsize, "1,4");
+    options.decode_packets = 100000;
+    options.serial_packets = 1000;
+    options.scan_len = 16;
+    options.out = stdout;
+    while((opt = getopt(argc, argv, "l:b:a:n:p:s:o:ch")) != -1) {
+        int32_t err = 0;
+        switch(opt) {
+            case 'l': err = bench_parse_list(&options.nlines, optarg); break;
+            case 'b': err = bench_parse_list(&options.bps, optarg); break;
+            case 'a': err = bench_parse_list(&options.lagsize, optarg); break;
+            case 'n': options.decode_packets = strtoull(optarg, NULL, 0); break;
+            case 'p': options.serial_packets = strtoull(optarg, NULL, 0); break;
+            case 's': options.scan_len = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': self_check = 1; break;
+            case 'o':
+                options.out = fopen(optarg, "w");
+                if(options.out == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+        if(err) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    ahp_set_debug_level(AHP_DEBUG_ERROR);
+    if(self_check) {
+        int32_t failures = check(&options);
+        if(options.out != stdout)
+            fclose(options.out);
+        return failures > 0 ? 1 : 0;
+    }
+#ifdef __OPTIMIZE__
+    const char *optimized = "true";
+#else
+    const char *optimized = "false";
+#endif
+    fprintf(options.out, "{\n  \"version\": \"0x%x\",\n  \"compiler\": \"%s\",\n  \"optimized\": %s,\n  \"results\": [",
+            AHP_XC_VERSION, __VERSION__, optimized);
+    bench_geometries(&options, bench_geometry);
+    fprintf(options.out, "\n  ]\n}\n");
+    fflush(options.out);
+    if(options.out != stdout)
+        fclose(options.out);
+    return 0;
+}
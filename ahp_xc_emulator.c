@@ -0,0 +1,513 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "ahp_xc_emulator.h"
+
+#define EMULATOR_SCAN_STEP 0
+#define EMULATOR_SCAN_SIZE 1
+#define EMULATOR_SCAN_START 2
+
+typedef struct {
+    uint32_t reg[3];
+    uint64_t origin;
+} emulator_delay;
+
+struct ahp_xc_emulator {
+    ahp_xc_emulator_config config;
+    int master;
+    int slave;
+    char port[64];
+    char header[64];
+    uint32_t header_len;
+    uint32_t packetsize;
+    uint32_t channel_len;
+
+    uint32_t capture_flags;
+    uint32_t index;
+    uint32_t baudrate;
+    uint32_t order;
+    unsigned char *test;
+    unsigned char *leds;
+    unsigned char *voltage;
+    emulator_delay *auto_delay;
+    emulator_delay *cross_delay;
+    int32_t sequence_len;
+    uint32_t sequence_count;
+    uint64_t sequence_value;
+
+    uint64_t number;
+    uint64_t next_due;
+    char *frame;
+    uint32_t frame_len;
+    uint32_t frame_off;
+    ahp_xc_emulator_stats stats;
+
+    pthread_t thread;
+    int32_t running;
+    int32_t stop;
+};
+
+static const char hex_digits[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t hex_length(uint64_t value)
+{
+    uint32_t len = 1;
+    while(value >>= 4)
+        len++;
+    return len;
+}
+
+static void put_hex(char *dst, uint64_t value, uint32_t len)
+{
+    while(len-- > 0) {
+        dst[len] = hex_digits[value & 0xf];
+        value >>= 4;
+    }
+}
+
+static uint32_t hex_value(char c)
+{
+    return (uint32_t)(c <= '9' ? c - '0' : c - 'A' + 10);
+}
+
+static uint32_t header_field(char *dst, uint64_t value)
+{
+    uint32_t len = hex_length(value);
+    put_hex(dst, len, 2);
+    put_hex(dst + 2, value, len);
+    return len + 2;
+}
+
+static void build_header(ahp_xc_emulator *emulator)
+{
+    ahp_xc_emulator_config *config = &emulator->config;
+    char *header = emulator->header;
+    uint32_t len = 0;
+    uint32_t n = config->bps / 4;
+    len += header_field(header + len, config->nlines - 1);
+    len += header_field(header + len, config->bps - 1);
+    emulator->channel_len = hex_length(config->delaysize);
+    len += header_field(header + len, config->delaysize);
+    len += header_field(header + len, config->auto_lagsize - 1);
+    len += header_field(header + len, config->cross_lagsize - 1);
+    put_hex(header + len, config->flags & 0xff, 2);
+    put_hex(header + len + 2, config->tau & 0xffff, 4);
+    len += 6;
+    header[len] = 0;
+    emulator->header_len = len;
+    if(config->flags & HAS_CROSSCORRELATOR)
+        emulator->packetsize = config->nlines * (config->nlines + 2) * n + len + 16 + 2 + 1;
+    else
+        emulator->packetsize = config->nlines * 3 * n + len + 16 + 2 + 1;
+}
+
+static uint64_t frame_time(ahp_xc_emulator *emulator)
+{
+    return (uint64_t)emulator->packetsize * 10 * 1000000000ULL / (emulator->baudrate > 0 ? emulator->baudrate : XC_BASE_RATE);
+}
+
+/**
+* Channel echoed by packet number of a line, the scan advances one step per packet sent
+* since it was enabled or its start register was last written.
+*/
+static uint32_t scan_channel(const emulator_delay *delay, int32_t scanning, uint64_t number)
+{
+    uint64_t step = delay->reg[EMULATOR_SCAN_STEP] > 0 ? delay->reg[EMULATOR_SCAN_STEP] : 1;
+    uint64_t size = delay->reg[EMULATOR_SCAN_SIZE] > 0 ? delay->reg[EMULATOR_SCAN_SIZE] : 1;
+    uint64_t steps = number > delay->origin ? number - delay->origin : 0;
+    if(!scanning)
+        return delay->reg[EMULATOR_SCAN_START];
+    return (uint32_t)(delay->reg[EMULATOR_SCAN_START] + (steps * step) % size);
+}
+
+uint32_t ahp_xc_emulator_build_packet(ahp_xc_emulator *emulator, uint64_t number, char *buf)
+{
+    ahp_xc_emulator_config *config = &emulator->config;
+    uint32_t size = emulator->packetsize;
+    uint32_t timestamp = size - 19;
+    uint32_t checksum = size - 3;
+    uint32_t cl = emulator->channel_len;
+    uint64_t state = config->seed ^ (number * 0xD1B54A32D192ED03ULL);
+    uint64_t ns = number * frame_time(emulator);
+    uint32_t x, y, sum = 0;
+    memcpy(buf, emulator->header, emulator->header_len);
+    for(x = emulator->header_len; x < timestamp; x += 16) {
+        uint64_t bits = splitmix64(&state);
+        for(y = 0; y < 16 && x + y < timestamp; y++, bits >>= 4)
+            buf[x + y] = hex_digits[bits & 0xf];
+    }
+    for(x = 0; x < config->nlines; x++) {
+        if(timestamp < cl * (1 + config->nlines + x) + emulator->header_len)
+            break;
+        put_hex(&buf[timestamp - cl * (1 + config->nlines + x)], scan_channel(&emulator->auto_delay[x], emulator->test[x] & SCAN_AUTO, number), cl);
+        put_hex(&buf[timestamp - cl * (1 + x)], scan_channel(&emulator->cross_delay[x], emulator->test[x] & SCAN_CROSS, number), cl);
+    }
+    put_hex(&buf[timestamp], ns >> 32, 8);
+    put_hex(&buf[timestamp + 8], ns & 0xffffffff, 8);
+    for(x = emulator->header_len; x < checksum; x++)
+        sum += hex_value(buf[x]);
+    put_hex(&buf[checksum], sum & 0xff, 2);
+    buf[size - 1] = '\r';
+    if(config->corrupt_every > 0 && (number + 1) % config->corrupt_every == 0) {
+        x = emulator->header_len + (uint32_t)(splitmix64(&state) % (checksum - emulator->header_len));
+        buf[x] = hex_digits[(hex_value(buf[x]) + 1) & 0xf];
+    }
+    return size;
+}
+
+uint32_t ahp_xc_emulator_get_packetsize(ahp_xc_emulator *emulator)
+{
+    return emulator->packetsize;
+}
+
+void ahp_xc_emulator_default_config(ahp_xc_emulator_config *config)
+{
+    memset(config, 0, sizeof(ahp_xc_emulator_config));
+    config->nlines = 8;
+    config->bps = 24;
+    config->delaysize = 4096;
+    config->auto_lagsize = 1;
+    config->cross_lagsize = 1;
+    config->flags = HAS_CROSSCORRELATOR | HAS_LEDS;
+    config->tau = 1000;
+    config->baudrate = XC_BASE_RATE;
+    config->seed = 1;
+}
+
+static int32_t sequence_nibble(ahp_xc_emulator *emulator, uint32_t value)
+{
+    if(emulator->sequence_len < 0) {
+        emulator->sequence_len = (int32_t)value;
+        emulator->sequence_count = 0;
+        emulator->sequence_value = 0;
+    } else if(emulator->sequence_count < (uint32_t)emulator->sequence_len) {
+        emulator->sequence_value |= (uint64_t)value << (4 * emulator->sequence_count++);
+    } else {
+        return 0;
+    }
+    return emulator->sequence_count == (uint32_t)emulator->sequence_len;
+}
+
+static void set_nibble(unsigned char *reg, uint32_t value, int32_t high)
+{
+    if(high)
+        *reg = (unsigned char)((*reg & 0x0f) | (value << 4));
+    else
+        *reg = (unsigned char)((*reg & 0xf0) | value);
+}
+
+static void emulator_command(ahp_xc_emulator *emulator, unsigned char c)
+{
+    uint32_t cmd = c & 0xf;
+    uint32_t value = c >> 4;
+    uint32_t index = emulator->index;
+    int32_t extra = (emulator->capture_flags & CAP_EXTRA_CMD) != 0;
+    uint32_t scanning;
+    __atomic_add_fetch(&emulator->stats.commands, 1, __ATOMIC_RELAXED);
+    switch(cmd) {
+        case CLEAR:
+            emulator->sequence_len = -1;
+            break;
+        case SET_INDEX:
+            if(sequence_nibble(emulator, value) && emulator->sequence_value < emulator->config.nlines)
+                emulator->index = (uint32_t)emulator->sequence_value;
+            break;
+        case SET_BAUD_RATE:
+            if(!extra)
+                emulator->baudrate = XC_BASE_RATE << value;
+            else if(sequence_nibble(emulator, value))
+                emulator->order = (uint32_t)emulator->sequence_value + 1;
+            break;
+        case SET_LEDS:
+            set_nibble(&emulator->leds[index], value, extra);
+            break;
+        case SET_VOLTAGE:
+            set_nibble(&emulator->voltage[index], value, extra);
+            break;
+        case ENABLE_TEST:
+            scanning = emulator->test[index];
+            set_nibble(&emulator->test[index], value, extra);
+            scanning = emulator->test[index] & ~scanning;
+            if(scanning & SCAN_AUTO)
+                emulator->auto_delay[index].origin = emulator->number;
+            if(scanning & SCAN_CROSS)
+                emulator->cross_delay[index].origin = emulator->number;
+            break;
+        case SET_DELAY:
+            if(sequence_nibble(emulator, value)) {
+                uint32_t reg = (emulator->test[index] >> 4) & 3;
+                emulator_delay *delay = extra ? &emulator->cross_delay[index] : &emulator->auto_delay[index];
+                if(reg <= EMULATOR_SCAN_START)
+                    delay->reg[reg] = (uint32_t)emulator->sequence_value;
+                if(reg == EMULATOR_SCAN_START)
+                    delay->origin = emulator->number;
+            }
+            break;
+        case ENABLE_CAPTURE:
+            if((value & CAP_ENABLE) && !(emulator->capture_flags & CAP_ENABLE)) {
+                if(value & CAP_RESET_TIMESTAMP) {
+                    emulator->number = 0;
+                    for(index = 0; index < emulator->config.nlines; index++) {
+                        emulator->auto_delay[index].origin = 0;
+                        emulator->cross_delay[index].origin = 0;
+                    }
+                }
+                emulator->next_due = monotonic_ns();
+            }
+            emulator->capture_flags = value;
+            break;
+        default:
+            break;
+    }
+}
+
+ahp_xc_emulator *ahp_xc_emulator_open(const ahp_xc_emulator_config *config)
+{
+    ahp_xc_emulator *emulator = (ahp_xc_emulator*)calloc(1, sizeof(ahp_xc_emulator));
+    if(emulator == NULL)
+        return NULL;
+    if(config != NULL)
+        emulator->config = *config;
+    else
+        ahp_xc_emulator_default_config(&emulator->config);
+    config = &emulator->config;
+    if(config->nlines < 2 || config->bps < 4 || config->bps % 4 || config->auto_lagsize < 1 || config->cross_lagsize < 1 || config->tau < 1) {
+        free(emulator);
+        errno = EINVAL;
+        return NULL;
+    }
+    emulator->master = -1;
+    emulator->slave = -1;
+    emulator->sequence_len = -1;
+    emulator->baudrate = config->baudrate;
+    emulator->order = 2;
+    build_header(emulator);
+    emulator->test = (unsigned char*)calloc(config->nlines, 3);
+    emulator->auto_delay = (emulator_delay*)calloc(config->nlines, sizeof(emulator_delay) * 2);
+    emulator->frame = (char*)malloc(emulator->packetsize);
+    if(emulator->test == NULL || emulator->auto_delay == NULL || emulator->frame == NULL)
+        goto err_end;
+    emulator->leds = emulator->test + config->nlines;
+    emulator->voltage = emulator->leds + config->nlines;
+    emulator->cross_delay = emulator->auto_delay + config->nlines;
+    emulator->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(emulator->master < 0 || grantpt(emulator->master) || unlockpt(emulator->master))
+        goto err_end;
+    const char *name = ptsname(emulator->master);
+    if(name == NULL || strncmp(name, "/dev/", 5))
+        goto err_end;
+    snprintf(emulator->port, sizeof(emulator->port), "%s", name + 5);
+    emulator->slave = open(name, O_RDWR | O_NOCTTY);
+    if(emulator->slave < 0)
+        goto err_end;
+    struct termios settings;
+    if(tcgetattr(emulator->slave, &settings) == 0) {
+        cfmakeraw(&settings);
+        tcsetattr(emulator->slave, TCSANOW, &settings);
+    }
+    fcntl(emulator->master, F_SETFL, fcntl(emulator->master, F_GETFL) | O_NONBLOCK);
+    return emulator;
+err_end:
+    ahp_xc_emulator_close(emulator);
+    if(errno == 0)
+        errno = ENODEV;
+    return NULL;
+}
+
+void ahp_xc_emulator_close(ahp_xc_emulator *emulator)
+{
+    if(emulator == NULL)
+        return;
+    ahp_xc_emulator_stop(emulator);
+    if(emulator->slave >= 0)
+        close(emulator->slave);
+    if(emulator->master >= 0)
+        close(emulator->master);
+    free(emulator->test);
+    free(emulator->auto_delay);
+    free(emulator->frame);
+    free(emulator);
+}
+
+const char *ahp_xc_emulator_get_port(ahp_xc_emulator *emulator)
+{
+    return emulator->port;
+}
+
+int32_t ahp_xc_emulator_get_fd(ahp_xc_emulator *emulator)
+{
+    char name[80];
+    snprintf(name, sizeof(name), "/dev/%s", emulator->port);
+    int fd = open(name, O_RDWR | O_NOCTTY);
+    return fd < 0 ? -errno : fd;
+}
+
+static int32_t write_frame(ahp_xc_emulator *emulator)
+{
+    while(emulator->frame_off < emulator->frame_len) {
+        ssize_t n = write(emulator->master, emulator->frame + emulator->frame_off, emulator->frame_len - emulator->frame_off);
+        if(n > 0) {
+            emulator->frame_off += (uint32_t)n;
+            continue;
+        }
+        if(n < 0 && errno != EAGAIN && errno != EINTR)
+            return -errno;
+        if(!emulator->config.unthrottled) {
+            __atomic_add_fetch(&emulator->stats.overruns, 1, __ATOMIC_RELAXED);
+            emulator->frame_off = emulator->frame_len;
+        }
+        break;
+    }
+    return 0;
+}
+
+static void next_frame(ahp_xc_emulator *emulator)
+{
+    ahp_xc_emulator_config *config = &emulator->config;
+    uint64_t number = emulator->number++;
+    if(config->drop_every > 0 && (number + 1) % config->drop_every == 0) {
+        __atomic_add_fetch(&emulator->stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    emulator->frame_len = ahp_xc_emulator_build_packet(emulator, number, emulator->frame);
+    emulator->frame_off = 0;
+    if(config->corrupt_every > 0 && (number + 1) % config->corrupt_every == 0)
+        __atomic_add_fetch(&emulator->stats.corrupted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&emulator->stats.packets, 1, __ATOMIC_RELAXED);
+}
+
+int32_t ahp_xc_emulator_run(ahp_xc_emulator *emulator, volatile int32_t *interrupt)
+{
+    ahp_xc_emulator_config *config = &emulator->config;
+    unsigned char commands[256];
+    int32_t err = 0;
+    emulator->next_due = monotonic_ns();
+    while(interrupt == NULL || !*interrupt) {
+        int32_t pending = emulator->frame_off < emulator->frame_len;
+        int32_t done = config->npackets > 0 && __atomic_load_n(&emulator->stats.packets, __ATOMIC_RELAXED) >= config->npackets;
+        int32_t capturing = (emulator->capture_flags & CAP_ENABLE) && !done;
+        int timeout = 100;
+        if(done && !pending)
+            break;
+        if(capturing && !pending && !config->unthrottled) {
+            uint64_t now = monotonic_ns();
+            timeout = emulator->next_due > now ? (int)((emulator->next_due - now + 999999) / 1000000) : 0;
+            if(timeout > 100)
+                timeout = 100;
+        } else if(capturing && !pending) {
+            timeout = 0;
+        }
+        struct pollfd pfd;
+        pfd.fd = emulator->master;
+        pfd.events = POLLIN | (pending && config->unthrottled ? POLLOUT : 0);
+        pfd.revents = 0;
+        if(poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+            return -errno;
+        if(pfd.revents & POLLIN) {
+            ssize_t n = read(emulator->master, commands, sizeof(commands));
+            ssize_t x;
+            for(x = 0; x < n; x++)
+                emulator_command(emulator, commands[x]);
+        }
+        if(!pending && capturing) {
+            uint64_t now = monotonic_ns();
+            if(config->unthrottled || now >= emulator->next_due) {
+                uint64_t period = frame_time(emulator);
+                emulator->next_due = (now - emulator->next_due > period ? now : emulator->next_due) + period;
+                next_frame(emulator);
+                pending = emulator->frame_off < emulator->frame_len;
+            }
+        }
+        if(pending) {
+            err = write_frame(emulator);
+            if(err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+static void *emulator_thread(void *arg)
+{
+    ahp_xc_emulator *emulator = (ahp_xc_emulator*)arg;
+    ahp_xc_emulator_run(emulator, &emulator->stop);
+    return NULL;
+}
+
+int32_t ahp_xc_emulator_start(ahp_xc_emulator *emulator)
+{
+    if(emulator->running)
+        return 0;
+    emulator->stop = 0;
+    if(pthread_create(&emulator->thread, NULL, emulator_thread, emulator))
+        return -EAGAIN;
+    emulator->running = 1;
+    return 0;
+}
+
+void ahp_xc_emulator_stop(ahp_xc_emulator *emulator)
+{
+    if(!emulator->running)
+        return;
+    __atomic_store_n(&emulator->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(emulator->thread, NULL);
+    emulator->running = 0;
+}
+
+void ahp_xc_emulator_get_stats(ahp_xc_emulator *emulator, ahp_xc_emulator_stats *stats)
+{
+    stats->packets = __atomic_load_n(&emulator->stats.packets, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&emulator->stats.dropped, __ATOMIC_RELAXED);
+    stats->corrupted = __atomic_load_n(&emulator->stats.corrupted, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&emulator->stats.overruns, __ATOMIC_RELAXED);
+    stats->commands = __atomic_load_n(&emulator->stats.commands, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,174 @@
+/**
+* \license
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AHP_XC_EMULATOR_H
+#define _AHP_XC_EMULATOR_H
+
+#include "ahp_xc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \defgroup Emulator XC device emulator
+ *
+ * A pseudo-terminal that answers like an XC correlator: it parses the command bytes sent by
+ * ahp_xc_send_command and streams header, payload and checksum packets as parsed by ahp_xc_get_properties.
+ * Payloads are pseudo-random and depend only on the seed and the packet number, so runs are reproducible.
+ *\{*/
+
+/**
+* \brief Emulated device configuration
+*/
+typedef struct {
+///Number of input lines
+uint32_t nlines;
+///Bits per sample, a multiple of 4
+uint32_t bps;
+///Number of delay channels
+uint32_t delaysize;
+///Live autocorrelator lag size reported in the header
+uint32_t auto_lagsize;
+///Live crosscorrelator lag size reported in the header
+uint32_t cross_lagsize;
+///Header flags, a combination of xc_header_flags
+uint32_t flags;
+///Clock tau in picoseconds
+uint32_t tau;
+///Initial baud rate, packets are paced at this rate until the driver changes it
+uint32_t baudrate;
+///Stream packets as fast as the reader consumes them instead of pacing them at the baud rate
+int32_t unthrottled;
+///Seed of the payload generator
+uint64_t seed;
+///Corrupt one payload digit every this number of packets, 0 to disable
+uint32_t corrupt_every;
+///Skip one packet every this number of packets, 0 to disable
+uint32_t drop_every;
+///Stop streaming after this number of packets, 0 for no limit
+uint64_t npackets;
+} ahp_xc_emulator_config;
+
+/**
+* \brief Emulator counters
+*/
+typedef struct {
+///Packets written to the port
+uint64_t packets;
+///Packets skipped on purpose
+uint64_t dropped;
+///Packets sent with a corrupted payload
+uint64_t corrupted;
+///Paced packets truncated because the reader did not keep up
+uint64_t overruns;
+///Command bytes received
+uint64_t commands;
+} ahp_xc_emulator_stats;
+
+/**
+* \brief Opaque emulator instance
+*/
+typedef struct ahp_xc_emulator ahp_xc_emulator;
+
+/**
+* \brief Fill a configuration with the defaults: 8 lines, 24 bps, 4096 delay channels, crosscorrelator and leds, 57600 baud
+* \param config The configuration to fill
+*/
+DLL_EXPORT void ahp_xc_emulator_default_config(ahp_xc_emulator_config *config);
+
+/**
+* \brief Create an emulator on a new pseudo-terminal
+* \param config The device configuration, NULL for the defaults
+* \return Returns the emulator or NULL on failure, with errno set
+*/
+DLL_EXPORT ahp_xc_emulator *ahp_xc_emulator_open(const ahp_xc_emulator_config *config);
+
+/**
+* \brief Stop and destroy an emulator, closing its pseudo-terminal
+* \param emulator The emulator
+*/
+DLL_EXPORT void ahp_xc_emulator_close(ahp_xc_emulator *emulator);
+
+/**
+* \brief Obtain the port name to pass to ahp_xc_connect, relative to /dev
+* \param emulator The emulator
+* \return Returns the port name
+*/
+DLL_EXPORT const char *ahp_xc_emulator_get_port(ahp_xc_emulator *emulator);
+
+/**
+* \brief Open a new descriptor of the driver side of the pseudo-terminal, to pass to ahp_xc_connect_fd
+* The caller owns the descriptor, ahp_xc_disconnect closes it.
+* \param emulator The emulator
+* \return Returns the file descriptor or a negative error code
+*/
+DLL_EXPORT int32_t ahp_xc_emulator_get_fd(ahp_xc_emulator *emulator);
+
+/**
+* \brief Serve commands and stream packets until stopped or npackets were sent
+* \param emulator The emulator
+* \param interrupt Set to non-zero from another thread or a signal handler to return, may be NULL
+* \return Returns 0 or a negative error code
+*/
+DLL_EXPORT int32_t ahp_xc_emulator_run(ahp_xc_emulator *emulator, volatile int32_t *interrupt);
+
+/**
+* \brief Run the emulator on a background thread
+* \param emulator The emulator
+* \return Returns 0 or a negative error code
+*/
+DLL_EXPORT int32_t ahp_xc_emulator_start(ahp_xc_emulator *emulator);
+
+/**
+* \brief Stop the background thread started with ahp_xc_emulator_start
+* \param emulator The emulator
+*/
+DLL_EXPORT void ahp_xc_emulator_stop(ahp_xc_emulator *emulator);
+
+/**
+* \brief Build one packet as the emulated device would send it, without sending it
+* Scan channels, corruption and timestamps follow the current device state.
+* \param emulator The emulator
+* \param number The packet number, which selects the payload and the timestamp
+* \param buf The destination buffer, at least ahp_xc_emulator_get_packetsize bytes
+* \return Returns the packet length including the trailing carriage return
+*/
+DLL_EXPORT uint32_t ahp_xc_emulator_build_packet(ahp_xc_emulator *emulator, uint64_t number, char *buf);
+
+/**
+* \brief Obtain the size of the packets streamed by the emulator
+* \param emulator The emulator
+* \return Returns the packet size, matching ahp_xc_get_packetsize once connected
+*/
+DLL_EXPORT uint32_t ahp_xc_emulator_get_packetsize(ahp_xc_emulator *emulator);
+
+/**
+* \brief Obtain the emulator counters
+* \param emulator The emulator
+* \param stats The counters
+*/
+DLL_EXPORT void ahp_xc_emulator_get_stats(ahp_xc_emulator *emulator, ahp_xc_emulator_stats *stats);
+
+/**\}*/
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif //_AHP_XC_EMULATOR_H
@@ -30,7 +30,9 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -60,6 +62,8 @@ extern "C" {
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
 #define LINUX
@@ -129,11 +133,18 @@ void ahp_print(int x, char* str)
         fprintf(err, "%s", str);
 }
 
+#ifndef WINDOWS
+#define ahp_localtime(t, tm) localtime_r(t, tm)
+#else
+#define ahp_localtime(t, tm) localtime_s(tm, t)
+#endif
+
 #define pdbg(x, ...) ({ \
 char str[500]; \
 struct timespec ts; \
 time_t t = time(NULL); \
-struct tm tm = *localtime(&t); \
+struct tm tm; \
+ahp_localtime(&t, &tm); \
 clock_gettime(CLOCK_REALTIME, &ts); \
 sprintf(str, "[%04d-%02d-%02dT%02d:%02d:%02d.%03ld ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec/1000000); \
 switch(x) { \
@@ -170,19 +181,240 @@ ahp_print(x, str); \
 #define pgarb(...) fprintf(stderr, __VA_ARGS__)
 #endif
 
-pthread_mutexattr_t ahp_serial_mutex_attr;
-pthread_mutex_t ahp_serial_mutex;
-int ahp_serial_mutexes_initialized = 0;
-int ahp_serial_baudrate = 230400;
-char ahp_serial_mode[4] = { 0, 0, 0, 0 };
-int ahp_serial_flowctrl = -1;
-int ahp_serial_fd = -1;
+///Size of the receive ring, must be a power of two
+#define AHP_SERIAL_RING_SIZE 0x100000
+
+typedef struct ahp_serial_port ahp_serial_port;
+
+typedef struct {
+    unsigned char buffer[AHP_SERIAL_RING_SIZE];
+    size_t head;
+    size_t tail;
+    int32_t waiting;
+    int32_t running;
+    ahp_serial_port *port;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ahp_serial_ring;
 
 #ifndef WINDOWS
-int ahp_serial_error = 0;
+typedef struct termios ahp_serial_settings;
+#else
+typedef DCB ahp_serial_settings;
+#endif
+
+/**
+* \brief State of one serial port, every port opened by the process has its own
+*/
+struct ahp_serial_port {
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutex_t mutex;
+    int mutexes_initialized;
+    int baudrate;
+    char mode[4];
+    int flowctrl;
+    int fd;
+    int error;
+    ahp_serial_ring *rx_ring;
+    ahp_serial_settings new_port_settings;
+    ahp_serial_settings old_port_settings;
+};
+
+ahp_serial_port ahp_serial_default_port = { .baudrate = 230400, .flowctrl = -1, .fd = -1 };
+
+///Port used by the serial functions called from this thread
+static __thread ahp_serial_port *ahp_serial_current_port = &ahp_serial_default_port;
+
+#define ahp_serial_mutex_attr (ahp_serial_current_port->mutex_attr)
+#define ahp_serial_mutex (ahp_serial_current_port->mutex)
+#define ahp_serial_mutexes_initialized (ahp_serial_current_port->mutexes_initialized)
+#define ahp_serial_baudrate (ahp_serial_current_port->baudrate)
+#define ahp_serial_mode (ahp_serial_current_port->mode)
+#define ahp_serial_flowctrl (ahp_serial_current_port->flowctrl)
+#define ahp_serial_fd (ahp_serial_current_port->fd)
+#define ahp_serial_error (ahp_serial_current_port->error)
+#define ahp_serial_rx_ring (ahp_serial_current_port->rx_ring)
+#define ahp_serial_new_port_settings (ahp_serial_current_port->new_port_settings)
+#define ahp_serial_old_port_settings (ahp_serial_current_port->old_port_settings)
 
-struct termios ahp_serial_new_port_settings, ahp_serial_old_port_settings;
+/**
+* \brief Allocate a closed serial port
+*/
+static ahp_serial_port *serial_alloc_port()
+{
+    ahp_serial_port *port = (ahp_serial_port*)calloc(1, sizeof(ahp_serial_port));
+    if(port == NULL)
+        return NULL;
+    port->baudrate = 230400;
+    port->flowctrl = -1;
+    port->fd = -1;
+    return port;
+}
+
+/**
+* \brief Make the serial functions called from this thread operate on port, return the previous one
+*/
+static ahp_serial_port *serial_select_port(ahp_serial_port *port)
+{
+    ahp_serial_port *previous = ahp_serial_current_port;
+    ahp_serial_current_port = (port != NULL ? port : &ahp_serial_default_port);
+    return previous;
+}
+
+static size_t serial_ring_available(ahp_serial_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
 
+static void serial_ring_drop(ahp_serial_ring *ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+static void *serial_reader_thread(void *arg)
+{
+    ahp_serial_ring *ring = (ahp_serial_ring*)arg;
+    serial_select_port(ring->port);
+    while(__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE)) {
+        size_t head = ring->head;
+        size_t space = AHP_SERIAL_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        if(space == 0) {
+            usleep(12000000/ahp_serial_baudrate);
+            continue;
+        }
+        size_t off = head & (AHP_SERIAL_RING_SIZE - 1);
+        size_t first = AHP_SERIAL_RING_SIZE - off;
+        if(first > space)
+            first = space;
+        ssize_t n = 0;
+#ifndef WINDOWS
+        struct pollfd pfd;
+        pfd.fd = ahp_serial_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, 100) < 1)
+            continue;
+        struct iovec iov[2];
+        iov[0].iov_base = ring->buffer + off;
+        iov[0].iov_len = first;
+        iov[1].iov_base = ring->buffer;
+        iov[1].iov_len = space - first;
+        n = readv(ahp_serial_fd, iov, space > first ? 2 : 1);
+        if(n < 1) {
+            if(n == 0 || (errno != EAGAIN && errno != EINTR))
+                usleep(12000000/ahp_serial_baudrate);
+            continue;
+        }
+#else
+        usleep(12000000/ahp_serial_baudrate);
+        n = read(ahp_serial_fd, ring->buffer + off, first);
+        if(n < 1)
+            continue;
+#endif
+        __atomic_store_n(&ring->head, head + (size_t)n, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&ring->mutex);
+            pthread_cond_broadcast(&ring->cond);
+            pthread_mutex_unlock(&ring->mutex);
+        }
+    }
+    return NULL;
+}
+
+/**
+* \brief Read from the receive ring, waiting at most timeout microseconds for at least min bytes
+*/
+static int serial_ring_read(ahp_serial_ring *ring, unsigned char *buf, int size, int min, long timeout)
+{
+    int nbytes = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000000;
+    deadline.tv_nsec += (timeout % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&ring->mutex);
+    while(nbytes < size) {
+        size_t avail = serial_ring_available(ring);
+        if(avail == 0) {
+            if(nbytes >= min || !__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE))
+                break;
+            int err = 0;
+            __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+            if(serial_ring_available(ring) == 0)
+                err = pthread_cond_timedwait(&ring->cond, &ring->mutex, &deadline);
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+            if(err == ETIMEDOUT)
+                break;
+            continue;
+        }
+        size_t len = (size_t)(size - nbytes) < avail ? (size_t)(size - nbytes) : avail;
+        size_t off = ring->tail & (AHP_SERIAL_RING_SIZE - 1);
+        size_t first = AHP_SERIAL_RING_SIZE - off;
+        if(first > len)
+            first = len;
+        memcpy(buf + nbytes, ring->buffer + off, first);
+        memcpy(buf + nbytes + first, ring->buffer, len - first);
+        __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+        nbytes += (int)len;
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    return nbytes;
+}
+
+DLL_EXPORT int serial_reader_running()
+{
+    return ahp_serial_rx_ring != NULL;
+}
+
+DLL_EXPORT int serial_start_reader()
+{
+    if(ahp_serial_rx_ring != NULL)
+        return 0;
+    if(ahp_serial_fd == -1)
+        return -ENODEV;
+    ahp_serial_ring *ring = (ahp_serial_ring*)malloc(sizeof(ahp_serial_ring));
+    if(ring == NULL)
+        return -ENOMEM;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+    ring->running = 1;
+    ring->port = ahp_serial_current_port;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    if(pthread_create(&ring->thread, NULL, serial_reader_thread, ring)) {
+        pthread_cond_destroy(&ring->cond);
+        pthread_mutex_destroy(&ring->mutex);
+        free(ring);
+        return -EAGAIN;
+    }
+    ahp_serial_rx_ring = ring;
+    return 0;
+}
+
+DLL_EXPORT void serial_stop_reader()
+{
+    ahp_serial_ring *ring = ahp_serial_rx_ring;
+    if(ring == NULL)
+        return;
+    __atomic_store_n(&ring->running, 0, __ATOMIC_SEQ_CST);
+    pthread_join(ring->thread, NULL);
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+    ahp_serial_rx_ring = NULL;
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring);
+}
+
+#ifndef WINDOWS
 DLL_EXPORT int ahp_serial_setup(int bauds, const char *m, int fc)
 {
     strcpy(ahp_serial_mode, m);
@@ -343,6 +575,8 @@ DLL_EXPORT int ahp_serial_setup(int bauds, const char *m, int fc)
 DLL_EXPORT void serial_flush_rx()
 {
     tcflush(ahp_serial_fd, TCIFLUSH);
+    if(ahp_serial_rx_ring != NULL)
+        serial_ring_drop(ahp_serial_rx_ring);
 }
 
 
@@ -352,14 +586,30 @@ DLL_EXPORT void serial_flush_tx()
 }
 
 
+DLL_EXPORT void serial_drain_tx()
+{
+    tcdrain(ahp_serial_fd);
+}
+
+
 DLL_EXPORT void serial_flush()
 {
     tcflush(ahp_serial_fd, TCIOFLUSH);
+    if(ahp_serial_rx_ring != NULL)
+        serial_ring_drop(ahp_serial_rx_ring);
 }
 
-#else
+DLL_EXPORT int serial_rx_pending()
+{
+    int n = 0;
+    if(ioctl(ahp_serial_fd, FIONREAD, &n) < 0)
+        n = 0;
+    if(ahp_serial_rx_ring != NULL)
+        n += (int)serial_ring_available(ahp_serial_rx_ring);
+    return n;
+}
 
-DCB ahp_serial_new_port_settings, ahp_serial_old_port_settings;
+#else
 
 DLL_EXPORT int ahp_serial_setup(int bauds, const char *m, int fc)
 {
@@ -467,6 +717,8 @@ DLL_EXPORT void serial_flush_rx()
 {
     HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
     PurgeComm(pHandle, PURGE_RXCLEAR | PURGE_RXABORT);
+    if(ahp_serial_rx_ring != NULL)
+        serial_ring_drop(ahp_serial_rx_ring);
 }
 
 
@@ -477,11 +729,33 @@ DLL_EXPORT void serial_flush_tx()
 }
 
 
+DLL_EXPORT void serial_drain_tx()
+{
+    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
+    FlushFileBuffers(pHandle);
+}
+
+
 DLL_EXPORT void serial_flush()
 {
     HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
     PurgeComm(pHandle, PURGE_RXCLEAR | PURGE_RXABORT);
     PurgeComm(pHandle, PURGE_TXCLEAR | PURGE_TXABORT);
+    if(ahp_serial_rx_ring != NULL)
+        serial_ring_drop(ahp_serial_rx_ring);
+}
+
+DLL_EXPORT int serial_rx_pending()
+{
+    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
+    DWORD errors = 0;
+    COMSTAT status;
+    int n = 0;
+    if(ClearCommError(pHandle, &errors, &status))
+        n = (int)status.cbInQue;
+    if(ahp_serial_rx_ring != NULL)
+        n += (int)serial_ring_available(ahp_serial_rx_ring);
+    return n;
 }
 
 #endif
@@ -519,6 +793,7 @@ DLL_EXPORT int serial_connect(const char* devname, int baudrate, const char *mod
 
 DLL_EXPORT void serial_close()
 {
+    serial_stop_reader();
     if(ahp_serial_fd != -1)
         close(ahp_serial_fd);
     if(ahp_serial_mutexes_initialized) {
@@ -542,6 +817,8 @@ DLL_EXPORT int serial_read(unsigned char *buf, int size)
     int bytes_left = size;
     errno = 0;
     memset(buf, 0, size);
+    if(ahp_serial_rx_ring != NULL)
+        return serial_ring_read(ahp_serial_rx_ring, buf, size, size, (long)ntries*12000000/ahp_serial_baudrate);
     if(ahp_serial_mutexes_initialized) {
         while(pthread_mutex_trylock(&ahp_serial_mutex))
             usleep(100);
@@ -559,6 +836,27 @@ DLL_EXPORT int serial_read(unsigned char *buf, int size)
     return nbytes;
 }
 
+DLL_EXPORT int serial_read_some(unsigned char *buf, int size)
+{
+    int n = 0;
+    int ntries = size*2;
+    errno = 0;
+    if(ahp_serial_rx_ring != NULL)
+        return serial_ring_read(ahp_serial_rx_ring, buf, size, 1, (long)ntries*12000000/ahp_serial_baudrate);
+    if(ahp_serial_mutexes_initialized) {
+        while(pthread_mutex_trylock(&ahp_serial_mutex))
+            usleep(100);
+        while(ntries-->0) {
+            n = read(ahp_serial_fd, buf, size);
+            if(n > 0)
+                break;
+            usleep(12000000/ahp_serial_baudrate);
+        }
+        pthread_mutex_unlock(&ahp_serial_mutex);
+    }
+    return n > 0 ? n : 0;
+}
+
 DLL_EXPORT int serial_write(unsigned char *buf, int size)
 {
     int n = -ENODEV;
@@ -0,0 +1,106 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "ahp_xc_emulator.h"
+
+static volatile int32_t interrupted = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+            "  -l lines       number of input lines (8)\n"
+            "  -b bps         bits per sample, a multiple of 4 (24)\n"
+            "  -d delaysize   number of delay channels (4096)\n"
+            "  -a lagsize     live autocorrelator lag size (1)\n"
+            "  -c lagsize     live crosscorrelator lag size (1)\n"
+            "  -f flags       header flags (3)\n"
+            "  -t tau         clock tau in picoseconds (1000)\n"
+            "  -r baudrate    initial baud rate (57600)\n"
+            "  -u             stream unthrottled instead of pacing at the baud rate\n"
+            "  -s seed        payload seed (1)\n"
+            "  -x n           corrupt one packet every n\n"
+            "  -k n           drop one packet every n\n"
+            "  -n count       exit after count packets\n"
+            "  -o file        also write the port name to file\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    ahp_xc_emulator_config config;
+    const char *portfile = NULL;
+    int opt;
+    ahp_xc_emulator_default_config(&config);
+    while((opt = getopt(argc, argv, "l:b:d:a:c:f:t:r:us:x:k:n:o:h")) != -1) {
+        switch(opt) {
+            case 'l': config.nlines = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'b': config.bps = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'd': config.delaysize = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'a': config.auto_lagsize = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': config.cross_lagsize = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'f': config.flags = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': config.tau = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'r': config.baudrate = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'u': config.unthrottled = 1; break;
+            case 's': config.seed = strtoull(optarg, NULL, 0); break;
+            case 'x': config.corrupt_every = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'k': config.drop_every = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'n': config.npackets = strtoull(optarg, NULL, 0); break;
+            case 'o': portfile = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    ahp_xc_emulator *emulator = ahp_xc_emulator_open(&config);
+    if(emulator == NULL) {
+        perror("ahp_xc_emulator_open");
+        return 1;
+    }
+    printf("%s\n", ahp_xc_emulator_get_port(emulator));
+    fflush(stdout);
+    if(portfile != NULL) {
+        FILE *f = fopen(portfile, "w");
+        if(f != NULL) {
+            fprintf(f, "%s\n", ahp_xc_emulator_get_port(emulator));
+            fclose(f);
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    int32_t err = ahp_xc_emulator_run(emulator, &interrupted);
+    ahp_xc_emulator_stats stats;
+    ahp_xc_emulator_get_stats(emulator, &stats);
+    fprintf(stderr, "packets %llu dropped %llu corrupted %llu overruns %llu commands %llu\n",
+            (unsigned long long)stats.packets, (unsigned long long)stats.dropped, (unsigned long long)stats.corrupted,
+            (unsigned long long)stats.overruns, (unsigned long long)stats.commands);
+    if(config.npackets > 0)
+        usleep(500000);
+    ahp_xc_emulator_close(emulator);
+    return err ? 1 : 0;
+}